@@ -0,0 +1,151 @@
+/*
+ * connection storm against rocksockserver: CONNS non-blocking connects
+ * are started at once, each sends a byte as soon as it's connected and
+ * is done when the server's reply arrived. compares the old one accept
+ * per round with listen backlog 10 to draining accepts with a large
+ * backlog, and TCP_DEFER_ACCEPT on top. "listen_drops" is the growth of
+ * the kernel's ListenDrops counter, connects that had their SYN dropped
+ * and retransmitted after a second or more, which shows in p99.
+ * connections not done after DEADLINE seconds count as "unfinished"
+ * and with DEADLINE as their latency.
+ *
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include "bench.h"
+#include "../rocksockserver.h"
+
+#define CONNS 1000
+#define DEADLINE 5.0
+
+static struct {
+	const char* name;
+	int backlog, accept_max, defer;
+} cfg, cfgs[] = {
+	{"one_per_round", 10, 1, 0},
+	{"drain", 10, 64, 0},
+	{"drain_backlog", 4096, 64, 0},
+	{"drain_backlog_defer", 4096, 64, 1},
+};
+static int port;
+static char sbuf[512];
+
+static int on_read(void* userdata, int fd, size_t n) {
+	send(fd, sbuf, 1, MSG_NOSIGNAL);
+	return 0;
+}
+
+static void server(int unused) {
+	rocksockserver srv;
+	if(rocksockserver_init(&srv, "127.0.0.1", port, 0) ||
+	   rocksockserver_set_backlog(&srv, cfg.backlog) ||
+	   (cfg.defer && rocksockserver_set_defer_accept(&srv, 5))) exit(1);
+	rocksockserver_set_backend(&srv, RS_SB_EPOLL);
+	rocksockserver_want_write(&srv, -1, 0);
+	rocksockserver_set_accept(&srv, cfg.accept_max, SOCK_CLOEXEC);
+	rocksockserver_loop(&srv, sbuf, sizeof sbuf, 0, on_read, 0, 0);
+}
+
+static long listen_drops(void) {
+	char line[4096], vals[4096], *k, *v, *ks, *vs;
+	long ret = -1;
+	FILE *f = fopen("/proc/net/netstat", "r");
+	if(!f) return -1;
+	while(ret == -1 && fgets(line, sizeof line, f) && fgets(vals, sizeof vals, f)) {
+		if(strncmp(line, "TcpExt:", 7)) continue;
+		k = strtok_r(line, " \n", &ks);
+		v = strtok_r(vals, " \n", &vs);
+		while((k = strtok_r(0, " \n", &ks)) && (v = strtok_r(0, " \n", &vs)))
+			if(!strcmp(k, "ListenDrops")) ret = atol(v);
+	}
+	fclose(f);
+	return ret;
+}
+
+static void run(void) {
+	static int fds[CONNS];
+	static double lat[CONNS], start[CONNS];
+	struct sockaddr_in sa = {.sin_family = AF_INET};
+	struct epoll_event ev[256];
+	int ep, i, n, done = 0, unfinished;
+	long drops;
+	double t;
+	char c;
+	pid_t pid;
+
+	close(bench_listen(&port));
+	pid = bench_fork(server, -1);
+	/* wait for the server to listen */
+	for(i = 0; i < 100; i++) {
+		int fd = socket(AF_INET, SOCK_STREAM, 0);
+		sa.sin_port = htons(port);
+		sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		n = connect(fd, (void*) &sa, sizeof sa);
+		close(fd);
+		if(!n) break;
+		usleep(10000);
+	}
+	if((ep = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	drops = listen_drops();
+	t = now();
+	for(i = 0; i < CONNS; i++) {
+		fds[i] = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+		start[i] = now();
+		if(connect(fds[i], (void*) &sa, sizeof sa) && errno != EINPROGRESS) {
+			perror("connect");
+			exit(1);
+		}
+		ev[0] = (struct epoll_event) {.events = EPOLLOUT, .data.u32 = i};
+		epoll_ctl(ep, EPOLL_CTL_ADD, fds[i], ev);
+	}
+	while(done < CONNS && now() - t < DEADLINE) {
+		if((n = epoll_wait(ep, ev, 256, 100)) == -1 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		while(n-- > 0) {
+			i = ev[n].data.u32;
+			if(ev[n].events & EPOLLOUT) {
+				/* connected */
+				send(fds[i], "x", 1, MSG_NOSIGNAL);
+				ev[n].events = EPOLLIN;
+				epoll_ctl(ep, EPOLL_CTL_MOD, fds[i], &ev[n]);
+			} else if(recv(fds[i], &c, 1, 0) == 1) {
+				lat[done++] = now() - start[i];
+				epoll_ctl(ep, EPOLL_CTL_DEL, fds[i], 0);
+				close(fds[i]);
+				fds[i] = -1;
+			} else {
+				dprintf(2, "accept: connection %d lost\n", i);
+				exit(1);
+			}
+		}
+	}
+	t = now() - t;
+	for(unfinished = 0; done < CONNS; unfinished++) lat[done++] = DEADLINE;
+	for(i = 0; i < CONNS; i++) if(fds[i] != -1) close(fds[i]);
+	drops = drops == -1 ? -1 : listen_drops() - drops;
+	printf("{\"bench\":\"accept\",\"mode\":\"%s\",\"backlog\":%d,\"accept_max\":%d,\"defer_accept\":%s,"
+	       "\"conns\":%d,\"unfinished\":%d,\"conns_per_s\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"listen_drops\":%ld}\n",
+	       cfg.name, cfg.backlog, cfg.accept_max, cfg.defer ? "true" : "false", CONNS, unfinished,
+	       (CONNS - unfinished) / t,
+	       percentile(lat, CONNS, 50) * 1e6, percentile(lat, CONNS, 99) * 1e6, drops);
+	close(ep);
+	bench_kill(pid);
+}
+
+int main(void) {
+	size_t i;
+	for(i = 0; i < sizeof(cfgs)/sizeof(cfgs[0]); i++) {
+		cfg = cfgs[i];
+		run();
+	}
+	return 0;
+}
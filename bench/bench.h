@@ -0,0 +1,84 @@
+/*
+ * helpers shared by the benchmarks. every benchmark prints one json
+ * object per line and measurement on stdout.
+ *
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../rocksock.h"
+
+static inline double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline void die(rocksock* s) {
+	rocksock_error_dprintf(2, s);
+	exit(1);
+}
+
+/* listens on an ephemeral loopback port */
+static inline int bench_listen(int* port) {
+	struct sockaddr_in sa = {.sin_family = AF_INET};
+	socklen_t sl = sizeof sa;
+	int fd;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if(fd == -1 || bind(fd, (void*) &sa, sizeof sa) || listen(fd, 1024) ||
+	   getsockname(fd, (void*) &sa, &sl)) {
+		perror("listen");
+		exit(1);
+	}
+	*port = ntohs(sa.sin_port);
+	return fd;
+}
+
+/* runs fn(lfd) in a child process, the listening socket is closed in the parent */
+static inline pid_t bench_fork(void (*fn)(int), int lfd) {
+	pid_t pid = fork();
+	if(pid == -1) {
+		perror("fork");
+		exit(1);
+	}
+	if(!pid) {
+		fn(lfd);
+		_exit(0);
+	}
+	close(lfd);
+	return pid;
+}
+
+static inline void bench_kill(pid_t pid) {
+	kill(pid, SIGKILL);
+	waitpid(pid, 0, 0);
+}
+
+static inline int cmp_double(const void* a, const void* b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+/* sorts v and returns the p-th percentile */
+static inline double percentile(double* v, size_t n, double p) {
+	size_t i;
+	qsort(v, n, sizeof(*v), cmp_double);
+	i = p / 100 * (n - 1) + 0.5;
+	return v[i];
+}
+
+#endif
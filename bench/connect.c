@@ -0,0 +1,215 @@
+/*
+ * connect rate and latency over loopback: direct connects one after
+ * another, direct connects with rocksock_multi keeping INFLIGHT in
+ * flight, and connects through chains of 1-3 socks4, socks5 or http
+ * proxies. the proxies are a stand-in forked off by the benchmark, one
+ * listener speaking all three protocols, so every hop costs a real tcp
+ * connect and handshake while the proxy itself stays cheap.
+ *
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#include <stdint.h>
+#include <poll.h>
+#include <netdb.h>
+#include <pthread.h>
+#include "bench.h"
+
+#define INFLIGHT 64
+
+static void target(int lfd) {
+	int fd;
+	while((fd = accept(lfd, 0, 0)) != -1) close(fd);
+}
+
+static int readn(int fd, void* buf, size_t n) {
+	return n && recv(fd, buf, n, MSG_WAITALL) != (ssize_t) n ? -1 : 0;
+}
+
+/* reads a nul terminated string */
+static int readz(int fd, char* buf, size_t size) {
+	size_t n = 0;
+	while(n < size && recv(fd, buf + n, 1, 0) == 1)
+		if(!buf[n++]) return 0;
+	return -1;
+}
+
+/* reads up to and including the terminator end */
+static int readuntil(int fd, char* buf, size_t size, const char* end) {
+	size_t n = 0, l = strlen(end);
+	while(n + 1 < size && recv(fd, buf + n, 1, 0) == 1) {
+		buf[++n] = 0;
+		if(n >= l && !memcmp(buf + n - l, end, l)) return 0;
+	}
+	return -1;
+}
+
+static int dial(const char* host, unsigned port) {
+	struct addrinfo hints = {.ai_socktype = SOCK_STREAM}, *ai;
+	char ps[8];
+	int fd;
+	snprintf(ps, sizeof ps, "%u", port);
+	if(getaddrinfo(host, ps, &hints, &ai)) return -1;
+	fd = socket(ai->ai_family, SOCK_STREAM, 0);
+	if(fd != -1 && connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(ai);
+	return fd;
+}
+
+static void relay(int a, int b) {
+	struct pollfd p[2] = {{.fd = a, .events = POLLIN}, {.fd = b, .events = POLLIN}};
+	char buf[16384];
+	ssize_t n;
+	int i;
+	while(poll(p, 2, -1) > 0) for(i = 0; i < 2; i++) {
+		if(!p[i].revents) continue;
+		if((n = recv(p[i].fd, buf, sizeof buf, 0)) <= 0 ||
+		   send(p[!i].fd, buf, n, MSG_NOSIGNAL) != n) return;
+	}
+}
+
+/* handles one client of the stand-in proxy, the protocol is told apart
+   by the first byte */
+static void* proxy_conn(void* arg) {
+	int fd = (intptr_t) arg, up = -1;
+	unsigned char b[512];
+	char host[256];
+	unsigned port;
+
+	if(readn(fd, b, 1)) goto out;
+	if(b[0] == 4) {
+		/* socks4/4a: cmd, port, ip, userid, [hostname] */
+		if(readn(fd, b + 1, 7) || readz(fd, host, sizeof host)) goto out;
+		port = b[2] << 8 | b[3];
+		if(!b[4] && !b[5] && !b[6] && b[7]) {
+			if(readz(fd, host, sizeof host)) goto out;
+		} else inet_ntop(AF_INET, b + 4, host, sizeof host);
+		up = dial(host, port);
+		memset(b, 0, 8);
+		b[1] = up == -1 ? 91 : 90;
+		send(fd, b, 8, MSG_NOSIGNAL);
+	} else if(b[0] == 5) {
+		/* socks5: method selection, then the connect request */
+		if(readn(fd, b + 1, 1) || readn(fd, b + 2, b[1])) goto out;
+		send(fd, "\x05\x00", 2, MSG_NOSIGNAL);
+		if(readn(fd, b, 4)) goto out;
+		if(b[3] == 1) {
+			if(readn(fd, b + 4, 4)) goto out;
+			inet_ntop(AF_INET, b + 4, host, sizeof host);
+		} else if(b[3] == 4) {
+			if(readn(fd, b + 4, 16)) goto out;
+			inet_ntop(AF_INET6, b + 4, host, sizeof host);
+		} else {
+			if(readn(fd, b + 4, 1) || readn(fd, host, b[4])) goto out;
+			host[b[4]] = 0;
+		}
+		if(readn(fd, b, 2)) goto out;
+		port = b[0] << 8 | b[1];
+		up = dial(host, port);
+		send(fd, up == -1 ? "\x05\x05\x00\x01\0\0\0\0\0\0" : "\x05\x00\x00\x01\0\0\0\0\0\0", 10, MSG_NOSIGNAL);
+	} else {
+		/* http CONNECT host:port */
+		char req[1024];
+		req[0] = b[0];
+		if(readuntil(fd, req + 1, sizeof(req) - 1, "\r\n\r\n") ||
+		   sscanf(req, "CONNECT %255[^:]:%u", host, &port) != 2) goto out;
+		up = dial(host, port);
+		if(up == -1) {
+			send(fd, "HTTP/1.0 502 Bad Gateway\r\n\r\n", 28, MSG_NOSIGNAL);
+		} else
+			send(fd, "HTTP/1.0 200 Connection established\r\n\r\n", 39, MSG_NOSIGNAL);
+	}
+	if(up != -1) relay(fd, up);
+out:
+	if(up != -1) close(up);
+	close(fd);
+	return 0;
+}
+
+static void proxy(int lfd) {
+	pthread_attr_t attr;
+	pthread_t t;
+	int fd;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setstacksize(&attr, 128 * 1024);
+	while((fd = accept(lfd, 0, 0)) != -1)
+		if(pthread_create(&t, &attr, proxy_conn, (void*)(intptr_t) fd)) close(fd);
+}
+
+static void report(const char* mode, const char* proxy, int hops, int n, double t, double* lat) {
+	printf("{\"bench\":\"connect\",\"mode\":\"%s\",\"proxy\":\"%s\",\"hops\":%d,\"connects\":%d,"
+	       "\"connects_per_s\":%.0f", mode, proxy, hops, n, n / t);
+	if(lat) printf(",\"p50_us\":%.1f,\"p99_us\":%.1f",
+	               percentile(lat, n, 50) * 1e6, percentile(lat, n, 99) * 1e6);
+	printf("}\n");
+}
+
+static void run_chain(int port, rs_proxyType type, const char* name, int pport, int hops, int n) {
+	rs_proxy proxies[3];
+	double lat[n], t, t0;
+	rocksock s;
+	int i, j;
+	t = now();
+	for(i = 0; i < n; i++) {
+		rocksock_init(&s, proxies);
+		rocksock_set_timeout(&s, 5000);
+		for(j = 0; j < hops; j++)
+			if(rocksock_add_proxy(&s, type, "127.0.0.1", pport, 0, 0)) die(&s);
+		t0 = now();
+		if(rocksock_connect(&s, "127.0.0.1", port, 0)) die(&s);
+		lat[i] = now() - t0;
+		rocksock_disconnect(&s);
+	}
+	report("sequential", name, hops, n, now() - t, lat);
+}
+
+static void done(rs_multiJob* job, rocksock* sock, int error, void* userdata) {
+	if(error) die(sock);
+}
+
+static void run_multi(int port, int n) {
+	static rocksock socks[INFLIGHT];
+	static rs_ioOp ops[INFLIGHT];
+	static struct pollfd pfds[INFLIGHT];
+	rs_multiJob jobs[n];
+	rs_multi m;
+	double t;
+	int i;
+	for(i = 0; i < n; i++)
+		jobs[i] = (rs_multiJob) {.host = "127.0.0.1", .port = port};
+	if(rocksock_multi_init(&m, socks, ops, pfds, INFLIGHT, RS_IOB_POLL, 5000)) exit(1);
+	t = now();
+	if(rocksock_multi_run(&m, jobs, n, done, 0)) {
+		perror("rocksock_multi_run");
+		exit(1);
+	}
+	report("multi", "none", 0, n, now() - t, 0);
+	rocksock_multi_free(&m);
+}
+
+int main(int argc, char** argv) {
+	static const struct { rs_proxyType type; const char* name; } types[] = {
+		{RS_PT_SOCKS4, "socks4"}, {RS_PT_SOCKS5, "socks5"}, {RS_PT_HTTP, "http"},
+	};
+	/* every connect leaves a socket in TIME_WAIT, stay well below the
+	   ephemeral port range */
+	int n = argc > 1 ? atoi(argv[1]) : 2000, port, pport, hops;
+	pid_t tpid, ppid;
+	size_t i;
+
+	tpid = bench_fork(target, bench_listen(&port));
+	ppid = bench_fork(proxy, bench_listen(&pport));
+	run_chain(port, RS_PT_NONE, "none", 0, 0, n);
+	run_multi(port, n);
+	for(i = 0; i < sizeof(types)/sizeof(types[0]); i++)
+		for(hops = 1; hops <= 3; hops++)
+			run_chain(port, types[i].type, types[i].name, pport, hops, n / 10);
+	bench_kill(ppid);
+	bench_kill(tpid);
+	return 0;
+}
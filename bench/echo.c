@@ -0,0 +1,174 @@
+/*
+ * c10k style echo benchmark of rocksockserver_loop with its select and
+ * epoll backends. a forked child runs the server, the parent keeps
+ * CONNS connections open and has each of them do MSGLEN byte round trips
+ * one after another for DURATION seconds. select can't go past
+ * FD_SETSIZE descriptors, so it only runs the smaller connection counts.
+ * "wantwrite":"always" is the classic mode where every client is polled
+ * for writability (with sleeptime 0, so the loop spins instead of
+ * sleeping), "explicit" turns write interest off as the echo is sent
+ * right away, so the loop blocks until a client sends something.
+ * echoes go out through rocksockserver_send.
+ * "server_cpu" is the share of a core the server used during the round
+ * trips, "idle_cpu" the same for IDLE seconds with all clients silent.
+ *
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "bench.h"
+#include "../rocksockserver.h"
+
+#define MSGLEN 64
+#define DURATION 2.0
+#define MAXLAT (1 << 20)
+#define IDLE 0.5
+
+static rs_serverBackend backend;
+static int explicit;
+static int port;
+static char sbuf[65536];
+static rocksockserver srv;
+
+static int on_read(void* userdata, int fd, size_t n) {
+	if(rocksockserver_send(&srv, fd, sbuf, n)) rocksockserver_disconnect_client(&srv, fd);
+	return 0;
+}
+
+static void server(int unused) {
+	static rs_outQueue queues[20016];
+	static char pool[1 << 20];
+	/* the clients connect as fast as they can */
+	if(rocksockserver_init(&srv, "127.0.0.1", port, 0) || rocksockserver_set_backlog(&srv, 4096) ||
+	   rocksockserver_set_backend(&srv, backend) != backend) exit(1);
+	rocksockserver_set_sleeptime(&srv, 0);
+	rocksockserver_set_outqueue(&srv, queues, 20016, pool, sizeof pool, 4096);
+	if(explicit) rocksockserver_want_write(&srv, -1, 0);
+	rocksockserver_loop(&srv, sbuf, sizeof sbuf, 0, on_read, 0, 0);
+}
+
+/* cpu seconds used by process pid so far */
+static double cputime(pid_t pid) {
+	unsigned long ut, st;
+	char path[64];
+	FILE *f;
+	int ok;
+	snprintf(path, sizeof path, "/proc/%d/stat", (int) pid);
+	if(!(f = fopen(path, "r"))) return 0;
+	ok = fscanf(f, "%*d %*s %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &ut, &st) == 2;
+	fclose(f);
+	return ok ? (ut + st) / (double) sysconf(_SC_CLK_TCK) : 0;
+}
+
+static int dial(void) {
+	struct sockaddr_in sa = {.sin_family = AF_INET, .sin_port = htons(port)};
+	int fd, tries;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	/* the server may not listen yet */
+	for(tries = 0; tries < 100; tries++) {
+		if((fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) break;
+		if(!connect(fd, (void*) &sa, sizeof sa)) {
+			fcntl(fd, F_SETFL, O_NONBLOCK);
+			return fd;
+		}
+		close(fd);
+		usleep(10000);
+	}
+	perror("connect");
+	exit(1);
+}
+
+static void run(const char* name, rs_serverBackend b, int expl, int conns) {
+	static double lat[MAXLAT], sent[20000];
+	static size_t got[20000];
+	struct epoll_event ev[256];
+	char msg[MSGLEN], rbuf[MSGLEN];
+	int fds[conns], ep, i, n;
+	size_t msgs = 0, nlat = 0;
+	double t, end, cpu, idle;
+	ssize_t r;
+	pid_t pid;
+
+	backend = b;
+	explicit = expl;
+	/* rocksockserver_init opens its own listen socket, on a port that was
+	   free a moment ago */
+	close(bench_listen(&port));
+	pid = bench_fork(server, -1);
+	memset(msg, 'x', sizeof msg);
+	if((ep = epoll_create1(0)) == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	for(i = 0; i < conns; i++) {
+		fds[i] = dial();
+		ev[0] = (struct epoll_event) {.events = EPOLLIN, .data.u32 = i};
+		epoll_ctl(ep, EPOLL_CTL_ADD, fds[i], ev);
+	}
+	idle = cputime(pid);
+	usleep(IDLE * 1e6);
+	idle = cputime(pid) - idle;
+	cpu = cputime(pid);
+	t = now();
+	end = t + DURATION;
+	for(i = 0; i < conns; i++) {
+		sent[i] = now();
+		got[i] = 0;
+		send(fds[i], msg, sizeof msg, MSG_NOSIGNAL);
+	}
+	while(now() < end) {
+		if((n = epoll_wait(ep, ev, 256, 100)) == -1 && errno != EINTR) {
+			perror("epoll_wait");
+			exit(1);
+		}
+		while(n-- > 0) {
+			i = ev[n].data.u32;
+			if((r = recv(fds[i], rbuf, sizeof rbuf - got[i], 0)) <= 0) {
+				if(r == -1 && errno == EAGAIN) continue;
+				dprintf(2, "connection %d lost\n", i);
+				exit(1);
+			}
+			if((got[i] += r) < MSGLEN) continue;
+			if(nlat < MAXLAT) lat[nlat++] = now() - sent[i];
+			msgs++;
+			got[i] = 0;
+			sent[i] = now();
+			send(fds[i], msg, sizeof msg, MSG_NOSIGNAL);
+		}
+	}
+	t = now() - t;
+	cpu = cputime(pid) - cpu;
+	printf("{\"bench\":\"echo\",\"backend\":\"%s\",\"wantwrite\":\"%s\",\"conns\":%d,\"msglen\":%d,"
+	       "\"msgs\":%zu,\"msgs_per_s\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f,\"server_cpu\":%.2f,\"idle_cpu\":%.2f}\n",
+	       name, expl ? "explicit" : "always", conns, MSGLEN, msgs, msgs / t,
+	       percentile(lat, nlat, 50) * 1e6, percentile(lat, nlat, 99) * 1e6, cpu / t, idle / IDLE);
+	for(i = 0; i < conns; i++) close(fds[i]);
+	close(ep);
+	bench_kill(pid);
+}
+
+int main(int argc, char** argv) {
+	static const int counts[] = {100, 1000, 10000};
+	struct rlimit rl;
+	size_t i;
+	int expl;
+	/* both ends need a descriptor per connection */
+	if(!getrlimit(RLIMIT_NOFILE, &rl)) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	for(i = 0; i < sizeof(counts)/sizeof(counts[0]); i++) for(expl = 0; expl < 2; expl++) {
+		if(counts[i] + 16 <= FD_SETSIZE) run("select", RS_SB_SELECT, expl, counts[i]);
+		if((rlim_t) counts[i] + 16 > rl.rlim_cur) {
+			printf("{\"bench\":\"echo\",\"backend\":\"epoll\",\"conns\":%d,\"available\":false}\n",
+			       counts[i]);
+			break;
+		}
+		run("epoll", RS_SB_EPOLL, expl, counts[i]);
+	}
+	return 0;
+}
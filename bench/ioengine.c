@@ -0,0 +1,212 @@
+/*
+ * compares the classic blocking path (rocksock_send/recv on one socket
+ * after another) with the batched io engine, on both of its backends.
+ * a forked child echoes everything back over loopback. each round sends
+ * one message on every connection and reads the echoes back.
+ * the wall clock time mostly depends on the echo server, the cpu time
+ * spent by the client process (user and kernel) is what's compared.
+ *
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../rocksock.h"
+
+#define MAXCONNS 1024
+#define MSGSIZE 64
+
+static rocksock socks[MAXCONNS];
+static char bufs[MAXCONNS][MSGSIZE];
+static rs_ioOp ops[MAXCONNS];
+static struct pollfd pfds[MAXCONNS];
+static rs_ioCompletion comps[MAXCONNS];
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void echo_server(int lfd) {
+	struct pollfd pfd[MAXCONNS + 1];
+	char buf[65536];
+	int i, n = 1;
+	ssize_t l;
+	pfd[0].fd = lfd;
+	pfd[0].events = POLLIN;
+	for(;;) {
+		if(poll(pfd, n, -1) <= 0) continue;
+		if(pfd[0].revents && n <= MAXCONNS) {
+			pfd[n].fd = accept(lfd, 0, 0);
+			pfd[n].events = POLLIN;
+			if(pfd[n].fd != -1) n++;
+		}
+		for(i = 1; i < n; i++) {
+			if(!pfd[i].revents) continue;
+			l = recv(pfd[i].fd, buf, sizeof buf, 0);
+			if(l <= 0) {
+				close(pfd[i].fd);
+				pfd[i--] = pfd[--n];
+				continue;
+			}
+			if(write(pfd[i].fd, buf, l) != l) _exit(1);
+		}
+	}
+}
+
+static void die(rocksock* s) {
+	rocksock_error_dprintf(2, s);
+	exit(1);
+}
+
+static double connect_classic(int conns, int port) {
+	double t = now();
+	int i;
+	for(i = 0; i < conns; i++) {
+		rocksock_init(&socks[i], 0);
+		rocksock_set_timeout(&socks[i], 5000);
+		if(rocksock_connect(&socks[i], "127.0.0.1", port, 0)) die(&socks[i]);
+	}
+	return now() - t;
+}
+
+/* cpu time of the last rounds_* call */
+static double rounds_cpu;
+
+static double rounds_classic(int conns, int rounds) {
+	double t = now(), c = cpu();
+	size_t n, got;
+	int i, r;
+	for(r = 0; r < rounds; r++) {
+		for(i = 0; i < conns; i++)
+			if(rocksock_send(&socks[i], bufs[i], MSGSIZE, 0, &n)) die(&socks[i]);
+		for(i = 0; i < conns; i++)
+			for(got = 0; got < MSGSIZE; got += n)
+				if(rocksock_recv(&socks[i], bufs[i] + got, MSGSIZE - got, 0, &n)) die(&socks[i]);
+	}
+	rounds_cpu = cpu() - c;
+	return now() - t;
+}
+
+/* runs the engine until nothing is pending. short reads are continued. */
+static void drain(rs_ioEngine* e) {
+	int i, n;
+	while((n = rocksock_ioengine_run(e, comps, MAXCONNS)) > 0) {
+		for(i = 0; i < n; i++) {
+			if(comps[i].error) die(comps[i].sock);
+			if(comps[i].type == RS_IO_RECV) {
+				size_t *got = comps[i].data;
+				*got += comps[i].bytes;
+				if(*got < MSGSIZE)
+					rocksock_ioengine_recv(e, comps[i].sock, bufs[comps[i].sock - socks] + *got, MSGSIZE - *got, got);
+			}
+		}
+	}
+	if(n == -1) {
+		perror("rocksock_ioengine_run");
+		exit(1);
+	}
+}
+
+static double connect_engine(rs_ioEngine* e, int conns, int port) {
+	double t = now();
+	int i;
+	for(i = 0; i < conns; i++) {
+		rocksock_init(&socks[i], 0);
+		rocksock_set_timeout(&socks[i], 5000);
+		if(rocksock_ioengine_connect(e, &socks[i], "127.0.0.1", port, 0, 0)) die(&socks[i]);
+	}
+	drain(e);
+	return now() - t;
+}
+
+static double rounds_engine(rs_ioEngine* e, int conns, int rounds) {
+	static size_t got[MAXCONNS];
+	double t = now(), c = cpu();
+	int i, r;
+	for(r = 0; r < rounds; r++) {
+		for(i = 0; i < conns; i++)
+			if(rocksock_ioengine_send(e, &socks[i], bufs[i], MSGSIZE, 0)) die(&socks[i]);
+		drain(e);
+		for(i = 0; i < conns; i++) {
+			got[i] = 0;
+			if(rocksock_ioengine_recv(e, &socks[i], bufs[i], MSGSIZE, &got[i])) die(&socks[i]);
+		}
+		drain(e);
+	}
+	rounds_cpu = cpu() - c;
+	return now() - t;
+}
+
+static void report(const char* mode, int conns, int rounds, double tc, double tr) {
+	printf("{\"bench\":\"ioengine\",\"mode\":\"%s\",\"conns\":%d,\"rounds\":%d,"
+	       "\"connect_us_per_conn\":%.1f,\"ns_per_msg\":%.1f,\"cpu_ns_per_msg\":%.1f}\n",
+	       mode, conns, rounds, tc * 1e6 / conns, tr * 1e9 / ((double) conns * rounds),
+	       rounds_cpu * 1e9 / ((double) conns * rounds));
+}
+
+int main(int argc, char** argv) {
+	int conns = argc > 1 ? atoi(argv[1]) : 64, rounds = argc > 2 ? atoi(argv[2]) : 1000;
+	struct sockaddr_in sa = {.sin_family = AF_INET};
+	socklen_t sl = sizeof sa;
+	rs_ioEngine e;
+	double tc, tr;
+	int i, lfd, port;
+	pid_t pid;
+
+	if(conns < 1 || conns > MAXCONNS) conns = MAXCONNS;
+	sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if(lfd == -1 || bind(lfd, (void*) &sa, sizeof sa) || listen(lfd, MAXCONNS) ||
+	   getsockname(lfd, (void*) &sa, &sl)) {
+		perror("listen");
+		return 1;
+	}
+	port = ntohs(sa.sin_port);
+	if(!(pid = fork())) echo_server(lfd);
+	close(lfd);
+	for(i = 0; i < MAXCONNS; i++) memset(bufs[i], 'x', MSGSIZE);
+
+	tc = connect_classic(conns, port);
+	tr = rounds_classic(conns, rounds);
+	for(i = 0; i < conns; i++) rocksock_disconnect(&socks[i]);
+	report("classic", conns, rounds, tc, tr);
+
+	rocksock_ioengine_init(&e, ops, pfds, MAXCONNS, RS_IOB_POLL);
+	tc = connect_engine(&e, conns, port);
+	tr = rounds_engine(&e, conns, rounds);
+	for(i = 0; i < conns; i++) rocksock_disconnect(&socks[i]);
+	rocksock_ioengine_free(&e);
+	report("poll", conns, rounds, tc, tr);
+
+	rocksock_ioengine_init(&e, ops, pfds, MAXCONNS, RS_IOB_URING);
+	if(rocksock_ioengine_backend(&e) == RS_IOB_URING) {
+		tc = connect_engine(&e, conns, port);
+		tr = rounds_engine(&e, conns, rounds);
+		for(i = 0; i < conns; i++) rocksock_disconnect(&socks[i]);
+		report("io_uring", conns, rounds, tc, tr);
+	} else
+		printf("{\"bench\":\"ioengine\",\"mode\":\"io_uring\",\"available\":false}\n");
+	rocksock_ioengine_free(&e);
+
+	kill(pid, SIGKILL);
+	waitpid(pid, 0, 0);
+	return 0;
+}
@@ -0,0 +1,55 @@
+/*
+ * rocksock_readline lines per second, reading byte by byte and with a
+ * read buffer (rocksock_set_readbuffer). a forked child sends lines of
+ * LINELEN bytes.
+ *
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#include "bench.h"
+
+#define LINELEN 64
+
+static void source(int lfd) {
+	char buf[LINELEN * 1024];
+	int fd, i;
+	for(i = 0; i < (int) sizeof buf; i++)
+		buf[i] = (i + 1) % LINELEN ? 'a' + i % 26 : '\n';
+	signal(SIGPIPE, SIG_IGN);
+	while((fd = accept(lfd, 0, 0)) != -1) {
+		while(send(fd, buf, sizeof buf, 0) > 0);
+		close(fd);
+	}
+}
+
+static void run(int port, size_t lines, size_t rbufsize) {
+	char rbuf[65536], line[LINELEN * 2];
+	rocksock s;
+	size_t i, n;
+	double t;
+	rocksock_init(&s, 0);
+	rocksock_set_timeout(&s, 10000);
+	if(rbufsize) rocksock_set_readbuffer(&s, rbuf, rbufsize);
+	if(rocksock_connect(&s, "127.0.0.1", port, 0)) die(&s);
+	t = now();
+	for(i = 0; i < lines; i++)
+		if(rocksock_readline(&s, line, sizeof line, &n) || n != LINELEN - 1) die(&s);
+	t = now() - t;
+	rocksock_disconnect(&s);
+	printf("{\"bench\":\"readline\",\"readbuffer\":%zu,\"line\":%d,\"lines\":%zu,"
+	       "\"lines_per_s\":%.0f,\"mb_per_s\":%.1f}\n",
+	       rbufsize, LINELEN, lines, lines / t, lines * LINELEN / t / 1e6);
+}
+
+int main(int argc, char** argv) {
+	size_t lines = argc > 1 ? strtoul(argv[1], 0, 10) : 1000000;
+	int port;
+	pid_t pid = bench_fork(source, bench_listen(&port));
+	/* one syscall per byte, so fewer lines */
+	run(port, lines / 20, 0);
+	run(port, lines, 4096);
+	run(port, lines, 65536);
+	bench_kill(pid);
+	return 0;
+}
@@ -0,0 +1,99 @@
+/*
+ * counts the syscalls issued per rocksock_recv() call.
+ * the network syscalls are intercepted with the linker's --wrap
+ * option (see Makefile), so this must be linked against librocksock.a.
+ *
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include "../rocksock.h"
+
+static unsigned long n_recv, n_send, n_select, n_poll, n_setsockopt;
+
+ssize_t __real_recv(int fd, void *buf, size_t len, int flags);
+ssize_t __wrap_recv(int fd, void *buf, size_t len, int flags) {
+	n_recv++;
+	return __real_recv(fd, buf, len, flags);
+}
+
+ssize_t __real_send(int fd, const void *buf, size_t len, int flags);
+ssize_t __wrap_send(int fd, const void *buf, size_t len, int flags) {
+	n_send++;
+	return __real_send(fd, buf, len, flags);
+}
+
+int __real_select(int n, fd_set *r, fd_set *w, fd_set *e, struct timeval *tv);
+int __wrap_select(int n, fd_set *r, fd_set *w, fd_set *e, struct timeval *tv) {
+	n_select++;
+	return __real_select(n, r, w, e, tv);
+}
+
+int __real_poll(struct pollfd *fds, nfds_t n, int timeout);
+int __wrap_poll(struct pollfd *fds, nfds_t n, int timeout) {
+	n_poll++;
+	return __real_poll(fds, n, timeout);
+}
+
+int __real_setsockopt(int fd, int level, int opt, const void *val, socklen_t len);
+int __wrap_setsockopt(int fd, int level, int opt, const void *val, socklen_t len) {
+	n_setsockopt++;
+	return __real_setsockopt(fd, level, opt, val, len);
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+	int sv[2];
+	unsigned long i, iterations = argc > 1 ? strtoul(argv[1], 0, 10) : 100000;
+	size_t chunk = argc > 2 ? strtoul(argv[2], 0, 10) : 64, n;
+	char buf[65536];
+	rocksock sock;
+	double t;
+
+	if(chunk > sizeof buf) chunk = sizeof buf;
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		perror("socketpair");
+		return 1;
+	}
+	rocksock_init(&sock, 0);
+	rocksock_set_timeout(&sock, 5000);
+	sock.socket = sv[0];
+	memset(buf, 'x', sizeof buf);
+
+	n_recv = n_send = n_select = n_poll = n_setsockopt = 0;
+	t = 0;
+	for(i = 0; i < iterations; i++) {
+		if(write(sv[1], buf, chunk) != (ssize_t) chunk) {
+			perror("write");
+			return 1;
+		}
+		double t0 = now();
+		if(rocksock_recv(&sock, buf, chunk, chunk, &n) || n != chunk) {
+			rocksock_error_dprintf(2, &sock);
+			return 1;
+		}
+		t += now() - t0;
+	}
+	printf("{\"bench\":\"recv_syscalls\",\"iterations\":%lu,\"chunk\":%zu,"
+	       "\"syscalls_per_recv\":%.3f,\"recv\":%lu,\"select\":%lu,\"poll\":%lu,"
+	       "\"setsockopt\":%lu,\"ns_per_recv\":%.1f}\n",
+	       iterations, chunk,
+	       (double)(n_recv + n_send + n_select + n_poll + n_setsockopt) / iterations,
+	       n_recv, n_select, n_poll, n_setsockopt, t * 1e9 / iterations);
+	close(sv[0]);
+	close(sv[1]);
+	return 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * rocksock_send/rocksock_recv throughput over loopback tcp across chunk
+ * sizes. a forked child discards everything sent to it, or sends as
+ * fast as it can.
+ *
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#include "bench.h"
+
+#define MAXCHUNK (256*1024)
+
+static char buf[MAXCHUNK];
+
+static void sink(int lfd) {
+	int fd;
+	while((fd = accept(lfd, 0, 0)) != -1) {
+		while(recv(fd, buf, sizeof buf, 0) > 0);
+		close(fd);
+	}
+}
+
+static void source(int lfd) {
+	int fd;
+	signal(SIGPIPE, SIG_IGN);
+	while((fd = accept(lfd, 0, 0)) != -1) {
+		while(send(fd, buf, sizeof buf, 0) > 0);
+		close(fd);
+	}
+}
+
+static void run(const char* op, int port, size_t chunk, size_t total) {
+	rocksock s;
+	size_t n, done = 0;
+	double t;
+	rocksock_init(&s, 0);
+	rocksock_set_timeout(&s, 10000);
+	if(rocksock_connect(&s, "127.0.0.1", port, 0)) die(&s);
+	t = now();
+	while(done < total) {
+		if(*op == 's' ? rocksock_send(&s, buf, chunk, 0, &n) : rocksock_recv(&s, buf, chunk, 0, &n))
+			die(&s);
+		done += n;
+	}
+	t = now() - t;
+	rocksock_disconnect(&s);
+	printf("{\"bench\":\"throughput\",\"op\":\"%s\",\"chunk\":%zu,\"bytes\":%zu,"
+	       "\"mb_per_s\":%.1f,\"ns_per_call\":%.1f}\n",
+	       op, chunk, done, done / t / 1e6, t * 1e9 / ((double) done / chunk));
+}
+
+int main(int argc, char** argv) {
+	static const size_t chunks[] = {64, 1024, 16384, 65536, MAXCHUNK};
+	size_t i, total = (argc > 1 ? strtoul(argv[1], 0, 10) : 128) << 20;
+	int port;
+	pid_t pid;
+
+	memset(buf, 'x', sizeof buf);
+	pid = bench_fork(sink, bench_listen(&port));
+	for(i = 0; i < sizeof(chunks)/sizeof(chunks[0]); i++)
+		/* small chunks are syscall-bound, keep their run time in check */
+		run("send", port, chunks[i], chunks[i] < 16384 ? total / 16 : total);
+	bench_kill(pid);
+
+	pid = bench_fork(source, bench_listen(&port));
+	for(i = 0; i < sizeof(chunks)/sizeof(chunks[0]); i++)
+		run("recv", port, chunks[i], chunks[i] < 16384 ? total / 16 : total);
+	bench_kill(pid);
+	return 0;
+}
@@ -0,0 +1,150 @@
+/*
+ * tls handshake rate (full and resumed through rs_sslCache) and bulk
+ * rocksock_send/rocksock_recv throughput over loopback for the ssl
+ * backend the library was built with. the forked server always uses
+ * openssl with a throwaway ec key and self-signed certificate, so with
+ * other backends only the client side is theirs.
+ *
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#include <netinet/tcp.h>
+#include "bench.h"
+
+#if defined(USE_SSL) && defined(USE_OPENSSL)
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+
+#define CHUNK 16384
+#define BACKEND "openssl"
+
+static SSL_CTX *ctx;
+static char buf[CHUNK];
+
+static void server_ctx(void) {
+	EVP_PKEY *key = EVP_EC_gen("P-256");
+	X509 *crt = X509_new();
+	X509_NAME *name;
+	ctx = SSL_CTX_new(TLS_server_method());
+	if(!key || !crt || !ctx) goto fail;
+	ASN1_INTEGER_set(X509_get_serialNumber(crt), 1);
+	X509_gmtime_adj(X509_getm_notBefore(crt), 0);
+	X509_gmtime_adj(X509_getm_notAfter(crt), 3600);
+	X509_set_pubkey(crt, key);
+	name = X509_get_subject_name(crt);
+	X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (void*) "localhost", -1, -1, 0);
+	X509_set_issuer_name(crt, name);
+	if(!X509_sign(crt, key, EVP_sha256()) ||
+	   SSL_CTX_use_certificate(ctx, crt) != 1 || SSL_CTX_use_PrivateKey(ctx, key) != 1)
+		goto fail;
+	return;
+fail:
+	dprintf(2, "failed to set up the tls server\n");
+	exit(1);
+}
+
+/* "sink" sends one byte, so the client reads the session tickets that
+   tls 1.3 sends after the handshake, then reads until the client closes.
+   "source" writes until it does. */
+static void serve(int lfd, int source) {
+	SSL *ssl;
+	int fd, one = 1;
+	signal(SIGPIPE, SIG_IGN);
+	while((fd = accept(lfd, 0, 0)) != -1) {
+		/* the byte must not wait for the ack of the tickets */
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+		ssl = SSL_new(ctx);
+		SSL_set_fd(ssl, fd);
+		if(SSL_accept(ssl) == 1) {
+			if(source) while(SSL_write(ssl, buf, sizeof buf) > 0);
+			else if(SSL_write(ssl, buf, 1) == 1) while(SSL_read(ssl, buf, sizeof buf) > 0);
+		}
+		SSL_free(ssl);
+		close(fd);
+	}
+}
+
+static void sink(int lfd) { serve(lfd, 0); }
+static void source(int lfd) { serve(lfd, 1); }
+
+static void handshakes(int port, int n, int resume) {
+	rs_sslCacheEntry entries[4];
+	rs_sslCache cache;
+	unsigned long hits = 0, misses = 0;
+	double lat[n], t, t0;
+	rocksock s;
+	size_t len;
+	int i;
+	if(resume) {
+		rocksock_sslcache_init(&cache, entries, 4);
+		rocksock_sslcache_use(&cache);
+	}
+	t = now();
+	for(i = 0; i < n; i++) {
+		rocksock_init(&s, 0);
+		rocksock_set_timeout(&s, 5000);
+		t0 = now();
+		if(rocksock_connect(&s, "127.0.0.1", port, 1)) die(&s);
+		lat[i] = now() - t0;
+		if(rocksock_recv(&s, buf, 1, 1, &len)) die(&s);
+		rocksock_disconnect(&s);
+	}
+	t = now() - t;
+	if(resume) {
+		rocksock_sslcache_stats(&cache, &hits, &misses);
+		rocksock_sslcache_free(&cache);
+	}
+	printf("{\"bench\":\"tls\",\"backend\":\"%s\",\"op\":\"handshake\",\"resume\":%s,"
+	       "\"handshakes\":%d,\"resumed\":%lu,\"handshakes_per_s\":%.0f,\"p50_us\":%.1f,\"p99_us\":%.1f}\n",
+	       BACKEND, resume ? "true" : "false", n, hits, n / t,
+	       percentile(lat, n, 50) * 1e6, percentile(lat, n, 99) * 1e6);
+}
+
+static void bulk(const char* op, int port, size_t total) {
+	rocksock s;
+	size_t n, done = 0;
+	double t;
+	rocksock_init(&s, 0);
+	rocksock_set_timeout(&s, 10000);
+	if(rocksock_connect(&s, "127.0.0.1", port, 1)) die(&s);
+	t = now();
+	while(done < total) {
+		if(*op == 's' ? rocksock_send(&s, buf, CHUNK, 0, &n) : rocksock_recv(&s, buf, CHUNK, 0, &n))
+			die(&s);
+		done += n;
+	}
+	t = now() - t;
+	rocksock_disconnect(&s);
+	printf("{\"bench\":\"tls\",\"backend\":\"%s\",\"op\":\"%s\",\"chunk\":%d,\"bytes\":%zu,"
+	       "\"mb_per_s\":%.1f}\n", BACKEND, op, CHUNK, done, done / t / 1e6);
+}
+
+int main(int argc, char** argv) {
+	int n = argc > 1 ? atoi(argv[1]) : 500, port;
+	pid_t pid;
+
+	server_ctx();
+	rocksock_init_ssl();
+	pid = bench_fork(sink, bench_listen(&port));
+	handshakes(port, n, 0);
+	handshakes(port, n, 1);
+	bulk("send", port, 256 << 20);
+	bench_kill(pid);
+
+	pid = bench_fork(source, bench_listen(&port));
+	bulk("recv", port, 256 << 20);
+	bench_kill(pid);
+	rocksock_free_ssl();
+	return 0;
+}
+
+#else
+
+int main(void) {
+	printf("{\"bench\":\"tls\",\"available\":false}\n");
+	return 0;
+}
+
+#endif
@@ -13,6 +13,7 @@ enum cstate {
 	cs_said_hello,
 	cs_idle,
 	cs_msg,
+	cs_closing,
 };
 
 typedef struct client {
@@ -93,29 +94,46 @@ static int on_cwantsdata (void* userdata, int fd) {
 	if(!(c = client_from_fd(s->clients, fd))) return -1;
 	switch(c->state) {
 		case cs_said_hello:
-			send(fd, SL("HELO. you may now say something.\n"), MSG_NOSIGNAL);
+			rocksockserver_send(&s->srv, fd, SL("HELO. you may now say something.\n"));
 			c->state = cs_idle;
 		case cs_idle:
 		case cs_null:
+		case cs_closing:
 			break;
 		case cs_error:
-			send(fd, SL("error: need to send HELO first\n"), MSG_NOSIGNAL);
-			disconnect_client(s, fd);
+			/* the message may still be queued, on_cdrain closes then */
+			c->state = cs_closing;
+			if(rocksockserver_send(&s->srv, fd, SL("error: need to send HELO first\n")) ||
+			   !rocksockserver_pending(&s->srv, fd))
+				disconnect_client(s, fd);
 			break;
 		case cs_msg:
-			send(fd, c->msg, strlen(c->msg), MSG_NOSIGNAL);
+			rocksockserver_send(&s->srv, fd, c->msg, strlen(c->msg));
 			c->state = cs_idle;
 			break;
 	}
 	return 0;
 }
 
+static int on_cdrain (void* userdata, int fd) {
+	server* s = userdata;
+	struct client *c;
+	if((c = client_from_fd(s->clients, fd)) && c->state == cs_closing)
+		disconnect_client(s, fd);
+	return 0;
+}
+
 int main() {
+	static rs_outQueue queues[1024];
+	static char pool[64 * 1024];
 	server sv, *s = &sv;
 	s->clients = sblist_new(sizeof(struct client), 32);
 	const int port = 9999;
 	const char* listenip = "0.0.0.0";
 	if(rocksockserver_init(&s->srv, listenip, port, (void*) s)) return -1;
+	/* replies to slow readers get queued instead of cut short */
+	rocksockserver_set_outqueue(&s->srv, queues, 1024, pool, sizeof pool, 512);
+	rocksockserver_set_drainfunc(&s->srv, on_cdrain);
 	if(rocksockserver_loop(&s->srv, NULL, 0,
 	                       &on_cconnect, &on_cread,
 	                       &on_cwantsdata, &on_cdisconnect)) return -2;
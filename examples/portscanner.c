@@ -12,125 +12,167 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <pthread.h>
-#include <errno.h>
-#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
 #include "../rocksock.h"
 
-//RcB: LINK "-lpthread"
+/* jobs are handed to rocksock_multi in batches of this size */
+#define BATCH 65536
 
 typedef struct {
 	char host[16];
-	int port;
-	int status;
-} threaddata;
-
-static int done = 0;
-static pthread_mutex_t mutex;
+} target;
+
+static target targets[BATCH];
+static rs_multiJob jobs[BATCH];
+static rs_proxy proxies[16];
+static int verbose;
+
+static void usage(const char* prog) {
+	dprintf(2, "subnet portscanner\n"
+	           "usage: %s [-c concurrency] [-t timeout_ms] [-x proxy]... [-s] [-v] ranges ports\n"
+	           "ranges: comma-separated ipv4 addresses or cidr ranges\n"
+	           "ports: comma-separated ports or port ranges\n"
+	           "-x adds a proxy to the chain, e.g. socks5://127.0.0.1:1080\n"
+	           "-s connects with ssl, -v prints failed connects too\n"
+	           "example: %s -c 512 192.168.0.0/16,10.0.0.1 22,80,8000-8100\n", prog, prog);
+	exit(1);
+}
 
-static void* scanHost(void* arg) {
-	threaddata* d = arg;
-	rocksock skt;
-	rocksock* soc = &skt;
-	rocksock_init(soc);
-	rocksock_set_timeout(soc, 1500);
+static void result(rs_multiJob* job, rocksock* sock, int error, void* userdata) {
+	unsigned long *open = userdata;
+	if(!error) {
+		dprintf(1, "%s:%u\n", job->host, job->port);
+		++*open;
+	} else if(verbose)
+		dprintf(2, "%s:%u: %s\n", job->host, job->port, rocksock_strerror(sock));
+}
 
-	if (!rocksock_connect(soc, d->host, d->port, 0)){
-		d->status = 1;
-	} else {
-		//printf("%s\n", soc->lasterror.errormsg);
-		d->status = 0;
+/* parses a.b.c.d or a.b.c.d/n into the first and last address to scan.
+   network and broadcast addresses are skipped for prefixes up to /30. */
+static int parse_range(char* s, unsigned long* first, unsigned long* last) {
+	struct in_addr a;
+	char *p = strchr(s, '/');
+	int bits = 32;
+	unsigned long mask;
+	if(p) {
+		*p = 0;
+		bits = atoi(p + 1);
+		if(bits < 0 || bits > 32) return -1;
+	}
+	if(!inet_aton(s, &a)) return -1;
+	mask = bits ? (0xffffffffUL << (32 - bits)) & 0xffffffffUL : 0;
+	*first = ntohl(a.s_addr) & mask;
+	*last = *first | (~mask & 0xffffffffUL);
+	if(bits <= 30) {
+		++*first;
+		--*last;
 	}
-
-	rocksock_disconnect(soc);
-	rocksock_clear(soc);
-
-	pthread_mutex_lock(&mutex);
-	done++;
-	pthread_mutex_unlock(&mutex);
 	return 0;
 }
 
-int running(pthread_t* t, int max) {
-	int res = 0, i = 0;
-	for (; i <= max; i++) {
-		if (t[i]) res++;
-	}
-	return res;
+/* parses n or n-m */
+static int parse_ports(char* s, unsigned* first, unsigned* last) {
+	char *p = strchr(s, '-');
+	*first = *last = atoi(s);
+	if(p) *last = atoi(p + 1);
+	return *first && *first <= *last && *last <= 65535 ? 0 : -1;
 }
 
-int joinThreads(pthread_t* threads, int max) {
-	void* exitstate;
-	int i = 0;
-	for(;i<max;i++) {
-		if (threads[i]) {
-			if (!pthread_join(threads[i], &exitstate)) {
-				threads[i] = 0;
-				free(exitstate);
-			}
-		}
+static void run_batch(rs_multi* m, size_t n, unsigned long* open) {
+	if(n && rocksock_multi_run(m, jobs, n, result, open)) {
+		perror("rocksock_multi_run");
+		exit(1);
 	}
-	return 0;
 }
 
-int scanRange(const char *ip, int port, int max_threads) {
-
-	int maxthreads = max_threads > 254 ? 254 : max_threads;
-	pthread_t threads[255] = {0};
-	threaddata data[255] = {0};
-
-	pthread_attr_t attr;
-	size_t stack;
-	pthread_attr_init(&attr);
-	pthread_attr_getstacksize(&attr, &stack);
-	stack = 32768;
-	pthread_attr_setstacksize(&attr, stack);
-
-	pthread_mutex_init(&mutex, NULL);
-
-	volatile int x = 1;
-	while(done < 254) {
-		while(x < 255 && running((pthread_t*) threads, x) < maxthreads) {
-			threaddata* d = &data[x];
-			snprintf(d->host, sizeof(d->host), "%s.%d", ip, x);
-			d->port = port;
-			d->status = -1;
-			if (!pthread_create(&threads[x], &attr, scanHost, &data[x])) {
-				x++;
-			}
-			else {
-				break;
+int main(int argc, char** argv) {
+	unsigned long timeout = 1500, open = 0, addr, first, last;
+	unsigned port, pfirst, plast;
+	int c, concurrency = 256, useSSL = 0, nproxies;
+	char *ranges, *ports, *r, *rs, *ps, *pp;
+	struct rlimit rl;
+	rocksock chain;
+	rocksock *socks;
+	rs_ioOp *ops;
+	struct pollfd *pfds;
+	rs_multi m;
+	size_t n = 0;
+
+	rocksock_init(&chain, proxies);
+	while((c = getopt(argc, argv, "c:t:x:sv")) != -1) switch(c) {
+		case 'c': concurrency = atoi(optarg); break;
+		case 't': timeout = strtoul(optarg, 0, 10); break;
+		case 'x':
+			if(rocksock_add_proxy_fromstring(&chain, optarg)) {
+				dprintf(2, "invalid proxy %s: %s\n", optarg, rocksock_strerror(&chain));
+				return 1;
 			}
-		}
-		joinThreads(threads, x);
+			break;
+		case 's': useSSL = 1; break;
+		case 'v': verbose = 1; break;
+		default: usage(argv[0]);
 	}
-
-	joinThreads(threads, x);
-
-	pthread_attr_destroy(&attr);
-
-	int i = 0;
-	for (; i < 255; i++) {
-		if (data[i].status > 0) dprintf(1, "%s\n", data[i].host);
+	if(argc - optind != 2 || concurrency < 1) usage(argv[0]);
+	ranges = argv[optind];
+	ports = argv[optind + 1];
+	nproxies = chain.lastproxy + 1;
+
+	/* every connect in flight needs a descriptor, two while racing */
+	if(!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &rl);
 	}
-
-	pthread_mutex_destroy(&mutex);
-	return 0;
-}
-
-int main(int argc, char** argv) {
-	if (argc < 4) {
-		dprintf(2, "multithreaded subnet portscanner\n"
-		           "inv. syntax\n"
-		           "%s 127.0.0 22 16\n"
-		           "subnetA port maxthreads\n", argv[0]);
-		exit(1);
+	socks = calloc(concurrency, sizeof(*socks));
+	ops = calloc(concurrency, sizeof(*ops));
+	pfds = calloc(concurrency, sizeof(*pfds));
+	if(!socks || !ops || !pfds) {
+		perror("calloc");
+		return 1;
+	}
+	if(useSSL) rocksock_init_ssl();
+	if(rocksock_multi_init(&m, socks, ops, pfds, concurrency, RS_IOB_URING, timeout)) {
+		dprintf(2, "rocksock_multi_init failed\n");
+		return 1;
 	}
 
-	int port = atoi(argv[2]);
-	char* ip = argv[1];
-	int maxthreads = atoi(argv[3]);
-
-	scanRange(ip, port, maxthreads);
+	for(r = strtok_r(ranges, ",", &rs); r; r = strtok_r(0, ",", &rs)) {
+		if(parse_range(r, &first, &last)) {
+			dprintf(2, "invalid range %s\n", r);
+			return 1;
+		}
+		for(addr = first; addr <= last; addr++) {
+			struct in_addr a = {.s_addr = htonl(addr)};
+			char portlist[strlen(ports) + 1];
+			memcpy(portlist, ports, sizeof portlist);
+			for(pp = strtok_r(portlist, ",", &ps); pp; pp = strtok_r(0, ",", &ps)) {
+				if(parse_ports(pp, &pfirst, &plast)) {
+					dprintf(2, "invalid ports %s\n", pp);
+					return 1;
+				}
+				for(port = pfirst; port <= plast; port++) {
+					if(n == BATCH) {
+						run_batch(&m, n, &open);
+						n = 0;
+					}
+					inet_ntop(AF_INET, &a, targets[n].host, sizeof(targets[n].host));
+					jobs[n].host = targets[n].host;
+					jobs[n].port = port;
+					jobs[n].useSSL = useSSL;
+					jobs[n].proxies = nproxies ? proxies : 0;
+					jobs[n].nproxies = nproxies;
+					jobs[n].data = 0;
+					n++;
+				}
+			}
+		}
+	}
+	run_batch(&m, n, &open);
+	rocksock_multi_free(&m);
+	dprintf(2, "%lu open\n", open);
+	free(socks);
+	free(ops);
+	free(pfds);
 	return 0;
 }
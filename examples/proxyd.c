@@ -0,0 +1,564 @@
+/*
+ * socks4/4a, socks5 and http CONNECT proxy server on top of rocksockserver.
+ * the protocol is told apart by the first byte a client sends.
+ * upstream connects, including the name lookup, are asynchronous, and can
+ * go through a chain of upstream proxies given with -x. once connected,
+ * rocksock_relay moves the data with splice(2), so it never gets copied
+ * to userspace.
+ *
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <arpa/inet.h>
+#include "../rocksock.h"
+#include "../rocksockserver.h"
+
+enum { ST_FREE = 0, ST_HANDSHAKE, ST_RESOLVE, ST_CONNECT, ST_RELAY };
+enum { P_NONE = 0, P_SOCKS4, P_SOCKS5, P_HTTP };
+enum { S5_GREETING = 0, S5_AUTH, S5_REQUEST };
+enum { PARSE_FAIL = -1, PARSE_MORE = 0, PARSE_DONE = 1 };
+
+/* socks5 reply codes, also used to pick the socks4 and http replies */
+#define REP_OK 0
+#define REP_FAILURE 1
+#define REP_NET_UNREACHABLE 3
+#define REP_HOST_UNREACHABLE 4
+#define REP_REFUSED 5
+#define REP_TTL_EXPIRED 6
+
+#define SL(X) X, sizeof(X)-1
+
+typedef struct {
+	int state, proto, stage;
+	int fd;
+	char host[256];
+	unsigned short port;
+	/* handshake bytes received; what follows the request goes upstream */
+	char buf[2048];
+	size_t pos, len;
+	rocksock up;
+	rs_dnsBatch dns;
+	rs_dnsQuery query;
+	/* descriptors the name lookup or the upstream connect waits on */
+	struct pollfd pfd[RS_MAX_ADDRS];
+	int npfd;
+	long long deadline, wake;
+	rocksock client;
+	rs_relay relay;
+	/* what the relay waits for on the client and the upstream socket */
+	short rev[2];
+} session;
+
+static session sessions[USER_MAX_FD];
+/* for upstream and resolver descriptors: client fd + 1 of their session */
+static int owner[USER_MAX_FD];
+static rocksockserver srv;
+static rs_proxy proxies[16];
+static int nproxies, verbose;
+static unsigned long timeout = 10000, idle_timeout;
+static char auth_user[256], auth_pass[256], auth_basic[700];
+static rs_dnsConfig dnsconf;
+static rs_dnsCacheEntry dnsentries[1024];
+static rs_dnsCache dnscache;
+static int use_dns;
+
+static void usage(const char* prog) {
+	dprintf(2, "socks4/4a/5 and http CONNECT proxy\n"
+	           "usage: %s [-i listenip] [-p port] [-u user:pass] [-x proxy]... [-t timeout_ms] [-T idle_ms] [-v]\n"
+	           "-u requires socks5 username/password or http basic authentication,\n"
+	           "   socks4 clients are refused then\n"
+	           "-x connects through an upstream proxy, e.g. socks5://127.0.0.1:9050\n"
+	           "-t is the timeout for the request and the upstream connect (default 10000)\n"
+	           "-T closes connections idle for that many ms (default: never)\n"
+	           "every connection takes 6 descriptors, all below %d\n", prog, USER_MAX_FD);
+	exit(1);
+}
+
+static void base64(const char* in, char* out) {
+	static const char t[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	const unsigned char *p = (const unsigned char*) in;
+	size_t i, l = strlen(in);
+	unsigned v;
+	for(i = 0; i < l; i += 3) {
+		v = p[i] << 16 | (i + 1 < l ? p[i + 1] << 8 : 0) | (i + 2 < l ? p[i + 2] : 0);
+		*out++ = t[v >> 18];
+		*out++ = t[v >> 12 & 63];
+		*out++ = i + 1 < l ? t[v >> 6 & 63] : '=';
+		*out++ = i + 2 < l ? t[v & 63] : '=';
+	}
+	*out = 0;
+}
+
+static session* session_from_fd(int fd) {
+	if(fd < 0 || fd >= USER_MAX_FD) return 0;
+	if(owner[fd]) return &sessions[owner[fd] - 1];
+	return sessions[fd].state != ST_FREE ? &sessions[fd] : 0;
+}
+
+static void set_nonblock(int fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+static void unwatch(session* s) {
+	int i;
+	for(i = 0; i < s->npfd; i++) {
+		rocksockserver_unwatch_fd(&srv, s->pfd[i].fd);
+		owner[s->pfd[i].fd] = 0;
+	}
+	s->npfd = 0;
+}
+
+/* replaces the descriptors watched for the session. timeout_ms is when the
+   lookup or connect wants to be stepped anyway, or -1 */
+static int watch(session* s, struct pollfd* pfd, int n, int timeout_ms) {
+	int i;
+	unwatch(s);
+	for(i = 0; i < n; i++)
+		if(pfd[i].fd >= USER_MAX_FD) return -1;
+	for(i = 0; i < n; i++) {
+		s->pfd[i] = pfd[i];
+		owner[pfd[i].fd] = s->fd + 1;
+		rocksockserver_watch_fd(&srv, pfd[i].fd);
+	}
+	s->npfd = n;
+	s->wake = timeout_ms >= 0 ? rocksock_now_ms() + timeout_ms : 0;
+	return 0;
+}
+
+static void close_session(session* s) {
+	unwatch(s);
+	if(s->state == ST_RESOLVE) rocksock_dns_batch_close(&s->dns);
+	if(s->state == ST_RELAY) {
+		if(verbose) dprintf(2, "%s:%u: closed, %llu bytes sent, %llu received\n",
+		                    s->host, s->port, s->relay.bytes[0], s->relay.bytes[1]);
+		rocksock_relay_free(&s->relay);
+	}
+	rocksock_disconnect(&s->up);
+	s->state = ST_FREE;
+	rocksockserver_disconnect_client(&srv, s->fd);
+}
+
+static void reply(session* s, const void* data, size_t len) {
+	/* small and the first thing sent on the socket, so it fits */
+	send(s->fd, data, len, MSG_NOSIGNAL);
+}
+
+static void reply_result(session* s, int code) {
+	unsigned char b[10] = {0};
+	switch(s->proto) {
+	case P_SOCKS4:
+		b[1] = code ? 91 : 90;
+		reply(s, b, 8);
+		break;
+	case P_SOCKS5:
+		b[0] = 5;
+		b[1] = code;
+		b[3] = 1;
+		reply(s, b, 10);
+		break;
+	case P_HTTP:
+		if(code) reply(s, SL("HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n\r\n"));
+		else reply(s, SL("HTTP/1.1 200 Connection established\r\n\r\n"));
+		break;
+	}
+}
+
+static int reply_code(rocksock* sock) {
+	int e = sock->lasterror.error;
+	switch(sock->lasterror.errortype) {
+	case RS_ET_OWN:
+		switch(e) {
+		case RS_E_TARGETPROXY_NET_UNREACHABLE: return REP_NET_UNREACHABLE;
+		case RS_E_HIT_TIMEOUT: case RS_E_HIT_CONNECTTIMEOUT:
+		case RS_E_HIT_READTIMEOUT: case RS_E_HIT_WRITETIMEOUT:
+		case RS_E_DNS_NOT_FOUND: case RS_E_DNS_FAILURE:
+		case RS_E_TARGETPROXY_HOST_UNREACHABLE: return REP_HOST_UNREACHABLE;
+		case RS_E_TARGETPROXY_CONN_REFUSED: return REP_REFUSED;
+		case RS_E_TARGETPROXY_TTL_EXPIRED: return REP_TTL_EXPIRED;
+		}
+		break;
+	case RS_ET_SYS:
+		switch(e) {
+		case ECONNREFUSED: return REP_REFUSED;
+		case ENETUNREACH: return REP_NET_UNREACHABLE;
+		case EHOSTUNREACH: case ETIMEDOUT: return REP_HOST_UNREACHABLE;
+		}
+		break;
+	case RS_ET_GAI:
+		return REP_HOST_UNREACHABLE;
+	default:
+		break;
+	}
+	return REP_FAILURE;
+}
+
+static void fail(session* s, int code) {
+	if(verbose) dprintf(2, "%s:%u: failed (%d)\n", s->host, s->port, code);
+	reply_result(s, code);
+	close_session(s);
+}
+
+static int parse_socks4(session* s) {
+	unsigned char *b = (unsigned char*) s->buf;
+	char *user, *host, *z, *end = s->buf + s->len;
+	if(s->len < 9) return PARSE_MORE;
+	user = s->buf + 8;
+	if(!(z = memchr(user, 0, end - user))) return PARSE_MORE;
+	if(!b[4] && !b[5] && !b[6] && b[7]) {
+		/* socks4a, the hostname follows the userid */
+		host = z + 1;
+		if(!(z = memchr(host, 0, end - host))) return PARSE_MORE;
+		if(z - host >= (ptrdiff_t) sizeof(s->host)) return PARSE_FAIL;
+		memcpy(s->host, host, z - host + 1);
+	} else
+		inet_ntop(AF_INET, b + 4, s->host, sizeof(s->host));
+	s->port = b[2] << 8 | b[3];
+	s->pos = z + 1 - s->buf;
+	if(b[1] != 1 || auth_user[0]) {
+		reply_result(s, REP_FAILURE);
+		return PARSE_FAIL;
+	}
+	return PARSE_DONE;
+}
+
+static int parse_socks5(session* s) {
+	unsigned char *b;
+	size_t avail, n, ulen, plen;
+	int method, ok;
+	for(;;) {
+		b = (unsigned char*) s->buf + s->pos;
+		avail = s->len - s->pos;
+		switch(s->stage) {
+		case S5_GREETING:
+			if(avail < 2 || avail < 2 + (size_t) b[1]) return PARSE_MORE;
+			method = auth_user[0] ? 2 : 0;
+			if(!memchr(b + 2, method, b[1])) {
+				reply(s, "\x05\xff", 2);
+				return PARSE_FAIL;
+			}
+			reply(s, method ? "\x05\x02" : "\x05\x00", 2);
+			s->pos += 2 + b[1];
+			s->stage = method ? S5_AUTH : S5_REQUEST;
+			break;
+		case S5_AUTH:
+			if(avail < 2) return PARSE_MORE;
+			ulen = b[1];
+			if(avail < 3 + ulen) return PARSE_MORE;
+			plen = b[2 + ulen];
+			if(avail < 3 + ulen + plen) return PARSE_MORE;
+			ok = b[0] == 1 &&
+			     ulen == strlen(auth_user) && !memcmp(b + 2, auth_user, ulen) &&
+			     plen == strlen(auth_pass) && !memcmp(b + 3 + ulen, auth_pass, plen);
+			reply(s, ok ? "\x01\x00" : "\x01\x01", 2);
+			if(!ok) return PARSE_FAIL;
+			s->pos += 3 + ulen + plen;
+			s->stage = S5_REQUEST;
+			break;
+		case S5_REQUEST:
+			if(avail < 5) return PARSE_MORE;
+			switch(b[3]) {
+			case 1: n = 4; break;
+			case 3: n = 1 + b[4]; break;
+			case 4: n = 16; break;
+			default:
+				reply_result(s, 8);
+				return PARSE_FAIL;
+			}
+			if(avail < 6 + n) return PARSE_MORE;
+			if(b[3] == 1) inet_ntop(AF_INET, b + 4, s->host, sizeof(s->host));
+			else if(b[3] == 4) inet_ntop(AF_INET6, b + 4, s->host, sizeof(s->host));
+			else {
+				memcpy(s->host, b + 5, b[4]);
+				s->host[b[4]] = 0;
+			}
+			s->port = b[4 + n] << 8 | b[5 + n];
+			s->pos += 6 + n;
+			if(b[1] != 1) {
+				reply_result(s, 7);
+				return PARSE_FAIL;
+			}
+			return PARSE_DONE;
+		}
+	}
+}
+
+/* checks the Proxy-Authorization header among the headers in hdr */
+static int http_authorized(char* hdr) {
+	char *p, *e;
+	if(!auth_user[0]) return 1;
+	for(p = hdr; (p = strstr(p, "\r\n")); ) {
+		p += 2;
+		if(strncasecmp(p, "Proxy-Authorization:", 20)) continue;
+		for(p += 20; *p == ' ' || *p == '\t'; p++);
+		if(strncasecmp(p, "Basic ", 6)) return 0;
+		for(p += 6; *p == ' '; p++);
+		for(e = p; *e && *e != '\r' && *e != ' '; e++);
+		return (size_t)(e - p) == strlen(auth_basic) && !memcmp(p, auth_basic, e - p);
+	}
+	return 0;
+}
+
+static int parse_http(session* s) {
+	char *end, *p, *sp, *colon;
+	if(!(end = memmem(s->buf, s->len, "\r\n\r\n", 4))) return PARSE_MORE;
+	s->pos = end + 4 - s->buf;
+	end[2] = 0;
+	if(strncmp(s->buf, "CONNECT ", 8)) {
+		reply(s, SL("HTTP/1.1 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n"));
+		return PARSE_FAIL;
+	}
+	p = s->buf + 8;
+	if(!(sp = strchr(p, ' ')) || !(colon = memrchr(p, ':', sp - p))) goto bad;
+	s->port = atoi(colon + 1);
+	if(*p == '[' && colon[-1] == ']') {
+		p++;
+		colon--;
+	}
+	if(colon <= p || colon - p >= (ptrdiff_t) sizeof(s->host) || !s->port) goto bad;
+	memcpy(s->host, p, colon - p);
+	s->host[colon - p] = 0;
+	if(!http_authorized(sp)) {
+		reply(s, SL("HTTP/1.1 407 Proxy Authentication Required\r\n"
+		         "Proxy-Authenticate: Basic realm=\"proxy\"\r\nContent-Length: 0\r\n\r\n"));
+		return PARSE_FAIL;
+	}
+	return PARSE_DONE;
+bad:
+	reply(s, SL("HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n"));
+	return PARSE_FAIL;
+}
+
+static void relay_step(session* s) {
+	struct pollfd pfd[2];
+	int i, n, tmo;
+	if(rocksock_relay_step(&s->relay) || !(n = rocksock_relay_pollfds(&s->relay, pfd, &tmo))) {
+		close_session(s);
+		return;
+	}
+	s->rev[0] = s->rev[1] = 0;
+	for(i = 0; i < n; i++) s->rev[pfd[i].fd != s->fd] = pfd[i].events;
+	s->wake = tmo >= 0 ? rocksock_now_ms() + tmo : 0;
+}
+
+static int start_relay(session* s) {
+	struct pollfd pfd = {.fd = s->up.socket, .events = POLLIN};
+	size_t n;
+	/* what the client sent along with its request, it's small and the
+	   socket is fresh, so it doesn't block */
+	if(s->pos < s->len && rocksock_send(&s->up, s->buf + s->pos, s->len - s->pos, 0, &n))
+		return -1;
+	if(watch(s, &pfd, 1, -1) ||
+	   rocksock_relay_init(&s->relay, &s->client, &s->up, 0, 0, idle_timeout)) return -1;
+	s->state = ST_RELAY;
+	if(verbose) dprintf(2, "%s:%u: connected\n", s->host, s->port);
+	reply_result(s, REP_OK);
+	relay_step(s);
+	return 0;
+}
+
+static void connect_step(session* s) {
+	struct pollfd pfd[RS_MAX_ADDRS];
+	int fd, want, n, tmo;
+	if(rocksock_connect_step(&s->up, &fd, &want)) {
+		fail(s, reply_code(&s->up));
+		return;
+	}
+	if(want == RS_WANT_NONE) {
+		if(start_relay(s)) fail(s, REP_FAILURE);
+		return;
+	}
+	n = rocksock_connect_pollfds(&s->up, pfd, &tmo);
+	if(watch(s, pfd, n, tmo)) fail(s, REP_FAILURE);
+}
+
+static void start_connect(session* s) {
+	s->state = ST_CONNECT;
+	rocksock_init(&s->up, nproxies ? proxies : 0);
+	s->up.lastproxy = nproxies - 1;
+	if(rocksock_connect_start(&s->up, s->host, s->port, 0)) {
+		fail(s, reply_code(&s->up));
+		return;
+	}
+	connect_step(s);
+}
+
+static void resolve_step(session* s) {
+	struct pollfd pfd[2];
+	int n, tmo;
+	if(rocksock_dns_batch_step(&s->dns) == -1) {
+		fail(s, REP_FAILURE);
+		return;
+	}
+	if(!s->dns.pending) {
+		rocksock_dns_batch_close(&s->dns);
+		unwatch(s);
+		/* the addresses are in the dns cache now */
+		if(s->query.error) fail(s, REP_HOST_UNREACHABLE);
+		else start_connect(s);
+		return;
+	}
+	n = rocksock_dns_batch_pollfds(&s->dns, pfd, &tmo);
+	if(watch(s, pfd, n, tmo)) fail(s, REP_FAILURE);
+}
+
+/* request parsed: look up the target, unless it's an address or the
+   upstream proxies take care of it, then connect */
+static void start_request(session* s) {
+	unsigned char a[16];
+	s->deadline = rocksock_now_ms() + timeout;
+	if(use_dns && !nproxies && !inet_pton(AF_INET, s->host, a) && !inet_pton(AF_INET6, s->host, a)) {
+		s->query = (rs_dnsQuery) {.host = s->host};
+		if(rocksock_dns_batch_start(&s->dns, &dnsconf, &s->query, 1)) {
+			fail(s, REP_FAILURE);
+			return;
+		}
+		s->state = ST_RESOLVE;
+		resolve_step(s);
+	} else
+		start_connect(s);
+}
+
+static void read_request(session* s) {
+	ssize_t n;
+	int ret;
+	if(s->len == sizeof(s->buf) - 1) {
+		close_session(s);
+		return;
+	}
+	n = recv(s->fd, s->buf + s->len, sizeof(s->buf) - 1 - s->len, 0);
+	if(n <= 0) {
+		if(!n || (errno != EAGAIN && errno != EINTR)) close_session(s);
+		return;
+	}
+	s->len += n;
+	if(s->proto == P_NONE)
+		s->proto = s->buf[0] == 4 ? P_SOCKS4 : s->buf[0] == 5 ? P_SOCKS5 : P_HTTP;
+	switch(s->proto) {
+	case P_SOCKS4: ret = parse_socks4(s); break;
+	case P_SOCKS5: ret = parse_socks5(s); break;
+	default: ret = parse_http(s); break;
+	}
+	if(ret == PARSE_FAIL) close_session(s);
+	else if(ret == PARSE_DONE) start_request(s);
+}
+
+static void timers(session* s) {
+	long long now = rocksock_now_ms();
+	/* clients that don't finish their request in time get dropped */
+	if(s->state == ST_HANDSHAKE) {
+		if(now >= s->deadline) close_session(s);
+	} else if(s->state != ST_RELAY && now >= s->deadline) fail(s, REP_HOST_UNREACHABLE);
+	else if(s->wake && now >= s->wake) {
+		if(s->state == ST_RESOLVE) resolve_step(s);
+		else if(s->state == ST_CONNECT) connect_step(s);
+		else relay_step(s);
+	}
+}
+
+static void upstream_event(session* s, int fd, short ev) {
+	int i;
+	for(i = 0; i < s->npfd; i++)
+		if(s->pfd[i].fd == fd && (s->pfd[i].events & ev)) {
+			if(s->state == ST_RESOLVE) resolve_step(s);
+			else connect_step(s);
+			return;
+		}
+}
+
+static int on_cconnect(void* userdata, struct sockaddr_storage* clientaddr, int fd) {
+	session *s = &sessions[fd];
+	memset(s, 0, sizeof(*s));
+	s->state = ST_HANDSHAKE;
+	s->fd = fd;
+	s->deadline = rocksock_now_ms() + timeout;
+	rocksock_init(&s->up, 0);
+	rocksock_init(&s->client, 0);
+	rocksock_set_socket(&s->client, fd);
+	set_nonblock(fd);
+	return 0;
+}
+
+static int on_cread(void* userdata, int fd, size_t dummy) {
+	session *s = session_from_fd(fd);
+	if(!s) return 0;
+	if(s->state == ST_RELAY) {
+		if(s->rev[fd != s->fd] & POLLIN) relay_step(s);
+	} else if(fd != s->fd) upstream_event(s, fd, POLLIN);
+	else if(s->state == ST_HANDSHAKE) read_request(s);
+	return 0;
+}
+
+static int on_cwantsdata(void* userdata, int fd) {
+	session *s = session_from_fd(fd);
+	if(!s) return 0;
+	if(s->state == ST_RELAY && (s->rev[fd != s->fd] & POLLOUT)) relay_step(s);
+	else if(fd != s->fd) {
+		/* writable upstream: only of interest while connecting */
+		if(s->state != ST_RELAY) upstream_event(s, fd, POLLOUT);
+	} else
+		/* the client is writable all the time, which makes this
+		   the place to check for timeouts */
+		timers(s);
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	const char *listenip = "0.0.0.0";
+	unsigned short port = 1080;
+	rocksock chain;
+	char *p;
+	int c;
+
+	rocksock_init(&chain, proxies);
+	while((c = getopt(argc, argv, "i:p:u:x:t:T:v")) != -1) switch(c) {
+		case 'i': listenip = optarg; break;
+		case 'p': port = atoi(optarg); break;
+		case 'u':
+			if(!(p = strchr(optarg, ':')) || p == optarg || p - optarg >= (ptrdiff_t) sizeof(auth_user) ||
+			   strlen(p + 1) >= sizeof(auth_pass)) usage(argv[0]);
+			memcpy(auth_user, optarg, p - optarg);
+			strcpy(auth_pass, p + 1);
+			base64(optarg, auth_basic);
+			break;
+		case 'x':
+			if(rocksock_add_proxy_fromstring(&chain, optarg)) {
+				dprintf(2, "invalid proxy %s: %s\n", optarg, rocksock_strerror(&chain));
+				return 1;
+			}
+			break;
+		case 't': timeout = strtoul(optarg, 0, 10); break;
+		case 'T': idle_timeout = strtoul(optarg, 0, 10); break;
+		case 'v': verbose = 1; break;
+		default: usage(argv[0]);
+	}
+	if(optind != argc) usage(argv[0]);
+	nproxies = chain.lastproxy + 1;
+
+	/* lookups of client-supplied names go through the stub resolver, whose
+	   results the cache hands to rocksock_connect_start */
+	if(!rocksock_dns_init(&dnsconf) &&
+	   !rocksock_dnscache_init(&dnscache, dnsentries, sizeof(dnsentries)/sizeof(dnsentries[0]), 60000, 5000)) {
+		rocksock_dnscache_use(&dnscache);
+		rocksock_dns_use(&dnsconf);
+		use_dns = 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	if(rocksockserver_init(&srv, listenip, port, 0)) {
+		dprintf(2, "failed to listen on %s:%u\n", listenip, port);
+		return 1;
+	}
+	/* the loop sleeps after each round, which bounds the latency */
+	rocksockserver_set_sleeptime(&srv, 1000);
+	return rocksockserver_loop(&srv, NULL, 0, on_cconnect, on_cread, on_cwantsdata, 0);
+}
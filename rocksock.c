@@ -18,8 +18,11 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <limits.h>
+#include <time.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #ifndef SOCK_CLOEXEC
 #warning compiling without SOCK_CLOEXEC support
@@ -83,6 +86,9 @@ static int isnumericipv4(const char* ipstring) {
 #ifndef MSG_NOSIGNAL
 #define MSG_NOSIGNAL 0
 #endif
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
 
 #ifdef USE_SSL
 #include "rocksock_ssl_internal.h"
@@ -98,49 +104,85 @@ int rocksock_seterror(rocksock* sock, rs_errorType errortype, int error, const c
 	return error;
 }
 
+long long rocksock_now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
 #define MKOERR(S, X) rocksock_seterror(S, RS_ET_OWN, X, ROCKSOCK_FILENAME, __LINE__)
 #define NOERR(S) rocksock_seterror(S, RS_ET_OWN, 0, NULL, 0)
 #define MKSYSERR(S, X) rocksock_seterror(S, RS_ET_SYS, X, ROCKSOCK_FILENAME, __LINE__)
 
+#ifndef NO_DNS_SUPPORT
+static struct addrinfo* ai_next_family(struct addrinfo* ai, int family, int match) {
+	while(ai && (ai->ai_family == family) != match) ai = ai->ai_next;
+	return ai;
+}
+
+/* returns 0 or a getaddrinfo error. the address families are interleaved,
+   starting with the preferred one (RFC 8305 section 4). */
+static int resolve_gai(const char* host, rs_sockAddr* addrs, int* count) {
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_ADDRCONFIG};
+	int ret, i, n = 0;
+	struct addrinfo *cur[2], *save;
+	ret = getaddrinfo(host, NULL, &hints, &save);
+	if(ret) {
+		*count = 0;
+		return ret;
+	}
+	cur[0] = save;
+	cur[1] = ai_next_family(save, save->ai_family, 0);
+	for(i = 0; n < *count && (cur[0] || cur[1]); i ^= 1) {
+		if(!cur[i]) continue;
+		if(cur[i]->ai_family == AF_INET || cur[i]->ai_family == AF_INET6)
+			memcpy(&addrs[n++], cur[i]->ai_addr, cur[i]->ai_addrlen);
+		cur[i] = ai_next_family(cur[i]->ai_next, save->ai_family, !i);
+	}
+	freeaddrinfo(save);
+	*count = n;
+	return n ? 0 : EAI_FAMILY;
+}
+#endif
+
+rs_resolverFunc rocksock_resolver;
+
+/* resolves hostinfo into up to *count addresses, consulting the
+   process-wide dns cache if one was set up. */
 //#define NO_DNS_SUPPORT
-static int rocksock_resolve_host(rocksock* sock, rs_hostInfo* hostinfo, rs_resolveStorage* result) {
+static int rocksock_resolve_host(rocksock* sock, rs_hostInfo* hostinfo, rs_sockAddr* addrs, int* count) {
 	if (!sock) return RS_E_NULL;
 	if (!hostinfo || !hostinfo->host[0] || !hostinfo->port) return MKOERR(sock, RS_E_NULL);
 
-	result->hostaddr = &(result->hostaddr_buf);
-
-#ifndef NO_DNS_SUPPORT
-	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM, .ai_flags = AI_ADDRCONFIG};
-	int ret;
-	struct addrinfo *best, *save;
-	ret = getaddrinfo(hostinfo->host, NULL, &hints, &save);
-	if(!ret) {
-		best = save;
-		while(best->ai_addr->sa_family == AF_INET6 && best->ai_next) best = best->ai_next;
-		*result->hostaddr = *best;
-		result->hostaddr->ai_addr = (struct sockaddr*) &(result->hostaddr_aiaddr_buf);
-		result->hostaddr->ai_next = 0;
-		*result->hostaddr->ai_addr = *best->ai_addr;
-
-		if(result->hostaddr->ai_addr->sa_family == AF_INET)
-			((struct sockaddr_in*) result->hostaddr->ai_addr)->sin_port = htons(hostinfo->port);
-		else
-			((struct sockaddr_in6*) result->hostaddr->ai_addr)->sin6_port = htons(hostinfo->port);
-		freeaddrinfo(save);
-		return 0;
-	} else
-		return rocksock_seterror(sock, RS_ET_GAI, ret, ROCKSOCK_FILENAME, __LINE__);
+	int ret, type = RS_ET_OWN, i;
+	/* the stub resolver consults and feeds the dns cache itself */
+	if(rocksock_resolver) {
+		ret = rocksock_resolver(hostinfo->host, addrs, count, &type);
+	} else {
+#ifdef NO_DNS_SUPPORT
+		/* without a resolver hosts can only be ipv4 literals, which are
+		   parsed here and not cached */
+		ret = 0;
+		memset(&addrs[0], 0, sizeof(addrs[0]));
+		addrs[0].v4.sin_family = AF_INET;
+		ipv4fromstring(hostinfo->host, (unsigned char*) &addrs[0].v4.sin_addr);
+		*count = 1;
 #else
-	result->hostaddr->ai_addr = (struct sockaddr*) &(result->hostaddr_aiaddr_buf);
-
-	((struct sockaddr_in*) result->hostaddr->ai_addr)->sin_port = htons(hostinfo->port);
-	((struct sockaddr_in*) result->hostaddr->ai_addr)->sin_family = AF_INET;
-	result->hostaddr->ai_addr->sa_family = AF_INET;
-	result->hostaddr->ai_addrlen = sizeof(struct sockaddr_in);
-	ipv4fromstring(hostinfo->host, (unsigned char*) &((struct sockaddr_in*) result->hostaddr->ai_addr)->sin_addr);
-
-	return 0;
+		if(!rocksock_dnscache_get(hostinfo->host, addrs, count, &type, &ret)) {
+			type = RS_ET_GAI;
+			ret = resolve_gai(hostinfo->host, addrs, count);
+			rocksock_dnscache_put(hostinfo->host, addrs, *count, type, ret);
+		}
 #endif
+	}
+	if(ret) return rocksock_seterror(sock, type, ret, ROCKSOCK_FILENAME, __LINE__);
+	for(i = 0; i < *count; i++) {
+		if(addrs[i].sa.sa_family == AF_INET)
+			addrs[i].v4.sin_port = htons(hostinfo->port);
+		else
+			addrs[i].v6.sin6_port = htons(hostinfo->port);
+	}
+	return 0;
 }
 
 int rocksock_set_timeout(rocksock* sock, unsigned long timeout_millisec) {
@@ -149,6 +191,59 @@ int rocksock_set_timeout(rocksock* sock, unsigned long timeout_millisec) {
 	return NOERR(sock);
 }
 
+int rocksock_set_deadline(rocksock* sock, long long deadline_ms) {
+	if (!sock) return RS_E_NULL;
+	sock->deadline = deadline_ms;
+	return NOERR(sock);
+}
+
+int rocksock_set_pipelining(rocksock* sock, int enable) {
+	if (!sock) return RS_E_NULL;
+	sock->pipeline = enable;
+	return NOERR(sock);
+}
+
+int rocksock_set_readbuffer(rocksock* sock, char* buffer, size_t size) {
+	if (!sock) return RS_E_NULL;
+	if (buffer && !size) return MKOERR(sock, RS_E_NULL);
+	sock->rbuf = buffer;
+	sock->rbufsize = buffer ? size : 0;
+	sock->rpos = sock->rlen = 0;
+	return NOERR(sock);
+}
+
+int rocksock_set_writebuffer(rocksock* sock, char* buffer, size_t size, size_t flush_at) {
+	int ret;
+	if (!sock) return RS_E_NULL;
+	if (buffer && !size) return MKOERR(sock, RS_E_NULL);
+	if (sock->wlen && (ret = rocksock_flush(sock))) return ret;
+	sock->wbuf = buffer;
+	sock->wbufsize = buffer ? size : 0;
+	sock->wflush = flush_at && flush_at < size ? flush_at : size;
+	sock->wlen = 0;
+	return NOERR(sock);
+}
+
+int rocksock_set_sslctx(rocksock* sock, rs_sslContext* c) {
+	if (!sock) return RS_E_NULL;
+	sock->sslcontext = c;
+	return NOERR(sock);
+}
+
+int rocksock_set_fastopen(rocksock* sock, int enable) {
+	if (!sock) return RS_E_NULL;
+	sock->fastopen = enable;
+	return NOERR(sock);
+}
+
+int rocksock_set_early_data(rocksock* sock, const void* data, size_t len) {
+	if (!sock) return RS_E_NULL;
+	if (!data && len) return MKOERR(sock, RS_E_NULL);
+	sock->early_data = data;
+	sock->early_len = len;
+	return NOERR(sock);
+}
+
 int rocksock_init(rocksock* sock, rs_proxy *proxies) {
 	if (!sock) return RS_E_NULL;
 	memset(sock, 0, sizeof(rocksock));
@@ -166,51 +261,216 @@ static struct timeval* make_timeval(struct timeval* tv, unsigned long timeout) {
 	return tv;
 }
 
-static int do_connect(rocksock* sock, rs_resolveStorage* hostinfo, unsigned long timeout) {
-	int flags, ret;
-	fd_set wset;
-	struct timeval tv;
-	int optval;
-	socklen_t optlen = sizeof(optval);
+enum rs_connectStates {
+	RS_CS_NONE = 0,
+	RS_CS_CONNECT,
+	/* states between RS_CS_HOP and RS_CS_HTTP_HEADERS talk to proxy px */
+	RS_CS_HOP,
+	RS_CS_SOCKS4_REPLY,
+	RS_CS_SOCKS5_METHOD,
+	RS_CS_SOCKS5_AUTH,
+	RS_CS_SOCKS5_REPLY,
+	RS_CS_SOCKS5_REPLY_ADDR,
+	RS_CS_HTTP_REPLY,
+	RS_CS_HTTP_HEADERS,
+	RS_CS_EARLY_DATA,
+	RS_CS_SSL,
+	RS_CS_DONE,
+};
+
+/* process-wide tcp fast open counters, see rocksock_fastopen_stats() */
+static unsigned long tfo_attempts, tfo_acked, tfo_fallbacks;
+
+void rocksock_fastopen_stats(unsigned long *attempts, unsigned long *acked, unsigned long *fallbacks) {
+	if(attempts) *attempts = __sync_fetch_and_add(&tfo_attempts, 0);
+	if(acked) *acked = __sync_fetch_and_add(&tfo_acked, 0);
+	if(fallbacks) *fallbacks = __sync_fetch_and_add(&tfo_fallbacks, 0);
+}
+
+/* initiates the connect with a SYN carrying the first request to the first
+   hop. returns 0 and sets *sent to the number of bytes that went out with
+   it (0 if the kernel has no cookie for the peer yet, in which case it
+   asks for one), or -1 with errno set. */
+static int fastopen_connect(rocksock* sock, int fd, rs_sockAddr* addr, size_t* sent) {
+#ifdef MSG_FASTOPEN
+	rs_connectState *cs = &sock->cs;
+	struct iovec iov[2] = {
+		{.iov_base = cs->buf, .iov_len = cs->len},
+		{.iov_base = (void*) cs->xdata, .iov_len = cs->xlen},
+	};
+	struct msghdr msg = {
+		.msg_name = addr,
+		.msg_namelen = addr->sa.sa_family == AF_INET ? sizeof(addr->v4) : sizeof(addr->v6),
+		.msg_iov = iov + !cs->len,
+		.msg_iovlen = !!cs->len + !!cs->xlen,
+	};
+	ssize_t n = sendmsg(fd, &msg, MSG_FASTOPEN | MSG_NOSIGNAL);
+	*sent = 0;
+	if(n == -1) return errno == EINPROGRESS ? 0 : -1;
+	*sent = n;
+	return 0;
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
+static int do_connect(rocksock* sock, rs_sockAddr* addr, int* fd, size_t* synsent) {
+	int ret;
 
-	sock->socket = socket(hostinfo->hostaddr->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
-	if(sock->socket == -1) return MKSYSERR(sock, errno);
+	*fd = socket(addr->sa.sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(*fd == -1) return MKSYSERR(sock, errno);
 
-	/* the socket has to be made non-blocking temporarily so we can enforce a connect timeout */
-	flags = fcntl(sock->socket, F_GETFL);
-	if(flags == -1) return MKSYSERR(sock, errno);
+	/* the socket stays non-blocking until the connect and all proxy/ssl
+	   handshakes are done, so they can be driven by rocksock_connect_step() */
+	sock->cs.fdflags = fcntl(*fd, F_GETFL);
+	if(sock->cs.fdflags == -1) return MKSYSERR(sock, errno);
 
-	if(fcntl(sock->socket, F_SETFL, flags | O_NONBLOCK) == -1) return errno;
+	if(fcntl(*fd, F_SETFL, sock->cs.fdflags | O_NONBLOCK) == -1) return MKSYSERR(sock, errno);
 
-	ret = connect(sock->socket, hostinfo->hostaddr->ai_addr, hostinfo->hostaddr->ai_addrlen);
+	*synsent = 0;
+	if(sock->cs.synstate != RS_CS_NONE) {
+		ret = fastopen_connect(sock, *fd, addr, synsent);
+		if(!ret) {
+			__sync_fetch_and_add(&tfo_attempts, 1);
+			return 0;
+		}
+		/* disabled in the kernel, or not available at all */
+		if(errno != EOPNOTSUPP && errno != ENOPROTOOPT && errno != EINVAL)
+			return MKSYSERR(sock, errno);
+		__sync_fetch_and_add(&tfo_fallbacks, 1);
+		sock->cs.synstate = RS_CS_NONE;
+	}
+	ret = connect(*fd, &addr->sa, addr->sa.sa_family == AF_INET ? sizeof(addr->v4) : sizeof(addr->v6));
 	if(ret == -1) {
 		ret = errno;
 		if (!(ret == EINPROGRESS || ret == EWOULDBLOCK)) return MKSYSERR(sock, ret);
 	}
+	return 0;
+}
+
+/* sets *connected if the non-blocking connect() on fd is complete */
+static int check_connect(rocksock* sock, int fd, int* connected) {
+	int optval;
+	socklen_t optlen = sizeof(optval);
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+
+	*connected = 0;
+	if(getsockopt(fd, SOL_SOCKET, SO_ERROR, &optval, &optlen) == -1)
+		return MKSYSERR(sock, errno);
+	if(optval) return MKSYSERR(sock, optval);
+	if(getpeername(fd, (struct sockaddr*) &addr, &addrlen) == -1) {
+		if(errno != ENOTCONN) return MKSYSERR(sock, errno);
+	} else *connected = 1;
+	return 0;
+}
+
+/* time to wait for an attempt to succeed before racing the next address
+   against it, as recommended by RFC 8305 section 5. */
+#ifndef RS_CONNECT_ATTEMPT_DELAY
+#define RS_CONNECT_ATTEMPT_DELAY 250
+#endif
+
+/* starts a connection attempt to the next address. addresses that fail
+   right away (e.g. unreachable network) are skipped. */
+static int he_attempt(rocksock* sock) {
+	rs_connectState *cs = &sock->cs;
+	int ret = 0, fd, i;
+	while(cs->nextaddr < cs->naddrs) {
+		i = cs->nextaddr++;
+		ret = do_connect(sock, &cs->addrs[i], &fd, &cs->synsent[i]);
+		if(!ret) {
+			cs->fds[i] = fd;
+			sock->socket = fd;
+			cs->t_attempt = rocksock_now_ms();
+			return 0;
+		}
+		if(fd != -1) close(fd);
+	}
+	return ret;
+}
 
-	if(fcntl(sock->socket, F_SETFL, flags) == -1) return MKSYSERR(sock, errno);
+static int he_pollfds(rs_connectState *cs, struct pollfd* pfd) {
+	int i, n = 0;
+	for(i = 0; i < cs->nextaddr; i++) if(cs->fds[i] != -1) {
+		pfd[n].fd = cs->fds[i];
+		pfd[n].events = POLLOUT;
+		pfd[n].revents = 0;
+		n++;
+	}
+	return n;
+}
 
-	FD_ZERO(&wset);
-	FD_SET(sock->socket, &wset);
+static void he_close(rs_connectState *cs, int keep) {
+	int i;
+	for(i = 0; i < cs->nextaddr; i++) if(cs->fds[i] != -1) {
+		if(cs->fds[i] != keep) close(cs->fds[i]);
+		cs->fds[i] = -1;
+	}
+}
 
-	ret = select(sock->socket+1, NULL, &wset, NULL, timeout ? make_timeval(&tv, timeout) : NULL);
+/* the first request of the winning attempt continues behind the part
+   that went out with its SYN. */
+static void fastopen_done(rocksock* sock, int i) {
+	rs_connectState *cs = &sock->cs;
+#ifdef TCPI_OPT_SYN_DATA
+	struct tcp_info ti;
+	socklen_t l = sizeof(ti);
+	if(cs->synsent[i] && !getsockopt(sock->socket, IPPROTO_TCP, TCP_INFO, &ti, &l) &&
+	   (ti.tcpi_options & TCPI_OPT_SYN_DATA))
+		__sync_fetch_and_add(&tfo_acked, 1);
+#endif
+	cs->pos = cs->synsent[i];
+}
 
-	if(ret == 1 && FD_ISSET(sock->socket, &wset)) {
-		ret = getsockopt(sock->socket, SOL_SOCKET, SO_ERROR, &optval,&optlen);
-		if(ret == -1) return MKSYSERR(sock, errno);
-		else if(optval) return MKSYSERR(sock, optval);
-		return 0;
-	} else if(ret == 0) return MKOERR(sock, RS_E_HIT_CONNECTTIMEOUT);
+/* checks all connection attempts in flight. the first one to succeed
+   becomes sock->socket and the others are closed. */
+static int he_check(rocksock* sock, int* want) {
+	rs_connectState *cs = &sock->cs;
+	struct pollfd pfd[RS_MAX_ADDRS];
+	int i, j, n, alive, connected, ret = 0;
 
-	return MKSYSERR(sock, errno);
+	alive = n = he_pollfds(cs, pfd);
+	if(n && poll(pfd, n, 0) == -1 && errno != EINTR) return MKSYSERR(sock, errno);
+	for(i = 0; i < n; i++) {
+		if(!pfd[i].revents) continue;
+		for(j = 0; cs->fds[j] != pfd[i].fd; j++);
+		ret = check_connect(sock, pfd[i].fd, &connected);
+		if(ret) {
+			close(pfd[i].fd);
+			cs->fds[j] = -1;
+			alive--;
+		} else if(connected) {
+			he_close(cs, pfd[i].fd);
+			sock->socket = pfd[i].fd;
+			if(cs->synstate != RS_CS_NONE) fastopen_done(sock, j);
+			/* fresh sockets have no SO_RCVTIMEO/SO_SNDTIMEO */
+			sock->rcvtimeo = sock->sndtimeo = 0;
+			return 0;
+		}
+	}
+	if(cs->nextaddr < cs->naddrs &&
+	   (!alive || rocksock_now_ms() - cs->t_attempt >= RS_CONNECT_ATTEMPT_DELAY)) {
+		ret = he_attempt(sock);
+		if(!ret) alive++;
+	}
+	if(!alive) {
+		sock->socket = -1;
+		return ret;
+	}
+	for(i = cs->nextaddr - 1; cs->fds[i] == -1; i--);
+	sock->socket = cs->fds[i];
+	*want = RS_WANT_WRITE;
+	return 0;
 }
 
-static int rocksock_setup_socks4_header(rocksock* sock, int is4a, char* buffer, rs_proxy* proxy, size_t* bytesused) {
+static int rocksock_setup_socks4_header(rocksock* sock, int is4a, char* buffer, rs_hostInfo* hostinfo, size_t* bytesused) {
 	int ret;
 	buffer[0] = 4;
 	buffer[1] = 1;
-	buffer[2] = proxy->hostinfo.port / 256;
-	buffer[3] = proxy->hostinfo.port % 256;
+	buffer[2] = hostinfo->port / 256;
+	buffer[3] = hostinfo->port % 256;
 
 	if(is4a) {
 		buffer[4] = 0;
@@ -218,38 +478,318 @@ static int rocksock_setup_socks4_header(rocksock* sock, int is4a, char* buffer,
 		buffer[6] = 0;
 		buffer[7] = 1;
 	} else {
-		rs_resolveStorage stor;
-		ret = rocksock_resolve_host(sock, &proxy->hostinfo, &stor);
+		rs_sockAddr addrs[RS_MAX_ADDRS];
+		int i, n = RS_MAX_ADDRS;
+		ret = rocksock_resolve_host(sock, hostinfo, addrs, &n);
 		if(ret) return ret;
-		if(stor.hostaddr->ai_family != AF_INET)
+		for(i = 0; i < n && addrs[i].sa.sa_family != AF_INET; i++);
+		if(i == n)
 			return MKOERR(sock, RS_E_SOCKS4_NO_IP6);
-		buffer[4] = ((char*) &(((struct sockaddr_in*) stor.hostaddr->ai_addr)->sin_addr.s_addr))[0];
-		buffer[5] = ((char*) &(((struct sockaddr_in*) stor.hostaddr->ai_addr)->sin_addr.s_addr))[1];
-		buffer[6] = ((char*) &(((struct sockaddr_in*) stor.hostaddr->ai_addr)->sin_addr.s_addr))[2];
-		buffer[7] = ((char*) &(((struct sockaddr_in*) stor.hostaddr->ai_addr)->sin_addr.s_addr))[3];
+		memcpy(buffer + 4, &addrs[i].v4.sin_addr.s_addr, 4);
 	}
 	buffer[8] = 0;
 	*bytesused = 9;
 	if(is4a) {
 		char *p = buffer + *bytesused;
-		size_t l = strlen(proxy->hostinfo.host) + 1;
+		size_t l = strlen(hostinfo->host) + 1;
 		/* memcpy is safe because all functions accepting a hostname check it's < 255 */
-		memcpy(p, proxy->hostinfo.host, l);
+		memcpy(p, hostinfo->host, l);
 		*bytesused += l;
 	}
 	return NOERR(sock);
 }
 
-int rocksock_connect(rocksock* sock, const char* host, unsigned short port, int useSSL) {
-	ptrdiff_t px;
-	int ret, trysocksv4a;
-	rs_hostInfo targethost;
+/* the first len bytes of cs->buf get sent, then expect bytes are read back */
+static void cs_request(rs_connectState* cs, int state, size_t len, size_t expect) {
+	cs->state = state;
+	cs->sending = 1;
+	cs->pos = 0;
+	cs->len = len;
+	cs->expect = expect;
+	cs->xdata = 0;
+	cs->xlen = 0;
+}
+
+static void cs_expect(rs_connectState* cs, int state, size_t len) {
+	cs->state = state;
+	cs->sending = 0;
+	cs->pos = 0;
+	cs->len = len;
+	cs->xdata = 0;
+	cs->xlen = 0;
+}
+
+/* early data to be sent on a direct connection */
+static void cs_early_request(rocksock* sock) {
+	rs_connectState *cs = &sock->cs;
+	cs_request(cs, RS_CS_EARLY_DATA, 0, 0);
+	cs->xdata = sock->early_data;
+	cs->xlen = sock->early_len;
+}
+
+/* the early data travels with the connect request for the last hop */
+static void cs_last_request(rocksock* sock) {
+	rs_connectState *cs = &sock->cs;
+	if(cs->px != sock->lastproxy) return;
+	cs->xdata = sock->early_data;
+	cs->xlen = sock->early_len;
+}
+
+/* advances the pending request. when it would block, *want is set. */
+static int cs_transfer(rocksock* sock, int* want) {
+	rs_connectState *cs = &sock->cs;
+	struct iovec iov[2];
+	struct msghdr msg = {.msg_iov = iov};
+	ssize_t n;
+	for(;;) {
+		if(cs->pos == cs->len + (cs->sending ? cs->xlen : 0)) {
+			if(!cs->sending) return 0;
+			cs_expect(cs, cs->state, cs->expect);
+			continue;
+		}
+		if(cs->sending) {
+			if(cs->pos < cs->len) {
+				iov[0].iov_base = cs->buf + cs->pos;
+				iov[0].iov_len = cs->len - cs->pos;
+				iov[1].iov_base = (void*) cs->xdata;
+				iov[1].iov_len = cs->xlen;
+				msg.msg_iovlen = cs->xlen ? 2 : 1;
+			} else {
+				iov[0].iov_base = (void*) (cs->xdata + (cs->pos - cs->len));
+				iov[0].iov_len = cs->len + cs->xlen - cs->pos;
+				msg.msg_iovlen = 1;
+			}
+			n = sendmsg(sock->socket, &msg, MSG_NOSIGNAL);
+		} else
+			n = recv(sock->socket, cs->buf + cs->pos, cs->len - cs->pos, 0);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				*want = cs->sending ? RS_WANT_WRITE : RS_WANT_READ;
+				return 0;
+			}
+			return MKSYSERR(sock, errno);
+		}
+		if(!n && !cs->sending) return MKOERR(sock, RS_E_REMOTE_DISCONNECTED);
+		cs->pos += n;
+	}
+}
+
+/* eats the remainder of a HTTP proxy's response header, but not a single
+   byte of the payload that may follow it. */
+static int cs_skip_http_headers(rocksock* sock, int* want) {
+	rs_connectState *cs = &sock->cs;
+	ssize_t n, i;
+	for(;;) {
+		n = recv(sock->socket, cs->buf, sizeof(cs->buf), MSG_PEEK);
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				*want = RS_WANT_READ;
+				return 0;
+			}
+			return MKSYSERR(sock, errno);
+		}
+		if(!n) return MKOERR(sock, RS_E_REMOTE_DISCONNECTED);
+		for(i = 0; i < n && cs->newlines < 2; i++) {
+			if(cs->buf[i] == '\n') cs->newlines++;
+			else if(cs->buf[i] != '\r') cs->newlines = 0;
+		}
+		if(recv(sock->socket, cs->buf, i, 0) != i) return MKSYSERR(sock, errno);
+		if(cs->newlines == 2) return 0;
+	}
+}
+
+static rs_hostInfo* cs_hop_target(rocksock* sock) {
+	if(sock->cs.px == sock->lastproxy) return &sock->cs.target;
+	return &sock->proxies[sock->cs.px + 1].hostinfo;
+}
+
+static int socks5_has_auth(rs_proxy* proxy) {
+	return proxy->username[0] && proxy->password[0];
+}
+
+/* writes the username/password request to p, returns its length */
+static size_t socks5_auth_request(rs_proxy* proxy, char* p) {
+	char *start = p;
+	size_t bytes;
+	/*
+	+----+------+----------+------+----------+
+	|VER | ULEN |  UNAME   | PLEN |  PASSWD  |
+	+----+------+----------+------+----------+
+	| 1  |  1   | 1 to 255 |  1   | 1 to 255 |
+	+----+------+----------+------+----------+
+	*/
+	*p++ = 1;
+	bytes = strlen(proxy->username);
+	*p++ = bytes;
+	memcpy(p, proxy->username, bytes);
+	p += bytes;
+	bytes = strlen(proxy->password);
+	*p++ = bytes;
+	memcpy(p, proxy->password, bytes);
+	p += bytes;
+	return p - start;
+}
+
+static void cs_socks5_auth(rocksock* sock) {
+	rs_connectState *cs = &sock->cs;
+	cs_request(cs, RS_CS_SOCKS5_AUTH, socks5_auth_request(&sock->proxies[cs->px], cs->buf), 2);
+}
+
+/* writes the connect request for the next hop to p */
+static int socks5_connect_request(rocksock* sock, char* p, size_t* len) {
+	rs_hostInfo *target = cs_hop_target(sock);
+	char *start = p;
+	size_t bytes;
+
+	*p++ = 5;
+	*p++ = 1;
+	*p++ = 0;
+	if(isnumericipv4(target->host)) {
+		*p++ = 1; // ipv4 method
+		bytes = 4;
+		ipv4fromstring(target->host, (unsigned char*) p);
+	} else {
+		*p++ = 3; //hostname method, requires the server to do dns lookups.
+		bytes = strlen(target->host);
+		if(bytes > 255)
+			return MKOERR(sock, RS_E_SOCKS5_AUTH_EXCEEDSIZE);
+		*p++ = bytes;
+		memcpy(p, target->host, bytes);
+	}
+	p+=bytes;
+	*p++ = target->port / 256;
+	*p++ = target->port % 256;
+	*len = p - start;
+	return 0;
+}
+
+static int cs_socks5_connect(rocksock* sock) {
+	rs_connectState *cs = &sock->cs;
+	size_t bytes;
+	int ret = socks5_connect_request(sock, cs->buf, &bytes);
+	if(ret) return ret;
+	/* read up to the first byte of the bound address, which tells us
+	   the length of the rest of the reply in case of a domain name */
+	cs_request(cs, RS_CS_SOCKS5_REPLY, bytes, 5);
+	cs_last_request(sock);
+	return 0;
+}
+
+static int cs_start_hop(rocksock* sock) {
+	rs_connectState *cs = &sock->cs;
+	rs_proxy *proxy = &sock->proxies[cs->px];
+	rs_hostInfo *target = cs_hop_target(sock);
+	char *p = cs->buf;
+	size_t bytes;
+	int ret;
+
+	switch(proxy->proxytype) {
+		case RS_PT_SOCKS4:
+			ret = rocksock_setup_socks4_header(sock, cs->trysocksv4a, cs->buf, target, &bytes);
+			if(ret) return ret;
+			/* early data waits for the reply instead, a socks4a request
+			   that's rejected is repeated as socks4 */
+			cs_request(cs, RS_CS_SOCKS4_REPLY, bytes, 8);
+			break;
+		case RS_PT_SOCKS5:
+			cs->pipelined = sock->pipeline;
+			*p++ = 5;
+			if(cs->pipelined) {
+				/* offer only the method the requests below are made for */
+				*p++ = 1;
+				*p++ = socks5_has_auth(proxy) ? 2 : 0;
+				if(socks5_has_auth(proxy)) p += socks5_auth_request(proxy, p);
+				ret = socks5_connect_request(sock, p, &bytes);
+				if(ret) return ret;
+				p += bytes;
+			} else if(socks5_has_auth(proxy)) {
+				*p++ = 2;
+				*p++ = 0;
+				*p++ = 2;
+			} else {
+				*p++ = 1;
+				*p++ = 0;
+			}
+			cs_request(cs, RS_CS_SOCKS5_METHOD, p - cs->buf, 2);
+			if(cs->pipelined) cs_last_request(sock);
+			break;
+		case RS_PT_HTTP:
+			bytes = snprintf(cs->buf, sizeof(cs->buf), "CONNECT %s:%d HTTP/1.1\r\n\r\n", target->host, target->port);
+			cs->newlines = 0;
+			cs_request(cs, RS_CS_HTTP_REPLY, bytes, 12);
+			cs_last_request(sock);
+			break;
+		default:
+			cs->px++;
+			break;
+	}
+	return 0;
+}
+
+static int cs_socks5_status(rocksock* sock) {
+	switch(sock->cs.buf[1]) {
+		case 0:
+			return 0;
+		case 1:
+			return MKOERR(sock, RS_E_PROXY_GENERAL_FAILURE);
+		case 2:
+			return MKOERR(sock, RS_E_PROXY_AUTH_FAILED);
+		case 3:
+			return MKOERR(sock, RS_E_TARGETPROXY_NET_UNREACHABLE);
+		case 4:
+			return MKOERR(sock, RS_E_TARGETPROXY_HOST_UNREACHABLE);
+		case 5:
+			return MKOERR(sock, RS_E_TARGETPROXY_CONN_REFUSED);
+		case 6:
+			return MKOERR(sock, RS_E_TARGETPROXY_TTL_EXPIRED);
+		case 7:
+			return MKOERR(sock, RS_E_PROXY_COMMAND_NOT_SUPPORTED);
+		case 8:
+			return MKOERR(sock, RS_E_PROXY_ADDRESSTYPE_NOT_SUPPORTED);
+		default:
+			return MKOERR(sock, RS_E_PROXY_UNEXPECTED_RESPONSE);
+	}
+}
+
+/* prepares the first request to the first hop ahead of the connect, so
+   that it can go out with the SYN. */
+static int cs_syn_request(rocksock* sock) {
+	rs_connectState *cs = &sock->cs;
+	int ret;
+	if(sock->lastproxy >= 0) {
+		ret = cs_start_hop(sock);
+		if(ret) return ret;
+		if(cs->state != RS_CS_CONNECT) cs->synstate = cs->state;
+		cs->px = 0;
+	} else if(sock->early_len && !cs->useSSL) {
+		cs_early_request(sock);
+		cs->synstate = cs->state;
+	}
+	cs->state = RS_CS_CONNECT;
+	return 0;
+}
+
+/* records which proxy was involved in a failure of the current state */
+static int cs_failure(rocksock* sock, int ret) {
+	rs_connectState *cs = &sock->cs;
+	if(cs->state == RS_CS_CONNECT) {
+		if(sock->lastproxy >= 0) sock->lasterror.failedProxy = 0;
+		he_close(cs, -1);
+		sock->socket = -1;
+	} else if(cs->state >= RS_CS_HOP && cs->state <= RS_CS_HTTP_HEADERS)
+		sock->lasterror.failedProxy = cs->px;
+	cs->state = RS_CS_NONE;
+	sock->early_data = 0;
+	sock->early_len = 0;
+	return ret;
+}
+
+int rocksock_connect_start(rocksock* sock, const char* host, unsigned short port, int useSSL) {
+	rs_connectState *cs;
 	rs_hostInfo* connector;
-	rs_proxy dummy;
-	rs_proxy* targetproxy;
-	char socksdata[768];
-	char* p;
-	size_t socksused = 0, bytes;
+	int ret, i;
 	if (!sock) return RS_E_NULL;
 	if (!host || !port)
 		return MKOERR(sock, RS_E_NULL);
@@ -259,257 +799,427 @@ int rocksock_connect(rocksock* sock, const char* host, unsigned short port, int
 #ifndef USE_SSL
 	if (useSSL) return MKOERR(sock, RS_E_NO_SSL);
 #endif
-	memcpy(targethost.host, host, hl+1);
-	targethost.port = port;
+	cs = &sock->cs;
+	if (useSSL && sock->early_len) {
+		cs->state = RS_CS_NONE;
+		return cs_failure(sock, MKOERR(sock, RS_E_EARLY_DATA_SSL));
+	}
+	sock->connected = 0;
+	sock->rpos = sock->rlen = 0;
+	sock->wlen = 0;
+	memcpy(cs->target.host, host, hl+1);
+	cs->target.port = port;
+	cs->useSSL = useSSL;
+	cs->trysocksv4a = 1;
+	cs->pipelined = 0;
+	cs->synstate = RS_CS_NONE;
+	cs->px = 0;
+	cs->want = RS_WANT_NONE;
+	cs->state = RS_CS_CONNECT;
+	cs->naddrs = RS_MAX_ADDRS;
+	cs->nextaddr = 0;
+	for(i = 0; i < RS_MAX_ADDRS; i++) cs->fds[i] = -1;
 
 	if(sock->lastproxy >= 0)
 		connector = &sock->proxies[0].hostinfo;
 	else
-		connector = &targethost;
+		connector = &cs->target;
 
-	rs_resolveStorage stor;
-
-	ret = rocksock_resolve_host(sock, connector, &stor);
-	if(ret) {
-		check_proxy0_failure:
-		if(sock->lastproxy >= 0) sock->lasterror.failedProxy = 0;
-		return ret;
+	ret = rocksock_resolve_host(sock, connector, cs->addrs, &cs->naddrs);
+	if(ret) return cs_failure(sock, ret);
+	if(sock->fastopen) {
+		ret = cs_syn_request(sock);
+		if(ret) return cs_failure(sock, ret);
 	}
+	cs->t_start = rocksock_now_ms();
+	ret = he_attempt(sock);
+	if(ret) return cs_failure(sock, ret);
+	return NOERR(sock);
+}
 
-	ret = do_connect(sock, &stor, sock->timeout);
-	if(ret) goto check_proxy0_failure;
+int rocksock_connect_step(rocksock* sock, int* fd, int* want) {
+	rs_connectState *cs;
+	int ret = 0;
+	if (!sock) return RS_E_NULL;
+	if (!fd || !want) return MKOERR(sock, RS_E_NULL);
+	cs = &sock->cs;
+	*want = RS_WANT_NONE;
+	*fd = sock->socket;
+	if (sock->socket == -1 || cs->state == RS_CS_NONE) return MKOERR(sock, RS_E_NO_SOCKET);
 
-	for(px = 0; px <= sock->lastproxy; px++) {
-		if(px == sock->lastproxy) {
-			targetproxy = &dummy;
-			dummy.hostinfo = targethost;
-			dummy.password[0] = 0;
-			dummy.username[0] = 0;
-			dummy.proxytype = RS_PT_NONE;
-		} else {
-			targetproxy = &sock->proxies[px + 1];
-		}
-		// send socks connection data
-		switch(sock->proxies[px].proxytype) {
-			case RS_PT_SOCKS4:
-				trysocksv4a = 1;
-				trysocks4:
-				ret = rocksock_setup_socks4_header(sock, trysocksv4a, socksdata, targetproxy, &socksused);
-				if(ret) {
-					proxyfailure:
-					sock->lasterror.failedProxy = px;
-					return ret;
-				}
-				ret = rocksock_send(sock, socksdata, socksused, 0, &bytes);
-				if(ret) goto proxyfailure;
-				ret = rocksock_recv(sock, socksdata, 8, 8, &bytes);
-				if(ret) goto proxyfailure;
-				if(bytes < 8 || socksdata[0] != 0) {
-					err_unexpected:
-					ret = MKOERR(sock, RS_E_PROXY_UNEXPECTED_RESPONSE);
-					goto proxyfailure;
-				}
-				switch(socksdata[1]) {
-					case 0x5a:
-						break;
-					case 0x5b:
-						if(trysocksv4a) {
-							trysocksv4a = 0;
-							goto trysocks4;
-						}
-						err_proxyconnect:
-						ret = MKOERR(sock, RS_E_TARGETPROXY_CONNECT_FAILED);
-						goto proxyfailure;
-					case 0x5c: case 0x5d:
-						err_proxyauth:
-						ret = MKOERR(sock, RS_E_PROXY_AUTH_FAILED);
-						goto proxyfailure;
-					default:
-						goto err_unexpected;
-				}
+	for(;;) switch(cs->state) {
+		case RS_CS_CONNECT:
+			ret = he_check(sock, want);
+			if(ret || *want) goto out;
+			/* with fast open, the first request is already underway */
+			cs->state = cs->synstate != RS_CS_NONE ? cs->synstate : RS_CS_HOP;
+			break;
+		case RS_CS_HOP:
+			if(cs->px <= sock->lastproxy) {
+				ret = cs_start_hop(sock);
+				if(ret) goto out;
 				break;
-			case RS_PT_SOCKS5:
-				p = socksdata;
-				*p++ = 5;
-				if(sock->proxies[px].username[0] && sock->proxies[px].password[0]) {
-					*p++ = 2;
-					*p++ = 0;
-					*p++ = 2;
-				} else {
-					*p++ = 1;
-					*p++ = 0;
-				}
-				bytes = p - socksdata;
-				ret = rocksock_send(sock, socksdata, bytes, bytes, &bytes);
-				if(ret) goto proxyfailure;
-				ret = rocksock_recv(sock, socksdata, 2, 2, &bytes);
-				if(ret) goto proxyfailure;
-				if(bytes < 2 || socksdata[0] != 5) goto err_unexpected;
-				if(socksdata[1] == '\xff') {
-					goto err_proxyauth;
-				} else if (socksdata[1] == 2) {
-					if(sock->proxies[px].username[0] && sock->proxies[px].password[0]) {
-						/*
-						+----+------+----------+------+----------+
-						|VER | ULEN |  UNAME   | PLEN |  PASSWD  |
-						+----+------+----------+------+----------+
-						| 1  |  1   | 1 to 255 |  1   | 1 to 255 |
-						+----+------+----------+------+----------+
-						*/
-						p = socksdata;
-						*p++ = 1;
-						bytes = strlen(sock->proxies[px].username);
-						*p++ = bytes;
-						memcpy(p, sock->proxies[px].username, bytes);
-						p += bytes;
-						bytes = strlen(sock->proxies[px].password);
-						*p++ = bytes;
-						memcpy(p, sock->proxies[px].password, bytes);
-						p += bytes;
-						bytes = p - socksdata;
-						ret = rocksock_send(sock, socksdata, bytes, bytes, &bytes);
-						if(ret) goto proxyfailure;
-						ret = rocksock_recv(sock, socksdata, 2, 2, &bytes);
-						if(ret) goto proxyfailure;
-						if(bytes < 2) goto err_unexpected;
-						else if(socksdata[1] != 0) goto err_proxyauth;
-					} else {
-						goto err_proxyauth;
+			}
+#ifdef USE_SSL
+			if(cs->useSSL) {
+				ret = rocksock_ssl_connect_fd(sock);
+				if(ret) goto out;
+				cs->state = RS_CS_SSL;
+				break;
+			}
+#endif
+			if(sock->early_len && (sock->lastproxy < 0 ||
+			   sock->proxies[sock->lastproxy].proxytype == RS_PT_SOCKS4)) {
+				cs_early_request(sock);
+				break;
+			}
+			cs->state = RS_CS_DONE;
+			break;
+		case RS_CS_EARLY_DATA:
+			ret = cs_transfer(sock, want);
+			if(ret || *want) goto out;
+			cs->state = RS_CS_DONE;
+			break;
+		case RS_CS_SOCKS4_REPLY:
+			ret = cs_transfer(sock, want);
+			if(ret || *want) goto out;
+			if(cs->buf[0] != 0) goto err_unexpected;
+			switch(cs->buf[1]) {
+				case 0x5a:
+					goto next_hop;
+				case 0x5b:
+					if(cs->trysocksv4a) {
+						cs->trysocksv4a = 0;
+						cs->state = RS_CS_HOP;
+						continue;
 					}
-				}
-				p = socksdata;
-				*p++ = 5;
-				*p++ = 1;
-				*p++ = 0;
-				if(isnumericipv4(targetproxy->hostinfo.host)) {
-					*p++ = 1; // ipv4 method
-					bytes = 4;
-					ipv4fromstring(targetproxy->hostinfo.host, (unsigned char*) p);
-				} else {
-					*p++ = 3; //hostname method, requires the server to do dns lookups.
-					bytes = strlen(targetproxy->hostinfo.host);
-					if(bytes > 255)
-						return MKOERR(sock, RS_E_SOCKS5_AUTH_EXCEEDSIZE);
-					*p++ = bytes;
-					memcpy(p, targetproxy->hostinfo.host, bytes);
-				}
-				p+=bytes;
-				*p++ = targetproxy->hostinfo.port / 256;
-				*p++ = targetproxy->hostinfo.port % 256;
-				bytes = p - socksdata;
-				ret = rocksock_send(sock, socksdata, bytes, bytes, &bytes);
-				if(ret) goto proxyfailure;
-				ret = rocksock_recv(sock, socksdata, sizeof(socksdata), sizeof(socksdata), &bytes);
-				if(ret) goto proxyfailure;
-				if(bytes < 2) goto err_unexpected;
-				switch(socksdata[1]) {
-					case 0:
-						break;
-					case 1:
-						ret = MKOERR(sock, RS_E_PROXY_GENERAL_FAILURE);
-						goto proxyfailure;
-					case 2:
-						goto err_proxyauth;
-					case 3:
-						ret = MKOERR(sock, RS_E_TARGETPROXY_NET_UNREACHABLE);
-						goto proxyfailure;
-					case 4:
-						ret = MKOERR(sock, RS_E_TARGETPROXY_HOST_UNREACHABLE);
-						goto proxyfailure;
-					case 5:
-						ret = MKOERR(sock, RS_E_TARGETPROXY_CONN_REFUSED);
-						goto proxyfailure;
-					case 6:
-						ret = MKOERR(sock, RS_E_TARGETPROXY_TTL_EXPIRED);
-						goto proxyfailure;
-					case 7:
-						ret = MKOERR(sock, RS_E_PROXY_COMMAND_NOT_SUPPORTED);
-						goto proxyfailure;
-					case 8:
-						ret = MKOERR(sock, RS_E_PROXY_ADDRESSTYPE_NOT_SUPPORTED);
-						goto proxyfailure;
-					default:
-						goto err_unexpected;
-				}
+					goto err_proxyconnect;
+				case 0x5c: case 0x5d:
+					goto err_proxyauth;
+				default:
+					goto err_unexpected;
+			}
+		case RS_CS_SOCKS5_METHOD:
+			ret = cs_transfer(sock, want);
+			if(ret || *want) goto out;
+			if(cs->buf[0] != 5) goto err_unexpected;
+			if(cs->pipelined) {
+				/* the other requests are already on their way */
+				if(cs->buf[1] != (socks5_has_auth(&sock->proxies[cs->px]) ? 2 : 0))
+					goto err_proxyauth;
+				if(cs->buf[1] == 2) cs_expect(cs, RS_CS_SOCKS5_AUTH, 2);
+				else cs_expect(cs, RS_CS_SOCKS5_REPLY, 5);
 				break;
-			case RS_PT_HTTP:
-				bytes = snprintf(socksdata, sizeof(socksdata), "CONNECT %s:%d HTTP/1.1\r\n\r\n", targetproxy->hostinfo.host, targetproxy->hostinfo.port);
-				ret = rocksock_send(sock, socksdata, bytes, bytes, &bytes);
-				if(ret) goto proxyfailure;
-				ret = rocksock_recv(sock, socksdata, sizeof(socksdata), sizeof(socksdata), &bytes);
-				if(ret) goto proxyfailure;
-				if(bytes < 12) goto err_unexpected;
-				if(socksdata[9] != '2') goto err_proxyconnect;
+			}
+			if(cs->buf[1] == '\xff') {
+				goto err_proxyauth;
+			} else if(cs->buf[1] == 2) {
+				if(!socks5_has_auth(&sock->proxies[cs->px]))
+					goto err_proxyauth;
+				cs_socks5_auth(sock);
 				break;
-			default:
+			}
+			ret = cs_socks5_connect(sock);
+			if(ret) goto out;
+			break;
+		case RS_CS_SOCKS5_AUTH:
+			ret = cs_transfer(sock, want);
+			if(ret || *want) goto out;
+			if(cs->buf[1] != 0) goto err_proxyauth;
+			if(cs->pipelined) {
+				cs_expect(cs, RS_CS_SOCKS5_REPLY, 5);
 				break;
+			}
+			ret = cs_socks5_connect(sock);
+			if(ret) goto out;
+			break;
+		case RS_CS_SOCKS5_REPLY:
+			ret = cs_transfer(sock, want);
+			if(ret || *want) goto out;
+			ret = cs_socks5_status(sock);
+			if(ret) goto out;
+			switch(cs->buf[3]) {
+				case 1: /* ipv4 */
+					cs_expect(cs, RS_CS_SOCKS5_REPLY_ADDR, 4 - 1 + 2);
+					break;
+				case 3: /* hostname */
+					cs_expect(cs, RS_CS_SOCKS5_REPLY_ADDR, (unsigned char) cs->buf[4] + 2);
+					break;
+				case 4: /* ipv6 */
+					cs_expect(cs, RS_CS_SOCKS5_REPLY_ADDR, 16 - 1 + 2);
+					break;
+				default:
+					goto err_unexpected;
+			}
+			break;
+		case RS_CS_SOCKS5_REPLY_ADDR:
+			ret = cs_transfer(sock, want);
+			if(ret || *want) goto out;
+			goto next_hop;
+		case RS_CS_HTTP_REPLY:
+			ret = cs_transfer(sock, want);
+			if(ret || *want) goto out;
+			if(cs->buf[9] != '2') goto err_proxyconnect;
+			cs->state = RS_CS_HTTP_HEADERS;
+			break;
+		case RS_CS_HTTP_HEADERS:
+			ret = cs_skip_http_headers(sock, want);
+			if(ret || *want) goto out;
+			goto next_hop;
+#ifdef USE_SSL
+		case RS_CS_SSL:
+			ret = rocksock_ssl_connect_step(sock, want);
+			if(ret || *want) goto out;
+			rocksock_sslcache_count(sock);
+			cs->state = RS_CS_DONE;
+			break;
+#endif
+		case RS_CS_DONE:
+			if(fcntl(sock->socket, F_SETFL, cs->fdflags) == -1) {
+				ret = MKSYSERR(sock, errno);
+				goto out;
+			}
+			cs->state = RS_CS_NONE;
+			sock->connected = 1;
+			sock->early_data = 0;
+			sock->early_len = 0;
+			return NOERR(sock);
+		default:
+			return MKOERR(sock, RS_E_NO_SOCKET);
+		next_hop:
+			cs->px++;
+			cs->trysocksv4a = 1;
+			cs->state = RS_CS_HOP;
+			break;
+		err_unexpected:
+			ret = MKOERR(sock, RS_E_PROXY_UNEXPECTED_RESPONSE);
+			goto out;
+		err_proxyconnect:
+			ret = MKOERR(sock, RS_E_TARGETPROXY_CONNECT_FAILED);
+			goto out;
+		err_proxyauth:
+			ret = MKOERR(sock, RS_E_PROXY_AUTH_FAILED);
+			goto out;
+	}
+out:
+	*fd = sock->socket;
+	cs->want = *want;
+	if(ret) return cs_failure(sock, ret);
+	return 0;
+}
+
+int rocksock_connect_pollfds(rocksock* sock, struct pollfd* pfd, int* timeout_ms) {
+	rs_connectState *cs;
+	long long due;
+	if (!sock || !pfd || !timeout_ms) return 0;
+	cs = &sock->cs;
+	*timeout_ms = -1;
+	if(cs->state == RS_CS_NONE || cs->want == RS_WANT_NONE) return 0;
+	if(cs->state == RS_CS_CONNECT) {
+		if(cs->nextaddr < cs->naddrs) {
+			due = cs->t_attempt + RS_CONNECT_ATTEMPT_DELAY - rocksock_now_ms();
+			*timeout_ms = due > 0 ? due : 0;
 		}
+		return he_pollfds(cs, pfd);
 	}
+	pfd->fd = sock->socket;
+	pfd->events = cs->want == RS_WANT_READ ? POLLIN : POLLOUT;
+	pfd->revents = 0;
+	return 1;
+}
 
-#ifdef USE_SSL
-	if(useSSL) {
-		ret = rocksock_ssl_connect_fd(sock);
-		if(ret) return ret;
+int rocksock_connect_expired(rocksock* sock) {
+	int ret;
+	if(sock->cs.state == RS_CS_CONNECT || sock->cs.state == RS_CS_SSL)
+		ret = MKOERR(sock, RS_E_HIT_CONNECTTIMEOUT);
+	else
+		ret = MKOERR(sock, sock->cs.want == RS_WANT_READ ? RS_E_HIT_READTIMEOUT : RS_E_HIT_WRITETIMEOUT);
+	return cs_failure(sock, ret);
+}
+
+/* blocks until one of the descriptors the connect waits on is ready, or
+   sock->timeout expires. the connect timeout covers all attempts together,
+   a deadline covers the whole connect. */
+static int cs_wait(rocksock* sock) {
+	struct pollfd pfd[RS_MAX_ADDRS];
+	int n, ret, hint, expired;
+	long long timeout = sock->timeout ? (long long) sock->timeout : -1;
+
+	n = rocksock_connect_pollfds(sock, pfd, &hint);
+	if(sock->deadline) {
+		timeout = sock->deadline - rocksock_now_ms();
+		if(timeout < 0) timeout = 0;
+	} else if(sock->cs.state == RS_CS_CONNECT && timeout != -1) {
+		timeout -= rocksock_now_ms() - sock->cs.t_start;
+		if(timeout < 0) timeout = 0;
 	}
-#endif
-	return NOERR(sock);
+	if(timeout > INT_MAX) timeout = INT_MAX;
+	expired = hint == -1 || (timeout != -1 && timeout <= hint);
+	if(!expired) timeout = hint;
+	do ret = poll(pfd, n, timeout);
+	while(ret == -1 && errno == EINTR);
+	if(ret > 0 || (!ret && !expired)) return 0;
+	if(ret == -1) return cs_failure(sock, MKSYSERR(sock, errno));
+	return rocksock_connect_expired(sock);
 }
 
-typedef enum  {
-	RS_OT_SEND = 0,
-	RS_OT_READ
-} rs_operationType;
+int rocksock_connect(rocksock* sock, const char* host, unsigned short port, int useSSL) {
+	int ret, fd, want;
+	ret = rocksock_connect_start(sock, host, port, useSSL);
+	while(!ret) {
+		ret = rocksock_connect_step(sock, &fd, &want);
+		if(ret || !want) break;
+		ret = cs_wait(sock);
+	}
+	return ret;
+}
 
-static int rocksock_operation(rocksock* sock, rs_operationType operation, char* buffer, size_t bufsize, size_t chunksize, size_t* bytes) {
+int rocksock_connect_deadline(rocksock* sock, const char* host, unsigned short port, int useSSL, long long deadline_ms) {
+	long long saved;
+	int ret;
 	if (!sock) return RS_E_NULL;
-	if (!buffer || !bytes || (!bufsize && operation == RS_OT_READ)) return MKOERR(sock, RS_E_NULL);
-	*bytes = 0;
+	saved = sock->deadline;
+	sock->deadline = deadline_ms;
+	ret = rocksock_connect(sock, host, port, useSSL);
+	sock->deadline = saved;
+	return ret;
+}
+
+int rocksock_apply_timeout(rocksock* sock, rs_operationType operation) {
 	struct timeval tv;
-	fd_set fd;
-	fd_set* rfd = NULL;
-	fd_set* wfd = NULL;
-	int ret = 0;
-	size_t bytesleft = bufsize ? bufsize : strlen(buffer);
-	size_t byteswanted;
-	char* bufptr = buffer;
+	unsigned long *applied = operation == RS_OT_SEND ? &sock->sndtimeo : &sock->rcvtimeo;
+	unsigned long timeout = sock->timeout;
+	if(sock->deadline) {
+		long long left = sock->deadline - rocksock_now_ms();
+		/* 0 would mean no timeout at all */
+		if(left <= 0) return MKOERR(sock, operation == RS_OT_SEND ? RS_E_HIT_WRITETIMEOUT : RS_E_HIT_READTIMEOUT);
+		timeout = left;
+	}
+	if(*applied == timeout) return 0;
+	if(setsockopt(sock->socket, SOL_SOCKET, operation == RS_OT_SEND ? SO_SNDTIMEO : SO_RCVTIMEO,
+	              (void*) make_timeval(&tv, timeout), sizeof(tv)) == -1)
+		return MKSYSERR(sock, errno);
+	*applied = timeout;
+	return 0;
+}
 
-	if (sock->socket == -1) return MKOERR(sock, RS_E_NO_SOCKET);
-	if(operation == RS_OT_SEND) wfd = &fd;
-	else rfd = &fd;
+/* max. number of iovecs handed to the kernel per syscall */
+#define RS_IOV_WINDOW 64
+/* max. payload of a tls record (RFC 8446 5.1) */
+#define RS_TLS_RECORD 16384
 
-	if(sock->timeout) {
-		if(operation == RS_OT_SEND)
-			ret = setsockopt(sock->socket, SOL_SOCKET, SO_SNDTIMEO, (void*) make_timeval(&tv, sock->timeout), sizeof(tv));
-		else
-			ret = setsockopt(sock->socket, SOL_SOCKET, SO_RCVTIMEO, (void*) make_timeval(&tv, sock->timeout), sizeof(tv));
+/* position in the caller's iovec array */
+typedef struct {
+	const struct iovec *iov;
+	int iovcnt;
+	size_t off;
+} rs_iovCursor;
+
+static void iov_advance(rs_iovCursor* c, size_t n) {
+	while(c->iovcnt && (n || c->off == c->iov->iov_len)) {
+		size_t l = c->iov->iov_len - c->off;
+		if(n < l) {
+			c->off += n;
+			return;
+		}
+		n -= l;
+		c->iov++;
+		c->iovcnt--;
+		c->off = 0;
 	}
+}
 
-	if (ret == -1) return MKSYSERR(sock, errno);
+/* fills win with up to max bytes from the cursor, returns the count of iovecs */
+static int iov_window(const rs_iovCursor* c, struct iovec* win, size_t max, size_t* bytes) {
+	int i, n = 0;
+	size_t l, off = c->off;
+	*bytes = 0;
+	for(i = 0; i < c->iovcnt && n < RS_IOV_WINDOW && *bytes < max; i++, off = 0) {
+		l = c->iov[i].iov_len - off;
+		if(!l) continue;
+		if(l > max - *bytes) l = max - *bytes;
+		win[n].iov_base = (char*) c->iov[i].iov_base + off;
+		win[n].iov_len = l;
+		*bytes += l;
+		n++;
+	}
+	return n;
+}
 
-	while(bytesleft) {
-		byteswanted = (chunksize && chunksize < bytesleft) ? chunksize : bytesleft;
+#ifdef USE_SSL
+/* openssl has no writev, so small iovecs are packed into full tls records
+   instead of ending up in a record each. large ones are written as is. */
+static ssize_t ssl_sendv(rocksock* sock, const rs_iovCursor* c, size_t max, size_t* wanted) {
+	char buf[RS_TLS_RECORD];
+	struct iovec win[RS_IOV_WINDOW];
+	int i, n;
+	size_t l;
+	n = iov_window(c, win, max, wanted);
+	if(n == 1 || win[0].iov_len >= sizeof(buf)) {
+		*wanted = win[0].iov_len;
+		return rocksock_ssl_send(sock, win[0].iov_base, *wanted);
+	}
+	n = iov_window(c, win, max < sizeof(buf) ? max : sizeof(buf), wanted);
+	for(i = 0, l = 0; i < n; l += win[i].iov_len, i++)
+		memcpy(buf + l, win[i].iov_base, win[i].iov_len);
+	return rocksock_ssl_send(sock, buf, l);
+}
+#endif
+
+/* hands out data from the read buffer, see rocksock_set_readbuffer() */
+static size_t rbuf_drain(rocksock* sock, const struct iovec* iov, int iovcnt) {
+	size_t l, n = 0;
+	for(; iovcnt && sock->rpos < sock->rlen; iov++, iovcnt--) {
+		l = sock->rlen - sock->rpos;
+		if(l > iov->iov_len) l = iov->iov_len;
+		memcpy(iov->iov_base, sock->rbuf + sock->rpos, l);
+		sock->rpos += l;
+		n += l;
+	}
+	return n;
+}
+
+/* flags are added to those of send/sendmsg, and ignored for reads and ssl */
+int rocksock_transfer(rocksock* sock, rs_operationType operation, const struct iovec* iov, int iovcnt, size_t chunksize, size_t* bytes, int flags) {
+	rs_iovCursor cur = {.iov = iov, .iovcnt = iovcnt};
+	struct iovec win[RS_IOV_WINDOW];
+	size_t byteswanted, max = chunksize ? chunksize : (size_t) -1;
+	ssize_t ret;
+	int n;
+
+	*bytes = 0;
+	/* the timeout is enforced by the kernel on the blocking socket, so each
+	   chunk costs exactly one syscall. a deadline shrinks from chunk to
+	   chunk though, and is re-applied whenever a millisecond has passed. */
+	ret = rocksock_apply_timeout(sock, operation);
+	if (ret) return ret;
+
+	for(iov_advance(&cur, 0); cur.iovcnt; iov_advance(&cur, ret)) {
+		if(*bytes && sock->deadline && (ret = rocksock_apply_timeout(sock, operation)))
+			return ret;
 #ifdef USE_SSL
 		if (sock->ssl) {
 			if(operation == RS_OT_SEND)
-				ret = rocksock_ssl_send(sock, bufptr, byteswanted);
-			else
-				ret = rocksock_ssl_recv(sock, bufptr, byteswanted);
+				ret = ssl_sendv(sock, &cur, max, &byteswanted);
+			else {
+				iov_window(&cur, win, max, &byteswanted);
+				byteswanted = win[0].iov_len;
+				ret = rocksock_ssl_recv(sock, win[0].iov_base, byteswanted);
+			}
 		} else {
 #endif
-		/* enforce the timeout by using select() before doing the actual recv/send */
-		FD_SET(sock->socket, &fd);
-		ret=select(sock->socket+1, rfd, wfd, NULL, sock->timeout ? make_timeval(&tv, sock->timeout) : NULL);
-		if(!FD_ISSET(sock->socket, &fd)) MKOERR(sock, RS_E_NULL); // temp test
-		if(ret == -1) {
-			//printf("h: %s, skt: %d, to: %d:%d\n", targethost.host, sock->socket, tv.tv_sec, tv.tv_usec);
-			return MKSYSERR(sock, errno);
+		n = iov_window(&cur, win, max, &byteswanted);
+		if(n == 1 && operation == RS_OT_SEND)
+			ret = send(sock->socket, win[0].iov_base, byteswanted, MSG_NOSIGNAL | flags);
+		else if(n == 1)
+			ret = recv(sock->socket, win[0].iov_base, byteswanted, 0);
+		else {
+			struct msghdr msg = {.msg_iov = win, .msg_iovlen = n};
+			if(operation == RS_OT_SEND)
+				ret = sendmsg(sock->socket, &msg, MSG_NOSIGNAL | flags);
+			else
+				ret = recvmsg(sock->socket, &msg, 0);
 		}
-		else if(!ret) return MKOERR(sock, RS_OT_READ ? RS_E_HIT_READTIMEOUT : RS_E_HIT_WRITETIMEOUT);
-
-		if(operation == RS_OT_SEND)
-			ret = send(sock->socket, bufptr, byteswanted, MSG_NOSIGNAL);
-		else
-			ret = recv(sock->socket, bufptr, byteswanted, 0);
 
 #ifdef USE_SSL
 		}
@@ -519,18 +1229,93 @@ static int rocksock_operation(rocksock* sock, rs_operationType operation, char*
 			return MKOERR(sock, RS_E_REMOTE_DISCONNECTED);
 		else if(ret == -1) {
 			ret = errno;
-			if(ret == EWOULDBLOCK || ret == EINPROGRESS) return MKOERR(sock, RS_OT_READ ? RS_E_HIT_READTIMEOUT : RS_E_HIT_WRITETIMEOUT);
+			if(ret == EWOULDBLOCK || ret == EAGAIN || ret == EINPROGRESS)
+				return MKOERR(sock, operation == RS_OT_READ ? RS_E_HIT_READTIMEOUT : RS_E_HIT_WRITETIMEOUT);
 			return MKSYSERR(sock, errno);
 		}
 
-		bytesleft -= ret;
-		bufptr += ret;
 		*bytes += ret;
 		if(operation == RS_OT_READ && (size_t) ret < byteswanted) break;
 	}
 	return NOERR(sock);
 }
 
+/* sends the write buffer, keeping whatever couldn't be sent */
+static int wbuf_push(rocksock* sock, int flags) {
+	struct iovec iov = {.iov_base = sock->wbuf, .iov_len = sock->wlen};
+	size_t n;
+	int ret = rocksock_transfer(sock, RS_OT_SEND, &iov, 1, 0, &n, flags);
+	sock->wlen -= n;
+	if(sock->wlen) memmove(sock->wbuf, sock->wbuf + n, sock->wlen);
+	return ret;
+}
+
+/* whether anything follows the current iovec of the cursor */
+static int iov_more(const rs_iovCursor* c) {
+	int i;
+	for(i = 1; i < c->iovcnt; i++) if(c->iov[i].iov_len) return 1;
+	return 0;
+}
+
+static int wbuf_write(rocksock* sock, const struct iovec* iov, int iovcnt, size_t chunksize, size_t* bytes) {
+	rs_iovCursor cur = {.iov = iov, .iovcnt = iovcnt};
+	struct iovec seg;
+	size_t l, n;
+	int ret;
+	for(iov_advance(&cur, 0); cur.iovcnt; iov_advance(&cur, l)) {
+		l = cur.iov->iov_len - cur.off;
+		if(!sock->wlen && l >= sock->wbufsize) {
+			/* nothing to coalesce with, so it goes out directly */
+			seg.iov_base = (char*) cur.iov->iov_base + cur.off;
+			seg.iov_len = l;
+			ret = rocksock_transfer(sock, RS_OT_SEND, &seg, 1, chunksize, &n, iov_more(&cur) ? MSG_MORE : 0);
+			*bytes += n;
+			if(ret) return ret;
+			continue;
+		}
+		if(sock->wlen == sock->wbufsize && (ret = wbuf_push(sock, MSG_MORE))) return ret;
+		if(l > sock->wbufsize - sock->wlen) l = sock->wbufsize - sock->wlen;
+		memcpy(sock->wbuf + sock->wlen, (char*) cur.iov->iov_base + cur.off, l);
+		sock->wlen += l;
+		*bytes += l;
+	}
+	if(sock->wlen >= sock->wflush) return wbuf_push(sock, 0);
+	return NOERR(sock);
+}
+
+int rocksock_flush(rocksock* sock) {
+	if (!sock) return RS_E_NULL;
+	if (!sock->wlen) return NOERR(sock);
+	if (sock->socket == -1) return MKOERR(sock, RS_E_NO_SOCKET);
+	return wbuf_push(sock, 0);
+}
+
+static int rocksock_operationv(rocksock* sock, rs_operationType operation, const struct iovec* iov, int iovcnt, size_t chunksize, size_t* bytes) {
+	int ret;
+	*bytes = 0;
+	if (sock->socket == -1) return MKOERR(sock, RS_E_NO_SOCKET);
+
+	if (operation == RS_OT_READ && sock->rpos < sock->rlen) {
+		*bytes = rbuf_drain(sock, iov, iovcnt);
+		return NOERR(sock);
+	}
+	if (operation == RS_OT_SEND && sock->wbuf)
+		return wbuf_write(sock, iov, iovcnt, chunksize, bytes);
+	/* the peer won't answer a request that's still in the buffer */
+	if (operation == RS_OT_READ && sock->wlen && (ret = wbuf_push(sock, 0)))
+		return ret;
+	return rocksock_transfer(sock, operation, iov, iovcnt, chunksize, bytes, 0);
+}
+
+static int rocksock_operation(rocksock* sock, rs_operationType operation, char* buffer, size_t bufsize, size_t chunksize, size_t* bytes) {
+	struct iovec iov;
+	if (!sock) return RS_E_NULL;
+	if (!buffer || !bytes || (!bufsize && operation == RS_OT_READ)) return MKOERR(sock, RS_E_NULL);
+	iov.iov_base = buffer;
+	iov.iov_len = bufsize ? bufsize : strlen(buffer);
+	return rocksock_operationv(sock, operation, &iov, 1, chunksize, bytes);
+}
+
 int rocksock_send(rocksock* sock, char* buffer, size_t bufsize, size_t chunksize, size_t* byteswritten) {
 	return rocksock_operation(sock, RS_OT_SEND, buffer, bufsize, chunksize, byteswritten);
 }
@@ -539,13 +1324,64 @@ int rocksock_recv(rocksock* sock, char* buffer, size_t bufsize, size_t chunksize
 	return rocksock_operation(sock, RS_OT_READ, buffer, bufsize, chunksize, bytesread);
 }
 
+int rocksock_send_deadline(rocksock* sock, char* buffer, size_t bufsize, size_t chunksize, size_t* byteswritten, long long deadline_ms) {
+	long long saved;
+	int ret;
+	if (!sock) return RS_E_NULL;
+	saved = sock->deadline;
+	sock->deadline = deadline_ms;
+	ret = rocksock_send(sock, buffer, bufsize, chunksize, byteswritten);
+	sock->deadline = saved;
+	return ret;
+}
+
+int rocksock_recv_deadline(rocksock* sock, char* buffer, size_t bufsize, size_t chunksize, size_t* bytesread, long long deadline_ms) {
+	long long saved;
+	int ret;
+	if (!sock) return RS_E_NULL;
+	saved = sock->deadline;
+	sock->deadline = deadline_ms;
+	ret = rocksock_recv(sock, buffer, bufsize, chunksize, bytesread);
+	sock->deadline = saved;
+	return ret;
+}
+
+int rocksock_sendv(rocksock* sock, const struct iovec* iov, int iovcnt, size_t chunksize, size_t* byteswritten) {
+	if (!sock) return RS_E_NULL;
+	if ((!iov && iovcnt) || iovcnt < 0 || !byteswritten) return MKOERR(sock, RS_E_NULL);
+	return rocksock_operationv(sock, RS_OT_SEND, iov, iovcnt, chunksize, byteswritten);
+}
+
+int rocksock_recvv(rocksock* sock, const struct iovec* iov, int iovcnt, size_t chunksize, size_t* bytesread) {
+	if (!sock) return RS_E_NULL;
+	if (!iov || iovcnt <= 0 || !bytesread) return MKOERR(sock, RS_E_NULL);
+	return rocksock_operationv(sock, RS_OT_READ, iov, iovcnt, chunksize, bytesread);
+}
+
 int rocksock_disconnect(rocksock* sock) {
 	if (!sock) return RS_E_NULL;
 #ifdef USE_SSL
 	rocksock_ssl_free_context(sock);
 #endif
+	/* a connect in progress may have more attempts racing */
+	if(sock->cs.state == RS_CS_CONNECT) he_close(&sock->cs, sock->socket);
+	sock->cs.state = RS_CS_NONE;
 	if(sock->socket != -1) close(sock->socket);
 	sock->socket = -1;
+	sock->connected = 0;
+	sock->rpos = sock->rlen = 0;
+	sock->wlen = 0;
+	return NOERR(sock);
+}
+
+int rocksock_set_socket(rocksock* sock, int fd) {
+	if (!sock) return RS_E_NULL;
+	if (fd < 0) return MKOERR(sock, RS_E_NO_SOCKET);
+	rocksock_disconnect(sock);
+	sock->socket = fd;
+	sock->connected = 1;
+	/* unknown, they get applied on the first send or recv */
+	sock->rcvtimeo = sock->sndtimeo = ULONG_MAX;
 	return NOERR(sock);
 }
 
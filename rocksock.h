@@ -7,9 +7,13 @@
 #define _ROCKSOCK_H_
 
 #include <stddef.h>
+#include <sys/types.h>
+#include <poll.h>
+#include <pthread.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 
 typedef enum {
 	RS_PT_NONE = 0,
@@ -55,7 +59,10 @@ typedef enum rs_error {
 	RS_E_NO_PROXYSTORAGE = 25,
 	RS_E_HOSTNAME_TOO_LONG = 26,
 	RS_E_INVALID_PROXY_URL = 27,
-	RS_E_MAX_ERROR = 28
+	RS_E_DNS_NOT_FOUND = 28,
+	RS_E_DNS_FAILURE = 29,
+	RS_E_EARLY_DATA_SSL = 30,
+	RS_E_MAX_ERROR = 31
 } rs_error;
 
 typedef struct {
@@ -78,36 +85,559 @@ typedef struct {
 	rs_proxyType proxytype;
 } rs_proxy;
 
+/* readiness events requested by rocksock_connect_step() */
+typedef enum {
+	RS_WANT_NONE = 0,
+	RS_WANT_READ = 1,
+	RS_WANT_WRITE = 2,
+} rs_wantEvent;
+
+typedef union {
+	struct sockaddr sa;
+	struct sockaddr_in v4;
+	struct sockaddr_in6 v6;
+} rs_sockAddr;
+
+/* maximum number of addresses of the first hop that are raced against each
+   other when connecting (RFC 8305 "happy eyeballs") */
+#define RS_MAX_ADDRS 8
+
+typedef struct {
+	char host[256];
+	unsigned hash;
+	int naddrs;
+	int errortype;
+	int error;
+	long long expires;
+	unsigned long long lastused;
+	rs_sockAddr addrs[RS_MAX_ADDRS];
+} rs_dnsCacheEntry;
+
+typedef struct {
+	pthread_mutex_t lock;
+	rs_dnsCacheEntry *entries;
+	size_t size;
+	size_t used;
+	unsigned long ttl;
+	unsigned long negative_ttl;
+	unsigned long long tick;
+	unsigned long hits;
+	unsigned long misses;
+} rs_dnsCache;
+
+#define RS_DNS_MAXSERVERS 3
+
+typedef struct {
+	rs_sockAddr servers[RS_DNS_MAXSERVERS];
+	int nservers;
+	unsigned long timeout;
+	int attempts;
+} rs_dnsConfig;
+
+typedef struct {
+	const char* host;
+	/* results: 0 or RS_E_DNS_NOT_FOUND, RS_E_DNS_FAILURE, RS_E_HIT_TIMEOUT
+	   of type RS_ET_OWN; an error from the dns cache keeps its type. */
+	int errortype;
+	int error;
+	int naddrs;
+	rs_sockAddr addrs[RS_MAX_ADDRS];
+	/* private */
+	int pending;
+	int notfound;
+	int failed;
+	int tries;
+	int n4, n6;
+	long long sent;
+} rs_dnsQuery;
+
+typedef struct {
+	const rs_dnsConfig* conf;
+	rs_dnsQuery* queries;
+	size_t count;
+	size_t pending;
+	int fds[2];
+	unsigned short idbase;
+} rs_dnsBatch;
+
+/* room for the proxy chain of a pooled connection, see rocksock_pool_init */
+#define RS_POOL_CHAINSIZE 512
+
+typedef struct {
+	/* hash of proxy chain, host, port and useSSL */
+	unsigned long long key;
+	/* the proxy chain, packed */
+	char chain[RS_POOL_CHAINSIZE];
+	size_t chainlen;
+	char host[256];
+	unsigned short port;
+	int useSSL;
+	int state;
+	long long idle_since;
+	int socket;
+	unsigned long rcvtimeo;
+	unsigned long sndtimeo;
+	void *ssl;
+	void *sslctx;
+} rs_poolEntry;
+
+typedef struct {
+	pthread_mutex_t lock;
+	rs_poolEntry *entries;
+	size_t size;
+	unsigned long idle_timeout;
+	unsigned max_per_key;
+	unsigned long hits;
+	unsigned long misses;
+} rs_pool;
+
+typedef struct {
+	char host[256];
+	unsigned short port;
+	unsigned hash;
+	/* rs_sslContext.gen of the context the session was made with */
+	unsigned long gen;
+	void *session;
+	unsigned long long lastused;
+} rs_sslCacheEntry;
+
+typedef struct {
+	pthread_mutex_t lock;
+	rs_sslCacheEntry *entries;
+	size_t size;
+	unsigned long long tick;
+	unsigned long hits;
+	unsigned long misses;
+} rs_sslCache;
+
+/* ssl client context shared by many connections, see rocksock_sslctx_init */
+typedef struct {
+	void *ctx;
+	int refs;
+	/* unique per init, so that a context reusing the memory of a freed
+	   one doesn't get its cached sessions */
+	unsigned long gen;
+} rs_sslContext;
+
+/* private state of a connect in progress, don't touch. */
+typedef struct {
+	int state;
+	int want;
+	int fdflags;
+	int useSSL;
+	int trysocksv4a;
+	int pipelined;
+	int synstate;
+	int sending;
+	int newlines;
+	ptrdiff_t px;
+	size_t pos, len, expect;
+	/* sent behind the len bytes of buf */
+	const char *xdata;
+	size_t xlen;
+	rs_hostInfo target;
+	int naddrs, nextaddr;
+	long long t_start, t_attempt;
+	int fds[RS_MAX_ADDRS];
+	size_t synsent[RS_MAX_ADDRS];
+	rs_sockAddr addrs[RS_MAX_ADDRS];
+	char buf[1024];
+} rs_connectState;
+
 typedef struct rocksock {
 	int socket;
+	/* set once a connect has been completed */
 	int connected;
 	unsigned long timeout;
+	/* if set, replaces timeout, see rocksock_set_deadline() */
+	long long deadline;
+	/* timeouts currently applied to socket via SO_RCVTIMEO/SO_SNDTIMEO */
+	unsigned long rcvtimeo;
+	unsigned long sndtimeo;
 	rs_proxy *proxies;
 	ptrdiff_t lastproxy;
 	rs_errorInfo lasterror;
 	void *ssl;
+	/* the rs_sslContext referenced by the current connection */
 	void *sslctx;
+	rs_sslContext *sslcontext;
+	/* optional read buffer, data is in rbuf[rpos..rlen) */
+	char *rbuf;
+	size_t rbufsize, rpos, rlen;
+	/* optional write buffer, holding wlen bytes not yet sent */
+	char *wbuf;
+	size_t wbufsize, wlen, wflush;
+	int pipeline;
+	int fastopen;
+	const void *early_data;
+	size_t early_len;
+	rs_connectState cs;
 } rocksock;
 
+typedef enum {
+	RS_IOB_POLL = 0,
+	RS_IOB_URING,
+} rs_ioBackend;
+
+typedef enum {
+	RS_IO_CONNECT = 0,
+	RS_IO_SEND,
+	RS_IO_RECV,
+} rs_ioType;
+
+typedef struct {
+	rocksock *sock;
+	void *data;
+	rs_ioType type;
+	int state;
+	/* free and done lists */
+	int next;
+	/* what the poll backend waits for */
+	int fd;
+	short events;
+	char *buf;
+	size_t len, done;
+	int error;
+	/* the socket was made non-blocking for the operation (tls) */
+	int nonblock;
+	/* when the operation times out, and when to look at it again */
+	long long due, wake;
+	/* timespec of the linked io_uring timeout */
+	long long ts[2];
+} rs_ioOp;
+
+typedef struct {
+	rocksock *sock;
+	void *data;
+	rs_ioType type;
+	/* 0 or the error, the details are in sock->lasterror */
+	int error;
+	size_t bytes;
+} rs_ioCompletion;
+
+typedef struct {
+	rs_ioOp *ops;
+	/* what the poll backend polls, one per op */
+	struct pollfd *pfds;
+	size_t size;
+	/* number of ops taken, first free and done (fifo) ones */
+	size_t active;
+	int freelist, donehead, donetail;
+	/* io_uring instance, or -1 for the poll backend */
+	int ring;
+	unsigned sq_entries, to_submit;
+	unsigned *sq_head, *sq_tail, *sq_mask;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	void *sqes, *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_maplen, cq_maplen, sqes_maplen;
+} rs_ioEngine;
+
+typedef struct {
+	const char *host;
+	unsigned short port;
+	int useSSL;
+	/* proxy chain of nproxies entries, only read, may be shared by jobs */
+	rs_proxy *proxies;
+	int nproxies;
+	void *data;
+} rs_multiJob;
+
+/* error is 0 if sock is connected, otherwise sock->lasterror has the
+   details. sock is disconnected after the callback returns. */
+typedef void (*rs_multiCallback)(rs_multiJob* job, rocksock* sock, int error, void* userdata);
+
+typedef struct {
+	rocksock *socks;
+	size_t inflight;
+	unsigned long timeout;
+	rs_ioEngine engine;
+	rs_multiJob *jobs;
+	size_t njobs, next;
+	rs_multiCallback cb;
+	void *userdata;
+} rs_multi;
+
+/* state of a relay between two rocksocks, see rocksock_relay_init */
+typedef struct {
+	rocksock *socks[2];
+	/* bytes moved from socks[0] to socks[1] and back */
+	unsigned long long bytes[2];
+	unsigned long idle_timeout;
+	long long lastactive;
+	/* per direction: a pipe for splice, or half of buf */
+	int splice;
+	int pipes[2][2];
+	size_t inpipe[2];
+	char *buf;
+	size_t bufsize, bpos[2], blen[2];
+	int eof[2], shut[2];
+	int fdflags[2];
+} rs_relay;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/* rocksock_init_ssl also creates the default shared client context,
+   rocksock_free_ssl drops the library's reference to it. */
 void rocksock_init_ssl(void);
 void rocksock_free_ssl(void);
+/* shared ssl client contexts: the expensive setup (cipher tables, ca
+   store) happens once in init, instead of for every connection.
+   ciphers is an openssl-style cipher list for tls <= 1.2; if cafile or
+   capath are given, the peer certificate and host name are verified.
+   each connection holds a reference; rocksock_sslctx_release drops the
+   caller's, the context is freed once the last connection is gone.
+   rocksock_set_sslctx selects the context for subsequent ssl connects of
+   sock, NULL means the default one, which doesn't verify the peer. */
+int rocksock_sslctx_init(rs_sslContext* c, const char* ciphers, const char* cafile, const char* capath);
+void rocksock_sslctx_release(rs_sslContext* c);
+int rocksock_set_sslctx(rocksock* sock, rs_sslContext* c);
+
+/* tls session cache shared by all rocksocks of the process, disabled by
+   default. works like the dns cache: init takes caller-allocated storage
+   for count entries, the least recently used one is evicted when full.
+   sessions (tickets or ids) are stored per target host, port and ssl
+   context when a connection is closed, and offered on the next connect.
+   stats count ssl handshakes that resumed a session (hits) and the full
+   ones (misses) while the cache is in use. */
+int rocksock_sslcache_init(rs_sslCache* cache, rs_sslCacheEntry* entries, size_t count);
+void rocksock_sslcache_use(rs_sslCache* cache);
+void rocksock_sslcache_stats(rs_sslCache* cache, unsigned long *hits, unsigned long *misses);
+void rocksock_sslcache_free(rs_sslCache* cache);
 
 /* all rocksock functions that return int return 0 on success or an errornumber on failure */
 /* rocksock_init: pass empty rocksock struct and if you want to use proxies,
    an array of rs_proxy's that you need to allocate yourself. */
 int rocksock_init(rocksock* sock, rs_proxy *proxies);
 int rocksock_set_timeout(rocksock* sock, unsigned long timeout_millisec);
+/* CLOCK_MONOTONIC in milliseconds, the clock deadlines are based on */
+long long rocksock_now_ms(void);
+/* absolute deadline (rocksock_now_ms() + budget) for everything that
+   follows: connect, including all proxy hops and the tls handshake, and
+   send/recv, including all chunks. unlike sock->timeout, which is applied
+   to each wait on its own, the budget is shared, and what's left of it
+   is passed on from one step to the next. name resolution isn't covered
+   unless the stub resolver is in use, which has its own timeout.
+   0 goes back to sock->timeout. an operation that runs out of time fails
+   with the respective timeout error. */
+int rocksock_set_deadline(rocksock* sock, long long deadline_ms);
+/* optimistic socks5 handshakes: greeting, authentication and connect
+   request are sent to each proxy in a single write, and the replies are
+   parsed in order afterwards. only the authentication method that's going
+   to be used is offered, so proxies insisting on a different one fail. */
+int rocksock_set_pipelining(rocksock* sock, int enable);
+/* data to be sent to the target right behind the last proxy's connect
+   request (or right after the tcp connect, if there are no proxies).
+   a socks4 proxy gets it after its reply, since a socks4a request may
+   have to be repeated.
+   it can't be combined with useSSL. the buffer must stay valid until the
+   next connect is finished, which consumes it either way. */
+int rocksock_set_early_data(rocksock* sock, const void* data, size_t len);
+/* tcp fast open for the first hop: the first proxy request, or the early
+   data of a direct connection, is sent with the SYN. the kernel takes care
+   of resending it if the peer doesn't accept it, and a plain connect is
+   done if fast open is unavailable or disabled via net.ipv4.tcp_fastopen.
+   the process-wide counters tell how many SYNs were sent with fast open,
+   how many of them had their data acknowledged by the peer, and how many
+   connects fell back. */
+int rocksock_set_fastopen(rocksock* sock, int enable);
+void rocksock_fastopen_stats(unsigned long *attempts, unsigned long *acked, unsigned long *fallbacks);
 int rocksock_add_proxy(rocksock* sock, rs_proxyType proxytype, const char* host, unsigned short port, const char* username, const char* password);
 int rocksock_add_proxy_fromstring(rocksock* sock, const char *proxystring);
 int rocksock_connect(rocksock* sock, const char* host, unsigned short port, int useSSL);
+/* non-blocking variant of rocksock_connect, for use with an event loop.
+   rocksock_connect_start resolves the first hop and initiates the connection.
+   afterwards, call rocksock_connect_step whenever *fd is ready for the
+   events in *want (RS_WANT_READ/RS_WANT_WRITE). the connect is finished
+   once rocksock_connect_step returns 0 with *want set to RS_WANT_NONE;
+   the socket is then switched back to blocking mode.
+   timeouts are up to the caller; sock->timeout is not used by these two.
+   if the first hop resolves to several addresses, connection attempts to
+   them are staggered and raced against each other. to get notified about
+   all of them, use rocksock_connect_pollfds rather than fd and want. */
+int rocksock_connect_start(rocksock* sock, const char* host, unsigned short port, int useSSL);
+int rocksock_connect_step(rocksock* sock, int* fd, int* want);
+/* fills pfd (room for RS_MAX_ADDRS entries) with the descriptors the connect
+   in progress waits on and returns their number. *timeout_ms is set to the
+   time in ms after which rocksock_connect_step should be called even if
+   none of them got ready, or -1. */
+int rocksock_connect_pollfds(rocksock* sock, struct pollfd* pfd, int* timeout_ms);
 int rocksock_send(rocksock* sock, char* buffer, size_t bufsize, size_t chunksize, size_t* byteswritten);
 int rocksock_recv(rocksock* sock, char* buffer, size_t bufsize, size_t chunksize, size_t* bytesread);
+/* scatter/gather variants of send and recv, with the same semantics:
+   sendv sends all buffers, recvv returns after a read that didn't fill
+   what was asked for. chunksize limits the bytes per syscall as before.
+   with ssl, small buffers are coalesced into full tls records. */
+int rocksock_sendv(rocksock* sock, const struct iovec* iov, int iovcnt, size_t chunksize, size_t* byteswritten);
+int rocksock_recvv(rocksock* sock, const struct iovec* iov, int iovcnt, size_t chunksize, size_t* bytesread);
+/* connect, send and recv bounded by the deadline given, instead of the one
+   set with rocksock_set_deadline, if any, or sock->timeout. */
+int rocksock_connect_deadline(rocksock* sock, const char* host, unsigned short port, int useSSL, long long deadline_ms);
+int rocksock_send_deadline(rocksock* sock, char* buffer, size_t bufsize, size_t chunksize, size_t* byteswritten, long long deadline_ms);
+int rocksock_recv_deadline(rocksock* sock, char* buffer, size_t bufsize, size_t chunksize, size_t* bytesread, long long deadline_ms);
+/* sends len bytes of the file fd starting at offset, without changing its
+   file position. plain sockets use sendfile(2); with ssl, sendfile goes
+   through the kernel if openssl enabled ktls for the connection, otherwise
+   the file is read and encrypted in chunks. the timeout applies per chunk
+   like for rocksock_send. *bytessent is smaller than len if the file ends
+   early. */
+int rocksock_sendfile(rocksock* sock, int fd, off_t offset, size_t len, size_t* bytessent);
 int rocksock_readline(rocksock* sock, char* buffer, size_t bufsize, size_t* bytesread);
+/* caller-supplied receive buffer. with it, readline reads as much as is
+   available and scans it for the line end, instead of doing a recv per
+   byte. recv hands out buffered data first (and returns after it, like
+   after a short read), and peek reports it. it's emptied on connect and
+   disconnect; setting a new buffer (or NULL) drops any buffered data. */
+int rocksock_set_readbuffer(rocksock* sock, char* buffer, size_t size);
+/* caller-supplied send buffer. sends are collected in it, and only go
+   out when it fills, when flush_at bytes are buffered (0: the buffer size),
+   on rocksock_flush(), or before a read. writes larger than the buffer
+   bypass it. plaintext chunks sent because the buffer filled use MSG_MORE,
+   so the kernel still builds full segments; with ssl, a buffer of a
+   multiple of 16384 bytes makes every chunk full tls records.
+   buffered data is dropped on connect and disconnect, setting a new
+   buffer (or NULL) flushes it first. */
+int rocksock_set_writebuffer(rocksock* sock, char* buffer, size_t size, size_t flush_at);
+/* sends everything in the write buffer */
+int rocksock_flush(rocksock* sock);
 int rocksock_disconnect(rocksock* sock);
+/* takes over an already connected socket, e.g. one returned by accept(),
+   so it can be used with the rocksock functions. sock must have been
+   initialized; rocksock_disconnect closes the socket. */
+int rocksock_set_socket(rocksock* sock, int fd);
+
+/* dns cache shared by all rocksocks of the process, disabled by default.
+   init takes caller-allocated storage for count entries, which are a hash
+   table indexed by host name. a quarter of them is kept free to keep
+   lookups short, the least recently used entry is evicted once the rest
+   is in use. ttl and negative_ttl (for non-existing hosts) are in
+   milliseconds.
+   rocksock_dnscache_use activates the cache for all subsequent lookups;
+   pass NULL to turn it off again. call it before spawning threads. */
+int rocksock_dnscache_init(rs_dnsCache* cache, rs_dnsCacheEntry* entries, size_t count, unsigned long ttl, unsigned long negative_ttl);
+void rocksock_dnscache_use(rs_dnsCache* cache);
+void rocksock_dnscache_stats(rs_dnsCache* cache, unsigned long *hits, unsigned long *misses);
+void rocksock_dnscache_free(rs_dnsCache* cache);
+
+/* built-in asynchronous stub resolver, doesn't use getaddrinfo and malloc.
+   rocksock_dns_init reads nameservers, timeout and attempts from
+   /etc/resolv.conf. rocksock_dns_use makes rocksock_resolve_host use it
+   instead of getaddrinfo (or the numeric-only NO_DNS_SUPPORT lookup);
+   pass NULL to revert. names are looked up in /etc/hosts first and are
+   queried as given, without search domains.
+   a batch resolves count queries concurrently, each needs q[i].host set.
+   drive it like rocksock_connect_start/step: wait for the descriptors from
+   rocksock_dns_batch_pollfds (max 2) or the timeout, then call
+   rocksock_dns_batch_step, which returns the number of queries still
+   pending or -1 on a system error (errno is set), e.g. when no socket
+   could be made; batch_start fails the same way. a nameserver that
+   answers SERVFAIL or whose address family isn't supported is skipped
+   like one that timed out. rocksock_dns_resolve
+   does all that in a blocking fashion and returns 0 or -1.
+   results are fed into the dns cache, if one is in use. */
+int rocksock_dns_init(rs_dnsConfig* conf);
+void rocksock_dns_use(rs_dnsConfig* conf);
+int rocksock_dns_batch_start(rs_dnsBatch* b, const rs_dnsConfig* conf, rs_dnsQuery* q, size_t count);
+int rocksock_dns_batch_pollfds(rs_dnsBatch* b, struct pollfd* pfd, int* timeout_ms);
+int rocksock_dns_batch_step(rs_dnsBatch* b);
+void rocksock_dns_batch_close(rs_dnsBatch* b);
+int rocksock_dns_resolve(const rs_dnsConfig* conf, rs_dnsQuery* q, size_t count);
+
+/* pool of idle keep-alive connections, keyed by the proxy chain of the
+   rocksock, host, port and useSSL. init takes caller-allocated storage for
+   count entries; idle_timeout is in milliseconds (0 means no limit),
+   max_per_key limits the idle connections kept per key (0 means no limit).
+   rocksock_pool_checkout hands an idle connection to the (initialized,
+   unconnected) sock if one is alive, otherwise it does rocksock_connect.
+   connections are considered dead if they have been idle for too long,
+   or if rocksock_peek reports pending data or eof.
+   rocksock_pool_checkin takes over the connection of sock, which was
+   established by rocksock_connect or checkout; the caller must not have
+   left unread data or a half-finished request on it. the write buffer is
+   flushed first. the connection is closed instead of pooled if it's not
+   connected, the flush fails, the key is full or the proxies, their
+   credentials included, take more than RS_POOL_CHAINSIZE bytes; in any
+   case sock is disconnected afterwards.
+   all functions are thread-safe, except init and free. */
+int rocksock_pool_init(rs_pool* pool, rs_poolEntry* entries, size_t count, unsigned long idle_timeout, unsigned max_per_key);
+int rocksock_pool_checkout(rs_pool* pool, rocksock* sock, const char* host, unsigned short port, int useSSL);
+int rocksock_pool_checkin(rs_pool* pool, rocksock* sock);
+/* closes all connections that have been idle for longer than idle_timeout */
+void rocksock_pool_expire(rs_pool* pool);
+void rocksock_pool_stats(rs_pool* pool, unsigned long *hits, unsigned long *misses);
+/* closes all idle connections */
+void rocksock_pool_free(rs_pool* pool);
+
+/* batched connect/send/recv on many rocksocks. init takes caller-allocated
+   storage for count operations in flight, and count pollfds for the poll
+   backend (also needed with RS_IOB_URING, for the fallback). with USE_IO_URING, the
+   RS_IOB_URING backend submits all queued operations and their timeouts
+   and reaps the completions with a single io_uring_enter; if io_uring isn't
+   compiled in or not available at runtime, it falls back to RS_IOB_POLL,
+   which does a poll over all pending operations instead.
+   connect does what rocksock_connect does (proxies, tls, happy eyeballs),
+   name resolution and the initial connect happen synchronously though.
+   send completes when everything is sent, recv after the first read that
+   returned data, like rocksock_send/recv. tls connections are served
+   via readiness notifications and non-blocking reads and writes.
+   the timeout (or deadline) of the rocksock covers the whole operation.
+   buffers and socks must stay valid until the operation completes; the
+   write buffer is flushed (blocking) before a send or recv is queued,
+   the operation itself bypasses it. only one operation per
+   direction and rocksock may be in flight.
+   rocksock_ioengine_run waits until at least one operation completes
+   and stores up to max completions in c; it returns their number, 0 if
+   nothing was queued, or -1 on a system error (errno is set).
+   the queueing functions return RS_E_OUT_OF_BUFFER if all operations are
+   taken; failures of the operation itself are reported in its completion.
+   rocksock_ioengine_free abandons the operations still in flight. */
+int rocksock_ioengine_init(rs_ioEngine* e, rs_ioOp* ops, struct pollfd* pfds, size_t count, rs_ioBackend backend);
+rs_ioBackend rocksock_ioengine_backend(rs_ioEngine* e);
+int rocksock_ioengine_connect(rs_ioEngine* e, rocksock* sock, const char* host, unsigned short port, int useSSL, void* data);
+int rocksock_ioengine_send(rs_ioEngine* e, rocksock* sock, char* buffer, size_t bufsize, void* data);
+int rocksock_ioengine_recv(rs_ioEngine* e, rocksock* sock, char* buffer, size_t bufsize, void* data);
+int rocksock_ioengine_run(rs_ioEngine* e, rs_ioCompletion* c, int max);
+void rocksock_ioengine_free(rs_ioEngine* e);
+
+/* mass connects, e.g. for scanners and proxy checkers: runs a list of
+   jobs on the io engine, with at most inflight connects at a time.
+   init takes caller-allocated storage for inflight rocksocks, engine
+   operations and pollfds, timeout in ms applies to each connect as a whole (0: none);
+   it returns 0, or RS_E_NULL if any of them is missing.
+   rocksock_multi_run calls cb for every job as it finishes, and returns
+   once all of them did: 0, or -1 on a system error or invalid arguments
+   (errno is set), in which case the connects still in flight are aborted
+   without a callback. m can be run again afterwards. */
+int rocksock_multi_init(rs_multi* m, rocksock* socks, rs_ioOp* ops, struct pollfd* pfds, size_t inflight, rs_ioBackend backend, unsigned long timeout);
+int rocksock_multi_run(rs_multi* m, rs_multiJob* jobs, size_t njobs, rs_multiCallback cb, void* userdata);
+void rocksock_multi_free(rs_multi* m);
+
+/* bidirectional relay between two connected rocksocks, for proxies and
+   tunnels: what's read from one is written to the other, until both
+   directions reached eof. an eof is passed on as a half-close, so the
+   other direction keeps going; a tls destination gets a close_notify
+   first. between plaintext sockets the data moves through a pipe per
+   direction with splice(2), without being copied to userspace. if either
+   side uses ssl, buf is split between the two directions (a multiple of
+   2 * 16384 bytes reads and writes full tls records); it's optional
+   otherwise, and used if the pipes can't be set up.
+   write buffers are flushed by init, data in a read buffer is relayed first.
+   if no data moved for idle_timeout ms (0: none), the relay ends with
+   RS_E_HIT_TIMEOUT, set on a; other errors are set on the rocksock they
+   happened on. r->bytes[0] counts what went from a to b, bytes[1]
+   the other way.
+   both sockets are non-blocking until rocksock_relay_free. with an event
+   loop, wait for the descriptors from rocksock_relay_pollfds (max 2) or
+   the timeout, then call rocksock_relay_step; the relay is done when
+   pollfds returns 0. rocksock_relay does all that in a blocking fashion. */
+int rocksock_relay_init(rs_relay* r, rocksock* a, rocksock* b, char* buf, size_t bufsize, unsigned long idle_timeout);
+int rocksock_relay_step(rs_relay* r);
+int rocksock_relay_pollfds(rs_relay* r, struct pollfd* pfd, int* timeout_ms);
+int rocksock_relay(rs_relay* r);
+/* closes the pipes and puts the sockets back into their previous mode */
+void rocksock_relay_free(rs_relay* r);
 
 /* returns a string describing the last error or NULL */
 const char* rocksock_strerror(rocksock *sock);
@@ -149,4 +679,12 @@ void rocksock_free(rocksock* s);
 //RcB: DEP "rocksock_dynamic.c"
 //RcB: DEP "rocksock_readline.c"
 //RcB: DEP "rocksock_peek.c"
+//RcB: DEP "rocksock_dnscache.c"
+//RcB: DEP "rocksock_dns.c"
+//RcB: DEP "rocksock_pool.c"
+//RcB: DEP "rocksock_sendfile.c"
+//RcB: DEP "rocksock_sslcache.c"
+//RcB: DEP "rocksock_ioengine.c"
+//RcB: DEP "rocksock_multi.c"
+//RcB: DEP "rocksock_relay.c"
 
@@ -9,6 +9,7 @@
 #include "rocksock_internal.h"
 
 #include <cyassl/ssl.h>
+#include <errno.h>
 
 
 #ifndef ROCKSOCK_FILENAME
@@ -20,9 +21,11 @@
 void rocksock_init_ssl(void) {
 	CyaSSL_Init();
 	//CyaSSL_Debugging_ON(); /* cyassl needs to be compiled with --enable-debug */
+	rocksock_ssl_default_init();
 }
 
 void rocksock_free_ssl(void) {
+	rocksock_ssl_default_free();
 	CyaSSL_Cleanup();
 }
 
@@ -43,32 +46,66 @@ int rocksock_ssl_recv(rocksock* sock, char* buf, size_t sz) {
 	return ret;
 }
 
-int rocksock_ssl_connect_fd(rocksock* sock) {
-	sock->sslctx = CyaSSL_CTX_new(CyaSSLv23_client_method());
-	if (!sock->sslctx) {
-		return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
-	}
+int rocksock_ssl_shutdown(rocksock* sock) {
+	int ret = CyaSSL_shutdown(sock->ssl);
+	if (ret >= 0) return 0;
+	errno = CyaSSL_get_error(sock->ssl, ret) == SSL_ERROR_WANT_WRITE ? EWOULDBLOCK : 0;
+	return -1;
+}
 
-	/* FIXME cyassl needs explicit passing of certificates
-	   however the location may vary by system.
-	   until resolved, certificate checks are disabled */
-	CyaSSL_CTX_set_verify(sock->sslctx, SSL_VERIFY_NONE, 0);
+void* rocksock_ssl_ctx_new(const char* ciphers, const char* cafile, const char* capath) {
+	CYASSL_CTX *ctx = CyaSSL_CTX_new(CyaSSLv23_client_method());
+	if (!ctx) return 0;
+	if (ciphers && CyaSSL_CTX_set_cipher_list(ctx, ciphers) != SSL_SUCCESS) goto err;
+	/* cyassl needs explicit passing of certificates, and the location
+	   varies by system. without them, certificate checks are disabled */
+	if (cafile || capath) {
+		if (CyaSSL_CTX_load_verify_locations(ctx, cafile, capath) != SSL_SUCCESS) goto err;
+		CyaSSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, 0);
+	} else
+		CyaSSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, 0);
+	return ctx;
+err:
+	CyaSSL_CTX_free(ctx);
+	return 0;
+}
 
-	sock->ssl = CyaSSL_new(sock->sslctx);
+void rocksock_ssl_ctx_free(void* ctx) {
+	CyaSSL_CTX_free(ctx);
+}
+
+int rocksock_ssl_connect_fd(rocksock* sock) {
+	rs_sslContext *c = rocksock_ssl_acquire(sock);
+	if (!c)
+		return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
+	sock->sslctx = c;
+	sock->ssl = CyaSSL_new(c->ctx);
 	if (!sock->ssl) {
+		rocksock_sslctx_release(c);
+		sock->sslctx = 0;
 		return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
 	}
+	/* only checked if the context verifies the peer */
+	CyaSSL_check_domain_name(sock->ssl, sock->cs.target.host);
+	rocksock_sslcache_get(sock);
 
 	CyaSSL_set_fd(sock->ssl, sock->socket);
 	//CyaSSL_set_using_nonblock(sock->ssl, 0);
+	return 0;
+}
 
+int rocksock_ssl_connect_step(rocksock* sock, int* want) {
 	int ret = CyaSSL_connect(sock->ssl);
+	*want = RS_WANT_NONE;
 	if(ret != SSL_SUCCESS) {
-		/* when CyaSSL_connect gets interrupted by a timeout, it reports LENGTH_ERROR instead of
-		   SSL_ERROR_WANT_READ as it's supposed to do (see cyassl github issue #65).
-		   since that value is not exported we can't catch it without hardcoding the value, so we will wait for a fix */
-		if((ret = CyaSSL_get_error(sock->ssl, ret)) == SSL_ERROR_WANT_READ)
-			return rocksock_seterror(sock, RS_ET_OWN, RS_E_HIT_CONNECTTIMEOUT, ROCKSOCK_FILENAME, __LINE__);
+		switch((ret = CyaSSL_get_error(sock->ssl, ret))) {
+			case SSL_ERROR_WANT_READ:
+				*want = RS_WANT_READ;
+				return 0;
+			case SSL_ERROR_WANT_WRITE:
+				*want = RS_WANT_WRITE;
+				return 0;
+		}
 		return rocksock_seterror(sock, RS_ET_SSL, ret, ROCKSOCK_FILENAME, __LINE__);
 	}
 	return 0;
@@ -76,17 +113,49 @@ int rocksock_ssl_connect_fd(rocksock* sock) {
 
 void rocksock_ssl_free_context(rocksock *sock) {
         if(sock->ssl) {
+                rocksock_sslcache_put(sock);
                 CyaSSL_shutdown(sock->ssl);
                 CyaSSL_free(sock->ssl);
-                CyaSSL_CTX_free(sock->sslctx);
+                rocksock_sslctx_release(sock->sslctx);
                 sock->ssl = 0;
+                sock->sslctx = 0;
         }
 }
 
+/* cyassl hands out pointers into its own session cache,
+   which stay valid and don't need to be freed. */
+void* rocksock_ssl_get_session(rocksock* sock) {
+	return CyaSSL_get_session(sock->ssl);
+}
+
+void rocksock_ssl_set_session(rocksock* sock, void* session) {
+	CyaSSL_set_session(sock->ssl, session);
+}
+
+void rocksock_ssl_session_free(void* session) {
+	(void) session;
+}
+
+int rocksock_ssl_session_reused(rocksock* sock) {
+	return CyaSSL_session_reused(sock->ssl);
+}
+
 int rocksock_ssl_pending(rocksock *sock) {
 	return CyaSSL_pending(sock->ssl);
 }
 
+/* no kernel tls support */
+int rocksock_ssl_ktls_send(rocksock *sock) {
+	(void) sock;
+	return 0;
+}
+
+ssize_t rocksock_ssl_sendfile(rocksock* sock, int fd, off_t offset, size_t sz) {
+	(void) sock; (void) fd; (void) offset; (void) sz;
+	errno = EOPNOTSUPP;
+	return -1;
+}
+
 int rocksock_ssl_peek(rocksock* sock, int *result) {
         int ret;
         char buf[4];
@@ -0,0 +1,462 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+/* a small non-blocking DNS stub resolver for A/AAAA lookups.
+   it talks UDP to the nameservers from /etc/resolv.conf and uses neither
+   getaddrinfo nor malloc, so it's available in the NO_DNS_SUPPORT profile. */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <arpa/inet.h>
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+
+#ifndef SOCK_CLOEXEC
+#define SOCK_CLOEXEC 0
+#endif
+
+#define DNS_PORT 53
+#define T_A 1
+#define T_AAAA 28
+/* pending bits */
+#define P_A 1
+#define P_AAAA 2
+
+static const rs_dnsConfig *use_conf;
+
+/* calls fn for every line of the file at path, until it returns non-zero.
+   overlong lines are truncated. */
+static int for_each_line(const char* path, int (*fn)(char* line, void* arg), void* arg) {
+	char buf[1024], line[512];
+	size_t l = 0;
+	ssize_t n, i;
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if(fd == -1) return -1;
+	while((n = read(fd, buf, sizeof buf)) > 0) {
+		for(i = 0; i < n; i++) {
+			if(buf[i] != '\n') {
+				if(l < sizeof(line) - 1) line[l++] = buf[i];
+				continue;
+			}
+			line[l] = 0;
+			l = 0;
+			if(fn(line, arg)) goto done;
+		}
+	}
+	line[l] = 0;
+	if(l) fn(line, arg);
+done:
+	close(fd);
+	return 0;
+}
+
+/* splits off the next whitespace separated token of *s */
+static char* next_token(char** s) {
+	char *p = *s, *t;
+	while(*p == ' ' || *p == '\t' || *p == '\r') p++;
+	if(!*p || *p == '#' || *p == ';') return 0;
+	t = p;
+	while(*p && *p != ' ' && *p != '\t' && *p != '\r') p++;
+	if(*p) *p++ = 0;
+	*s = p;
+	return t;
+}
+
+static int parse_addr(const char* s, unsigned short port, rs_sockAddr* addr) {
+	memset(addr, 0, sizeof(*addr));
+	if(inet_pton(AF_INET, s, &addr->v4.sin_addr) == 1) {
+		addr->v4.sin_family = AF_INET;
+		addr->v4.sin_port = htons(port);
+		return 1;
+	}
+	if(inet_pton(AF_INET6, s, &addr->v6.sin6_addr) == 1) {
+		addr->v6.sin6_family = AF_INET6;
+		addr->v6.sin6_port = htons(port);
+		return 1;
+	}
+	return 0;
+}
+
+static int resolvconf_line(char* line, void* arg) {
+	rs_dnsConfig *conf = arg;
+	char *t, *p = line;
+	if(!(t = next_token(&p))) return 0;
+	if(!strcmp(t, "nameserver")) {
+		if(conf->nservers < RS_DNS_MAXSERVERS && (t = next_token(&p)) &&
+		   parse_addr(t, DNS_PORT, &conf->servers[conf->nservers]))
+			conf->nservers++;
+	} else if(!strcmp(t, "options")) {
+		while((t = next_token(&p))) {
+			if(!strncmp(t, "timeout:", 8)) conf->timeout = 1000UL * strtoul(t + 8, 0, 10);
+			else if(!strncmp(t, "attempts:", 9)) conf->attempts = strtoul(t + 9, 0, 10);
+		}
+	}
+	return 0;
+}
+
+int rocksock_dns_init(rs_dnsConfig* conf) {
+	if(!conf) return RS_E_NULL;
+	memset(conf, 0, sizeof(*conf));
+	/* same defaults as the libc resolvers */
+	conf->timeout = 5000;
+	conf->attempts = 2;
+	for_each_line("/etc/resolv.conf", resolvconf_line, conf);
+	if(!conf->nservers) {
+		parse_addr("127.0.0.1", DNS_PORT, &conf->servers[0]);
+		conf->nservers = 1;
+	}
+	if(!conf->timeout) conf->timeout = 1000;
+	if(conf->attempts < 1) conf->attempts = 1;
+	return 0;
+}
+
+static int resolve_stub(const char* host, rs_sockAddr* addrs, int* count, int* errortype) {
+	rs_dnsQuery q = {.host = host};
+	*errortype = RS_ET_SYS;
+	if(rocksock_dns_resolve(use_conf, &q, 1)) return errno;
+	*errortype = q.errortype;
+	if(*count > q.naddrs) *count = q.naddrs;
+	memcpy(addrs, q.addrs, *count * sizeof(*addrs));
+	return q.error;
+}
+
+void rocksock_dns_use(rs_dnsConfig* conf) {
+	use_conf = conf;
+	rocksock_resolver = conf ? resolve_stub : 0;
+}
+
+/* the addresses of each family are collected from opposite ends of
+   q->addrs, and interleaved once the query is done (RFC 8305). */
+static void add_addr(rs_dnsQuery* q, int family, const void* ip) {
+	rs_sockAddr *a;
+	if(q->n4 + q->n6 >= RS_MAX_ADDRS) return;
+	if(family == AF_INET) {
+		a = &q->addrs[q->n4++];
+		memset(a, 0, sizeof(*a));
+		a->v4.sin_family = AF_INET;
+		memcpy(&a->v4.sin_addr, ip, 4);
+	} else {
+		a = &q->addrs[RS_MAX_ADDRS - ++q->n6];
+		memset(a, 0, sizeof(*a));
+		a->v6.sin6_family = AF_INET6;
+		memcpy(&a->v6.sin6_addr, ip, 16);
+	}
+}
+
+static void finish_query(rs_dnsBatch* b, rs_dnsQuery* q, int error) {
+	rs_sockAddr tmp[RS_MAX_ADDRS];
+	int i4 = 0, i6 = 0, n = 0;
+	while(i4 < q->n4 || i6 < q->n6) {
+		if(i6 < q->n6) tmp[n++] = q->addrs[RS_MAX_ADDRS - 1 - i6++];
+		if(i4 < q->n4) tmp[n++] = q->addrs[i4++];
+	}
+	memcpy(q->addrs, tmp, n * sizeof(tmp[0]));
+	q->naddrs = n;
+	if(!n && !error) error = q->failed ? RS_E_DNS_FAILURE : RS_E_DNS_NOT_FOUND;
+	q->errortype = RS_ET_OWN;
+	q->error = n ? 0 : error;
+	q->pending = 0;
+	b->pending--;
+	rocksock_dnscache_put(q->host, q->addrs, q->naddrs, RS_ET_OWN, q->error);
+}
+
+static int strcaseeq(const char* a, const char* b) {
+	while(*a && (*a | 32) == (*b | 32)) a++, b++;
+	return !*a && !*b;
+}
+
+static int hosts_line(char* line, void* arg) {
+	rs_dnsBatch *b = arg;
+	rs_sockAddr addr;
+	char *t, *p = line;
+	size_t i;
+	if(!(t = next_token(&p)) || !parse_addr(t, 0, &addr)) return 0;
+	while((t = next_token(&p))) for(i = 0; i < b->count; i++) {
+		rs_dnsQuery *q = &b->queries[i];
+		if(q->pending && strcaseeq(t, q->host)) {
+			/* hosts entries take precedence, don't query them */
+			q->tries = -1;
+			add_addr(q, addr.sa.sa_family, addr.sa.sa_family == AF_INET ?
+			         (void*) &addr.v4.sin_addr : (void*) &addr.v6.sin6_addr);
+		}
+	}
+	return 0;
+}
+
+/* encodes host as DNS name, returns its length or 0 if it's invalid */
+static size_t encode_name(const char* host, unsigned char* out) {
+	unsigned char *len = out++;
+	size_t n = 1;
+	*len = 0;
+	for(; *host; host++) {
+		if(*host == '.') {
+			if(!*len) return 0;
+			if(!host[1]) break;
+			len = out++;
+			*len = 0;
+			n++;
+			continue;
+		}
+		if(*len == 63 || n >= 254) return 0;
+		*out++ = *host;
+		++*len;
+		n++;
+	}
+	if(!*len) return 0;
+	*out = 0;
+	return n + 1;
+}
+
+static int get_fd(rs_dnsBatch* b, int family) {
+	int *fd = &b->fds[family == AF_INET6];
+	if(*fd == -1) *fd = socket(family, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	return *fd;
+}
+
+/* returns -1 if no socket could be made for the server */
+static int send_query(rs_dnsBatch* b, rs_dnsQuery* q) {
+	const rs_dnsConfig *conf = b->conf;
+	unsigned char pkt[512];
+	unsigned short id = b->idbase + (q - b->queries);
+	size_t l;
+	int type, fd;
+
+	const rs_sockAddr *srv = &conf->servers[q->tries % conf->nservers];
+	q->sent = rocksock_now_ms();
+	if(!(l = encode_name(q->host, pkt + 12))) {
+		finish_query(b, q, RS_E_DNS_NOT_FOUND);
+		return 0;
+	}
+	/* a server we can't talk to times out like an unreachable one */
+	if((fd = get_fd(b, srv->sa.sa_family)) == -1 && errno != EAFNOSUPPORT)
+		return -1;
+	for(type = P_A; type <= P_AAAA; type <<= 1) {
+		if(!(q->pending & type)) continue;
+		memset(pkt, 0, 12);
+		pkt[0] = id >> 8;
+		pkt[1] = id & 0xff;
+		pkt[2] = 1; /* RD */
+		pkt[5] = 1; /* QDCOUNT */
+		pkt[12 + l] = 0;
+		pkt[12 + l + 1] = type == P_A ? T_A : T_AAAA;
+		pkt[12 + l + 2] = 0;
+		pkt[12 + l + 3] = 1; /* IN */
+		/* a failed send is treated like a lost packet */
+		if(fd != -1)
+			sendto(fd, pkt, 12 + l + 4, MSG_NOSIGNAL, &srv->sa,
+			       srv->sa.sa_family == AF_INET ? sizeof(srv->v4) : sizeof(srv->v6));
+	}
+	return 0;
+}
+
+int rocksock_dns_batch_start(rs_dnsBatch* b, const rs_dnsConfig* conf, rs_dnsQuery* q, size_t count) {
+	size_t i;
+	if(!b || !conf || (!q && count) || count > 65535) {
+		errno = EINVAL;
+		return -1;
+	}
+	b->conf = conf;
+	b->queries = q;
+	b->count = b->pending = count;
+	b->fds[0] = b->fds[1] = -1;
+	/* transaction ids are sequential from a base that's hard to guess */
+	b->idbase = (unsigned short) (rocksock_now_ms() ^ (size_t) b ^ ((size_t) q >> 4) ^ getpid());
+	for(i = 0; i < count; i++) {
+		q[i].pending = P_A | P_AAAA;
+		q[i].notfound = q[i].failed = q[i].tries = 0;
+		q[i].n4 = q[i].n6 = 0;
+		q[i].naddrs = 0;
+		q[i].errortype = RS_ET_OWN;
+		q[i].error = 0;
+	}
+	for(i = 0; i < count; i++) {
+		rs_sockAddr addr;
+		int n = RS_MAX_ADDRS;
+		if(!q[i].host) finish_query(b, &q[i], RS_E_NULL);
+		else if(parse_addr(q[i].host, 0, &addr)) {
+			q[i].addrs[0] = addr;
+			q[i].naddrs = 1;
+			q[i].pending = 0;
+			b->pending--;
+		} else if(rocksock_dnscache_get(q[i].host, q[i].addrs, &n, &q[i].errortype, &q[i].error)) {
+			q[i].naddrs = n;
+			q[i].pending = 0;
+			b->pending--;
+		}
+	}
+	if(b->pending) for_each_line("/etc/hosts", hosts_line, b);
+	for(i = 0; i < count; i++) {
+		if(!q[i].pending) continue;
+		if(q[i].tries == -1) finish_query(b, &q[i], 0);
+		else if(send_query(b, &q[i])) {
+			rocksock_dns_batch_close(b);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int rocksock_dns_batch_pollfds(rs_dnsBatch* b, struct pollfd* pfd, int* timeout_ms) {
+	long long now, due = -1;
+	size_t i;
+	int n = 0;
+	*timeout_ms = -1;
+	if(!b->pending) return 0;
+	now = rocksock_now_ms();
+	for(i = 0; i < b->count; i++) if(b->queries[i].pending) {
+		long long d = b->queries[i].sent + b->conf->timeout - now;
+		if(due == -1 || d < due) due = d;
+	}
+	*timeout_ms = due < 0 ? 0 : due > INT_MAX ? INT_MAX : due;
+	for(i = 0; i < 2; i++) if(b->fds[i] != -1) {
+		pfd[n].fd = b->fds[i];
+		pfd[n].events = POLLIN;
+		pfd[n].revents = 0;
+		n++;
+	}
+	return n;
+}
+
+/* returns the offset behind the name at off, or 0 if it's malformed */
+static size_t skip_name(const unsigned char* pkt, size_t len, size_t off) {
+	while(off < len) {
+		if(!pkt[off]) return off + 1;
+		if((pkt[off] & 0xc0) == 0xc0) return off + 2 <= len ? off + 2 : 0;
+		off += pkt[off] + 1;
+	}
+	return 0;
+}
+
+/* returns -1 if the query couldn't be sent to the next server */
+static int process_reply(rs_dnsBatch* b, const unsigned char* pkt, size_t len, const rs_sockAddr* from) {
+	unsigned char name[256];
+	unsigned short id, qtype, type, rdlen, ancount;
+	size_t off, l, i;
+	rs_dnsQuery *q;
+	const rs_sockAddr *srv;
+	int bit, rcode;
+
+	if(len < 12 || !(pkt[2] & 0x80) || pkt[4] || pkt[5] != 1) return 0;
+	id = (pkt[0] << 8) | pkt[1];
+	i = (unsigned short) (id - b->idbase);
+	if(i >= b->count || !(q = &b->queries[i])->pending) return 0;
+	/* only accept answers from the server the query was last sent to,
+	   for the name that was asked for */
+	srv = &b->conf->servers[q->tries % b->conf->nservers];
+	if(from->sa.sa_family != srv->sa.sa_family) return 0;
+	if(from->sa.sa_family == AF_INET ?
+	   (from->v4.sin_port != srv->v4.sin_port || memcmp(&from->v4.sin_addr, &srv->v4.sin_addr, 4)) :
+	   (from->v6.sin6_port != srv->v6.sin6_port || memcmp(&from->v6.sin6_addr, &srv->v6.sin6_addr, 16)))
+		return 0;
+	if(!(l = encode_name(q->host, name)) || 12 + l + 4 > len) return 0;
+	for(off = 0; off < l; off++)
+		if((pkt[12 + off] | 32) != (name[off] | 32)) return 0;
+	off = 12 + l;
+	qtype = (pkt[off] << 8) | pkt[off + 1];
+	bit = qtype == T_A ? P_A : qtype == T_AAAA ? P_AAAA : 0;
+	if(!(q->pending & bit)) return 0;
+	off += 4;
+
+	rcode = pkt[3] & 0xf;
+	if(rcode == 3) q->notfound |= bit;
+	else if(rcode) {
+		/* SERVFAIL, REFUSED etc are the server's problem, ask the next */
+		if(q->tries + 1 < b->conf->attempts * b->conf->nservers) {
+			q->tries++;
+			return send_query(b, q);
+		}
+		q->failed |= bit;
+	}
+	ancount = (pkt[6] << 8) | pkt[7];
+	for(i = 0; !rcode && i < ancount; i++) {
+		if(!(off = skip_name(pkt, len, off)) || off + 10 > len) break;
+		type = (pkt[off] << 8) | pkt[off + 1];
+		rdlen = (pkt[off + 8] << 8) | pkt[off + 9];
+		off += 10;
+		if(off + rdlen > len) break;
+		/* CNAME records are skipped, the recursive server includes
+		   the addresses they point to. */
+		if(type == T_A && qtype == T_A && rdlen == 4)
+			add_addr(q, AF_INET, pkt + off);
+		else if(type == T_AAAA && qtype == T_AAAA && rdlen == 16)
+			add_addr(q, AF_INET6, pkt + off);
+		off += rdlen;
+	}
+	q->pending &= ~bit;
+	if(!q->pending) finish_query(b, q, 0);
+	return 0;
+}
+
+int rocksock_dns_batch_step(rs_dnsBatch* b) {
+	unsigned char pkt[512];
+	rs_sockAddr from;
+	socklen_t fromlen;
+	ssize_t n;
+	long long now;
+	size_t i;
+	for(i = 0; i < 2; i++) {
+		if(b->fds[i] == -1) continue;
+		for(;;) {
+			fromlen = sizeof(from);
+			n = recvfrom(b->fds[i], pkt, sizeof pkt, 0, &from.sa, &fromlen);
+			if(n == -1) {
+				if(errno == EINTR) continue;
+				/* e.g. ECONNREFUSED from an ICMP error, the retransmit
+				   logic will try the next server. */
+				break;
+			}
+			if(process_reply(b, pkt, n, &from)) return -1;
+		}
+	}
+	now = rocksock_now_ms();
+	for(i = 0; i < b->count; i++) {
+		rs_dnsQuery *q = &b->queries[i];
+		if(!q->pending || now - q->sent < (long long) b->conf->timeout) continue;
+		if(++q->tries >= b->conf->attempts * b->conf->nservers)
+			finish_query(b, q, RS_E_HIT_TIMEOUT);
+		else if(send_query(b, q))
+			return -1;
+	}
+	return b->pending;
+}
+
+void rocksock_dns_batch_close(rs_dnsBatch* b) {
+	int i;
+	for(i = 0; i < 2; i++) if(b->fds[i] != -1) {
+		close(b->fds[i]);
+		b->fds[i] = -1;
+	}
+}
+
+int rocksock_dns_resolve(const rs_dnsConfig* conf, rs_dnsQuery* q, size_t count) {
+	rs_dnsBatch b;
+	struct pollfd pfd[2];
+	int n, timeout, ret = 0;
+	if(rocksock_dns_batch_start(&b, conf, q, count)) return -1;
+	while(b.pending) {
+		n = rocksock_dns_batch_pollfds(&b, pfd, &timeout);
+		if(poll(pfd, n, timeout) == -1 && errno != EINTR) {
+			ret = -1;
+			break;
+		}
+		if(rocksock_dns_batch_step(&b) == -1) {
+			ret = -1;
+			break;
+		}
+	}
+	rocksock_dns_batch_close(&b);
+	return ret;
+}
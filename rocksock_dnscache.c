@@ -0,0 +1,161 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <netdb.h>
+#include <pthread.h>
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+
+//RcB: LINK "-lpthread"
+
+static rs_dnsCache *dnscache;
+
+int rocksock_dnscache_init(rs_dnsCache* cache, rs_dnsCacheEntry* entries, size_t count, unsigned long ttl, unsigned long negative_ttl) {
+	if(!cache || !entries || !count) return RS_E_NULL;
+	memset(entries, 0, count * sizeof(*entries));
+	cache->entries = entries;
+	cache->size = count;
+	cache->ttl = ttl;
+	cache->negative_ttl = negative_ttl;
+	cache->used = 0;
+	cache->tick = 0;
+	cache->hits = cache->misses = 0;
+	if(pthread_mutex_init(&cache->lock, 0)) return RS_E_NULL;
+	return 0;
+}
+
+void rocksock_dnscache_use(rs_dnsCache* cache) {
+	dnscache = cache;
+}
+
+void rocksock_dnscache_stats(rs_dnsCache* cache, unsigned long *hits, unsigned long *misses) {
+	pthread_mutex_lock(&cache->lock);
+	if(hits) *hits = cache->hits;
+	if(misses) *misses = cache->misses;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void rocksock_dnscache_free(rs_dnsCache* cache) {
+	if(dnscache == cache) dnscache = 0;
+	pthread_mutex_destroy(&cache->lock);
+}
+
+/* FNV-1a, so most mismatches are caught without a strcmp */
+static unsigned hash_host(const char* host) {
+	unsigned h = 2166136261u;
+	while(*host) h = (h ^ (unsigned char) *host++) * 16777619u;
+	return h;
+}
+
+/* the entries are an open addressing table with linear probing, indexed
+   by the hash. a quarter of them is kept free, so that a probe reaches
+   an empty entry (lastused 0) soon. */
+static size_t max_used(rs_dnsCache* cache) {
+	return cache->size - cache->size / 4;
+}
+
+/* returns the entry for host, or the empty one where it belongs, or
+   NULL if neither exists (only possible with less than 4 entries) */
+static rs_dnsCacheEntry* find_entry(rs_dnsCache* cache, const char* host, unsigned hash) {
+	size_t i = hash % cache->size, n;
+	for(n = 0; n < cache->size; n++) {
+		rs_dnsCacheEntry *e = &cache->entries[i];
+		if(!e->lastused || (e->hash == hash && !strcmp(e->host, host))) return e;
+		i = (i + 1) % cache->size;
+	}
+	return 0;
+}
+
+/* empties e, and moves the entries of the probe sequence that follows
+   into the gap where that doesn't take them in front of their slot */
+static void remove_entry(rs_dnsCache* cache, rs_dnsCacheEntry* e) {
+	size_t j = e - cache->entries, i = j, home;
+	e->lastused = 0;
+	for(;;) {
+		i = (i + 1) % cache->size;
+		if(!cache->entries[i].lastused) break;
+		home = cache->entries[i].hash % cache->size;
+		if(i > j ? home <= j || home > i : home <= j && home > i) {
+			cache->entries[j] = cache->entries[i];
+			cache->entries[i].lastused = 0;
+			j = i;
+		}
+	}
+	cache->used--;
+}
+
+int rocksock_dnscache_get(const char* host, rs_sockAddr* addrs, int* count, int* errortype, int* error) {
+	rs_dnsCache *cache = dnscache;
+	rs_dnsCacheEntry *e;
+	int hit = 0;
+	if(!cache) return 0;
+	pthread_mutex_lock(&cache->lock);
+	e = find_entry(cache, host, hash_host(host));
+	if(e && e->lastused && e->expires <= rocksock_now_ms()) {
+		remove_entry(cache, e);
+		e = 0;
+	}
+	if(e && e->lastused) {
+		e->lastused = ++cache->tick;
+		if(*count > e->naddrs) *count = e->naddrs;
+		memcpy(addrs, e->addrs, *count * sizeof(*addrs));
+		*errortype = e->errortype;
+		*error = e->error;
+		cache->hits++;
+		hit = 1;
+	} else cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+	return hit;
+}
+
+void rocksock_dnscache_put(const char* host, const rs_sockAddr* addrs, int count, int errortype, int error) {
+	rs_dnsCache *cache = dnscache;
+	rs_dnsCacheEntry *e;
+	unsigned hash;
+	size_t i, l;
+	if(!cache) return;
+	/* only answers saying that the host doesn't exist are cached,
+	   not temporary failures. */
+	if(error && !(errortype == RS_ET_OWN && error == RS_E_DNS_NOT_FOUND)
+	   && !(errortype == RS_ET_GAI && (error == EAI_NONAME
+#ifdef EAI_NODATA
+	   || error == EAI_NODATA
+#endif
+	))) return;
+	if(error ? !cache->negative_ttl : !cache->ttl) return;
+	l = strlen(host);
+	if(l >= sizeof(e->host)) return;
+	hash = hash_host(host);
+	pthread_mutex_lock(&cache->lock);
+	if(!(e = find_entry(cache, host, hash)) || !e->lastused) {
+		if(cache->used >= max_used(cache)) {
+			/* evict the least recently used entry, inserts are rare
+			   enough for the scan */
+			rs_dnsCacheEntry *lru = 0;
+			for(i = 0; i < cache->size; i++)
+				if(cache->entries[i].lastused && (!lru || cache->entries[i].lastused < lru->lastused))
+					lru = &cache->entries[i];
+			remove_entry(cache, lru);
+			e = find_entry(cache, host, hash);
+		}
+		memcpy(e->host, host, l + 1);
+		e->hash = hash;
+		cache->used++;
+	}
+	e->lastused = ++cache->tick;
+	e->errortype = errortype;
+	e->error = error;
+	e->naddrs = count > RS_MAX_ADDRS ? RS_MAX_ADDRS : count;
+	memcpy(e->addrs, addrs, e->naddrs * sizeof(*addrs));
+	e->expires = rocksock_now_ms() + (error ? cache->negative_ttl : cache->ttl);
+	pthread_mutex_unlock(&cache->lock);
+}
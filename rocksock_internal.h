@@ -3,12 +3,33 @@
 
 #include "rocksock.h"
 
-typedef struct {
-	struct addrinfo* hostaddr;
-	struct addrinfo hostaddr_buf;
-	struct sockaddr_storage hostaddr_aiaddr_buf;
-} rs_resolveStorage;
-
 int rocksock_seterror(rocksock* sock, rs_errorType errortype, int error, const char* file, int line);
 
+typedef enum  {
+	RS_OT_SEND = 0,
+	RS_OT_READ
+} rs_operationType;
+
+/* applies sock->timeout, or the time left until sock->deadline, as
+   SO_SNDTIMEO or SO_RCVTIMEO, if it changed since it was last applied to
+   this socket. fails with a timeout error once the deadline has passed. */
+int rocksock_apply_timeout(rocksock* sock, rs_operationType operation);
+
+/* sends or reads iov on the socket itself, past the read and write
+   buffers. flags are added to those of send/sendmsg. */
+int rocksock_transfer(rocksock* sock, rs_operationType operation, const struct iovec* iov, int iovcnt, size_t chunksize, size_t* bytes, int flags);
+
+/* aborts the connect in progress with the timeout error fitting its state */
+int rocksock_connect_expired(rocksock* sock);
+
+/* process-wide dns cache, see rocksock_dnscache_use().
+   get returns 1 on a hit, a cached failure is returned in *errortype and *error. */
+int rocksock_dnscache_get(const char* host, rs_sockAddr* addrs, int* count, int* errortype, int* error);
+void rocksock_dnscache_put(const char* host, const rs_sockAddr* addrs, int count, int errortype, int error);
+
+/* resolver backend replacing getaddrinfo, installed by rocksock_dns_use().
+   returns 0 or an error of type *errortype. */
+typedef int (*rs_resolverFunc)(const char* host, rs_sockAddr* addrs, int* count, int* errortype);
+extern rs_resolverFunc rocksock_resolver;
+
 #endif
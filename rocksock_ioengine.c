@@ -0,0 +1,517 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/socket.h>
+#ifdef USE_IO_URING
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+#ifdef USE_SSL
+#include "rocksock_ssl_internal.h"
+#endif
+
+#ifndef ROCKSOCK_FILENAME
+#define ROCKSOCK_FILENAME __FILE__
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+enum {
+	OP_FREE = 0,
+	/* waiting for the poll backend or an io_uring completion */
+	OP_WAIT,
+	OP_DONE,
+};
+
+static void set_nonblock(int fd, int on) {
+	int flags = fcntl(fd, F_GETFL);
+	if(flags != -1) fcntl(fd, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+}
+
+static long long op_timeleft(rs_ioOp* op) {
+	long long ms;
+	if(!op->due) return -1;
+	ms = op->due - rocksock_now_ms();
+	return ms > 0 ? ms : 0;
+}
+
+static int op_expired(rs_ioOp* op) {
+	return op->due && rocksock_now_ms() >= op->due;
+}
+
+static void op_finish(rs_ioEngine* e, rs_ioOp* op, int error) {
+	int i = op - e->ops;
+	if(op->nonblock) set_nonblock(op->sock->socket, 0);
+	op->error = error;
+	op->state = OP_DONE;
+	op->next = -1;
+	if(e->donetail == -1) e->donehead = i;
+	else e->ops[e->donetail].next = i;
+	e->donetail = i;
+}
+
+#ifdef USE_IO_URING
+
+/* the kernel limit, IORING_MAX_ENTRIES */
+#define RS_RING_MAX 32768
+
+static int ring_enter(rs_ioEngine* e, unsigned wait) {
+	int ret;
+	do ret = syscall(__NR_io_uring_enter, e->ring, e->to_submit, wait,
+	                 wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	while(ret == -1 && errno == EINTR);
+	if(ret > 0) e->to_submit -= ret;
+	return ret;
+}
+
+/* sqes are used in ring order, the kernel only looks at them on enter */
+static struct io_uring_sqe* sqe_get(rs_ioEngine* e) {
+	struct io_uring_sqe *sqe;
+	unsigned tail = *e->sq_tail;
+	sqe = (struct io_uring_sqe*) e->sqes + (tail & *e->sq_mask);
+	memset(sqe, 0, sizeof(*sqe));
+	__atomic_store_n(e->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	e->to_submit++;
+	return sqe;
+}
+
+/* queues the request for op, linked to a timeout of ms milliseconds if
+   ms >= 0. both need to go into the same submission, or the link breaks. */
+static int ring_queue(rs_ioEngine* e, rs_ioOp* op, int opcode, int fd, short events, long long ms) {
+	struct io_uring_sqe *sqe;
+	unsigned head = __atomic_load_n(e->sq_head, __ATOMIC_ACQUIRE);
+	size_t l;
+	if(*e->sq_tail - head + 2 > e->sq_entries && ring_enter(e, 0) == -1) return -1;
+	sqe = sqe_get(e);
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->user_data = op - e->ops + 1;
+	switch(opcode) {
+		case IORING_OP_POLL_ADD:
+			sqe->poll32_events = events;
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+			sqe->poll32_events = sqe->poll32_events << 16 | sqe->poll32_events >> 16;
+#endif
+			break;
+		case IORING_OP_SEND:
+			l = op->len - op->done;
+			sqe->addr = (unsigned long) (op->buf + op->done);
+			sqe->len = l > INT_MAX ? INT_MAX : l;
+			sqe->msg_flags = MSG_NOSIGNAL;
+			break;
+		case IORING_OP_RECV:
+			sqe->addr = (unsigned long) op->buf;
+			sqe->len = op->len > INT_MAX ? INT_MAX : op->len;
+			break;
+	}
+	if(ms < 0) return 0;
+	sqe->flags |= IOSQE_IO_LINK;
+	op->ts[0] = ms / 1000;
+	op->ts[1] = (ms % 1000) * 1000000;
+	sqe = sqe_get(e);
+	sqe->opcode = IORING_OP_LINK_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (unsigned long) op->ts;
+	sqe->len = 1;
+	return 0;
+}
+
+static void ring_init(rs_ioEngine* e, size_t count) {
+	struct io_uring_params p;
+	unsigned i, *array, entries = count > RS_RING_MAX / 2 ? RS_RING_MAX : count * 2;
+	char *sq, *cq = 0;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, entries, &p);
+	if(fd == -1) return;
+	/* without fast poll, sends and receives that can't complete right
+	   away would each block an io worker thread. */
+	if(!(p.features & IORING_FEAT_FAST_POLL)) goto fail;
+	e->sq_maplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	e->cq_maplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(e->cq_maplen > e->sq_maplen) e->sq_maplen = e->cq_maplen;
+		e->cq_maplen = 0;
+	}
+	sq = mmap(0, e->sq_maplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if(sq == MAP_FAILED) goto fail;
+	if(e->cq_maplen) {
+		cq = mmap(0, e->cq_maplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if(cq == MAP_FAILED) goto fail_sq;
+	}
+	e->sqes_maplen = p.sq_entries * sizeof(struct io_uring_sqe);
+	e->sqes = mmap(0, e->sqes_maplen, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if(e->sqes == MAP_FAILED) goto fail_cq;
+
+	e->sq_map = sq;
+	e->cq_map = cq;
+	if(!cq) cq = sq;
+	e->sq_head = (unsigned*) (sq + p.sq_off.head);
+	e->sq_tail = (unsigned*) (sq + p.sq_off.tail);
+	e->sq_mask = (unsigned*) (sq + p.sq_off.ring_mask);
+	e->cq_head = (unsigned*) (cq + p.cq_off.head);
+	e->cq_tail = (unsigned*) (cq + p.cq_off.tail);
+	e->cq_mask = (unsigned*) (cq + p.cq_off.ring_mask);
+	e->cqes = cq + p.cq_off.cqes;
+	array = (unsigned*) (sq + p.sq_off.array);
+	for(i = 0; i < p.sq_entries; i++) array[i] = i;
+	e->sq_entries = p.sq_entries;
+	e->ring = fd;
+	return;
+
+fail_cq:
+	if(cq) munmap(cq, e->cq_maplen);
+fail_sq:
+	munmap(sq, e->sq_maplen);
+fail:
+	close(fd);
+}
+
+#endif
+
+/* waits until the socket is ready for events, or for ms milliseconds
+   (-1: no limit) at most. */
+static void op_wait(rs_ioEngine* e, rs_ioOp* op, int fd, short events, long long ms) {
+	op->state = OP_WAIT;
+	op->fd = fd;
+	op->events = events;
+	op->wake = ms < 0 ? 0 : rocksock_now_ms() + ms;
+#ifdef USE_IO_URING
+	if(e->ring != -1 && ring_queue(e, op, IORING_OP_POLL_ADD, fd, events, ms)) {
+		int ret = rocksock_seterror(op->sock, RS_ET_SYS, errno, ROCKSOCK_FILENAME, __LINE__);
+		if(op->type == RS_IO_CONNECT) rocksock_disconnect(op->sock);
+		op_finish(e, op, ret);
+	}
+#endif
+}
+
+static void op_connect_step(rs_ioEngine* e, rs_ioOp* op) {
+	struct pollfd pfd[RS_MAX_ADDRS];
+	long long ms;
+	int ret, fd, want, hint;
+	ret = rocksock_connect_step(op->sock, &fd, &want);
+	if(ret || !want) {
+		op_finish(e, op, ret);
+		return;
+	}
+	/* only the latest attempt is waited on, the hint makes sure that the
+	   step starting the next one and checking all of them happens. */
+	rocksock_connect_pollfds(op->sock, pfd, &hint);
+	ms = op_timeleft(op);
+	if(hint != -1 && (ms == -1 || hint < ms)) ms = hint;
+	op_wait(e, op, fd, want == RS_WANT_READ ? POLLIN : POLLOUT, ms);
+}
+
+/* accounts the result of a send or recv, the byte count or -errno.
+   returns 1 if the operation isn't finished yet. */
+static int io_result(rs_ioEngine* e, rs_ioOp* op, long res) {
+	rocksock *sock = op->sock;
+	int ret;
+	if(res > 0) {
+		op->done += res;
+		if(op->type == RS_IO_SEND && op->done < op->len) return 1;
+		op_finish(e, op, rocksock_seterror(sock, RS_ET_OWN, 0, NULL, 0));
+		return 0;
+	}
+	if(!res)
+		ret = rocksock_seterror(sock, RS_ET_OWN, RS_E_REMOTE_DISCONNECTED, ROCKSOCK_FILENAME, __LINE__);
+	else if(res == -EINTR || res == -EAGAIN || res == -EWOULDBLOCK)
+		return 1;
+	else if(res == -ECANCELED) {
+		/* the linked timeout fired */
+		if(!op_expired(op)) return 1;
+		ret = rocksock_seterror(sock, RS_ET_OWN, op->type == RS_IO_SEND ? RS_E_HIT_WRITETIMEOUT : RS_E_HIT_READTIMEOUT,
+		                        ROCKSOCK_FILENAME, __LINE__);
+	} else
+		ret = rocksock_seterror(sock, RS_ET_SYS, -res, ROCKSOCK_FILENAME, __LINE__);
+	op_finish(e, op, ret);
+	return 0;
+}
+
+/* non-blocking send/recv until done or the socket isn't ready, in which
+   case it returns 1. */
+static int op_io(rs_ioEngine* e, rs_ioOp* op) {
+	rocksock *sock = op->sock;
+	char *p = op->buf;
+	size_t l = op->len;
+	ssize_t n;
+	do {
+		if(op->type == RS_IO_SEND) {
+			p = op->buf + op->done;
+			l = op->len - op->done;
+		}
+		/* the ssl functions only set errno for WANT_READ/WANT_WRITE */
+		errno = 0;
+#ifdef USE_SSL
+		if(sock->ssl)
+			n = op->type == RS_IO_SEND ? rocksock_ssl_send(sock, p, l) : rocksock_ssl_recv(sock, p, l);
+		else
+#endif
+		if(op->type == RS_IO_SEND)
+			n = send(sock->socket, p, l, MSG_NOSIGNAL | MSG_DONTWAIT);
+		else
+			n = recv(sock->socket, p, l, MSG_DONTWAIT);
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+		if(n < 0 && !errno) {
+			op_finish(e, op, rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__));
+			return 0;
+		}
+	} while(io_result(e, op, n < 0 ? -errno : n));
+	return 0;
+}
+
+static void op_start_io(rs_ioEngine* e, rs_ioOp* op) {
+	rocksock *sock = op->sock;
+	short events = op->type == RS_IO_SEND ? POLLOUT : POLLIN;
+#ifdef USE_SSL
+	/* openssl may have decrypted data at hand, and renegotiations need
+	   both directions, so tls sockets are always tried first. */
+	if(sock->ssl) {
+		op->nonblock = 1;
+		set_nonblock(sock->socket, 1);
+		if(op_io(e, op)) op_wait(e, op, sock->socket, events, op_timeleft(op));
+		return;
+	}
+#endif
+#ifdef USE_IO_URING
+	if(e->ring != -1) {
+		op->state = OP_WAIT;
+		if(ring_queue(e, op, op->type == RS_IO_SEND ? IORING_OP_SEND : IORING_OP_RECV, op->sock->socket, 0, op_timeleft(op)))
+			op_finish(e, op, rocksock_seterror(sock, RS_ET_SYS, errno, ROCKSOCK_FILENAME, __LINE__));
+		return;
+	}
+#endif
+	/* a send most likely fits into the socket buffer right away */
+	if(op->type == RS_IO_SEND && !op_io(e, op)) return;
+	op_wait(e, op, sock->socket, events, op_timeleft(op));
+}
+
+/* op's socket got ready, or its wait timed out */
+static void op_wake(rs_ioEngine* e, rs_ioOp* op, int ready) {
+	if(op->type == RS_IO_CONNECT) {
+		if(!ready && op_expired(op)) op_finish(e, op, rocksock_connect_expired(op->sock));
+		else op_connect_step(e, op);
+		return;
+	}
+	if(!ready && op_expired(op)) {
+		io_result(e, op, -ECANCELED);
+		return;
+	}
+	if(!ready || op_io(e, op))
+		op_wait(e, op, op->sock->socket, op->events, op_timeleft(op));
+}
+
+#ifdef USE_IO_URING
+static void ring_complete(rs_ioEngine* e, rs_ioOp* op, int res) {
+	if(op->type == RS_IO_CONNECT || op->nonblock) {
+		/* a poll request, the result is the revents or an error */
+		op_wake(e, op, res != -ECANCELED);
+		return;
+	}
+	if(io_result(e, op, res) &&
+	   ring_queue(e, op, op->type == RS_IO_SEND ? IORING_OP_SEND : IORING_OP_RECV, op->sock->socket, 0, op_timeleft(op)))
+		op_finish(e, op, rocksock_seterror(op->sock, RS_ET_SYS, errno, ROCKSOCK_FILENAME, __LINE__));
+}
+
+/* submits everything queued and reaps the completions, waiting for one
+   if there are none yet, all in one syscall. */
+static int ring_wait(rs_ioEngine* e) {
+	struct io_uring_cqe *cqe;
+	unsigned head = *e->cq_head;
+	unsigned long long ud;
+	if(head == __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE) && ring_enter(e, 1) == -1)
+		return -1;
+	for(; head != __atomic_load_n(e->cq_tail, __ATOMIC_ACQUIRE); head++) {
+		cqe = (struct io_uring_cqe*) e->cqes + (head & *e->cq_mask);
+		/* the linked timeouts have no user data */
+		if((ud = cqe->user_data)) ring_complete(e, &e->ops[ud - 1], cqe->res);
+	}
+	__atomic_store_n(e->cq_head, head, __ATOMIC_RELEASE);
+	return 0;
+}
+#endif
+
+static int poll_wait(rs_ioEngine* e) {
+	struct pollfd *pfd = e->pfds;
+	long long now = rocksock_now_ms(), wake = 0;
+	size_t i, j, n = 0;
+	rs_ioOp *op;
+	int ret, ms;
+
+	for(i = 0; i < e->size; i++) {
+		op = &e->ops[i];
+		if(op->state != OP_WAIT) continue;
+		pfd[n].fd = op->fd;
+		pfd[n].events = op->events;
+		pfd[n].revents = 0;
+		n++;
+		if(op->wake && (!wake || op->wake < wake)) wake = op->wake;
+	}
+	if(!wake) ms = -1;
+	else if(wake - now > INT_MAX) ms = INT_MAX;
+	else ms = wake > now ? wake - now : 0;
+	ret = poll(pfd, n, ms);
+	if(ret == -1) return errno == EINTR ? 0 : -1;
+	now = rocksock_now_ms();
+	/* only the op at hand changes its state, so the order still matches */
+	for(i = 0, j = 0; i < e->size && j < n; i++) {
+		op = &e->ops[i];
+		if(op->state != OP_WAIT) continue;
+		if(pfd[j++].revents) op_wake(e, op, 1);
+		else if(op->wake && now >= op->wake) op_wake(e, op, 0);
+	}
+	return 0;
+}
+
+static rs_ioOp* op_get(rs_ioEngine* e, rocksock* sock, rs_ioType type, char* buf, size_t len, void* data) {
+	rs_ioOp *op;
+	if(e->freelist == -1) return 0;
+	op = &e->ops[e->freelist];
+	e->freelist = op->next;
+	e->active++;
+	op->sock = sock;
+	op->data = data;
+	op->type = type;
+	op->buf = buf;
+	op->len = len;
+	op->done = 0;
+	op->error = 0;
+	op->nonblock = 0;
+	op->state = OP_WAIT;
+	if(sock->deadline) op->due = sock->deadline;
+	else op->due = sock->timeout ? rocksock_now_ms() + sock->timeout : 0;
+	return op;
+}
+
+int rocksock_ioengine_init(rs_ioEngine* e, rs_ioOp* ops, struct pollfd* pfds, size_t count, rs_ioBackend backend) {
+	size_t i;
+	if(!e || !ops || !pfds || !count || count > INT_MAX) return RS_E_NULL;
+	memset(e, 0, sizeof(*e));
+	e->ops = ops;
+	e->pfds = pfds;
+	e->size = count;
+	e->ring = -1;
+	e->donehead = e->donetail = -1;
+	for(i = 0; i < count; i++) {
+		ops[i].state = OP_FREE;
+		ops[i].next = i + 1 < count ? (int) i + 1 : -1;
+	}
+	e->freelist = 0;
+#ifdef USE_IO_URING
+	if(backend == RS_IOB_URING) ring_init(e, count);
+#endif
+	return 0;
+}
+
+rs_ioBackend rocksock_ioengine_backend(rs_ioEngine* e) {
+	return e->ring != -1 ? RS_IOB_URING : RS_IOB_POLL;
+}
+
+int rocksock_ioengine_connect(rs_ioEngine* e, rocksock* sock, const char* host, unsigned short port, int useSSL, void* data) {
+	rs_ioOp *op;
+	int ret;
+	if(!sock) return RS_E_NULL;
+	if(!e) return rocksock_seterror(sock, RS_ET_OWN, RS_E_NULL, ROCKSOCK_FILENAME, __LINE__);
+	if(!(op = op_get(e, sock, RS_IO_CONNECT, 0, 0, data)))
+		return rocksock_seterror(sock, RS_ET_OWN, RS_E_OUT_OF_BUFFER, ROCKSOCK_FILENAME, __LINE__);
+	ret = rocksock_connect_start(sock, host, port, useSSL);
+	if(ret) op_finish(e, op, ret);
+	else op_connect_step(e, op);
+	return 0;
+}
+
+static int queue_io(rs_ioEngine* e, rocksock* sock, rs_ioType type, char* buffer, size_t bufsize, void* data) {
+	rs_ioOp *op;
+	size_t n;
+	int ret;
+	if(!sock) return RS_E_NULL;
+	if(!e || !buffer || !bufsize) return rocksock_seterror(sock, RS_ET_OWN, RS_E_NULL, ROCKSOCK_FILENAME, __LINE__);
+	if(!(op = op_get(e, sock, type, buffer, bufsize, data)))
+		return rocksock_seterror(sock, RS_ET_OWN, RS_E_OUT_OF_BUFFER, ROCKSOCK_FILENAME, __LINE__);
+	if(sock->socket == -1)
+		op_finish(e, op, rocksock_seterror(sock, RS_ET_OWN, RS_E_NO_SOCKET, ROCKSOCK_FILENAME, __LINE__));
+	else if(type == RS_IO_RECV && sock->rpos < sock->rlen) {
+		/* served from the read buffer, without a syscall */
+		rocksock_recv(sock, buffer, bufsize, 0, &n);
+		op->done = n;
+		op_finish(e, op, 0);
+	/* what's left in the write buffer goes out first, blocking */
+	} else if(sock->wlen && (ret = rocksock_flush(sock)))
+		op_finish(e, op, ret);
+	else
+		op_start_io(e, op);
+	return 0;
+}
+
+int rocksock_ioengine_send(rs_ioEngine* e, rocksock* sock, char* buffer, size_t bufsize, void* data) {
+	return queue_io(e, sock, RS_IO_SEND, buffer, bufsize, data);
+}
+
+int rocksock_ioengine_recv(rs_ioEngine* e, rocksock* sock, char* buffer, size_t bufsize, void* data) {
+	return queue_io(e, sock, RS_IO_RECV, buffer, bufsize, data);
+}
+
+int rocksock_ioengine_run(rs_ioEngine* e, rs_ioCompletion* c, int max) {
+	rs_ioOp *op;
+	int n = 0;
+	if(!e || !c || max <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	for(;;) {
+		while(n < max && e->donehead != -1) {
+			op = &e->ops[e->donehead];
+			e->donehead = op->next;
+			if(e->donehead == -1) e->donetail = -1;
+			c[n].sock = op->sock;
+			c[n].data = op->data;
+			c[n].type = op->type;
+			c[n].error = op->error;
+			c[n].bytes = op->done;
+			n++;
+			op->state = OP_FREE;
+			op->next = e->freelist;
+			e->freelist = op - e->ops;
+			e->active--;
+		}
+		if(n || !e->active) return n;
+#ifdef USE_IO_URING
+		if(e->ring != -1) {
+			if(ring_wait(e)) return -1;
+			continue;
+		}
+#endif
+		if(poll_wait(e)) return -1;
+	}
+}
+
+void rocksock_ioengine_free(rs_ioEngine* e) {
+#ifdef USE_IO_URING
+	if(e->ring == -1) return;
+	munmap(e->sqes, e->sqes_maplen);
+	if(e->cq_map) munmap(e->cq_map, e->cq_maplen);
+	munmap(e->sq_map, e->sq_maplen);
+	close(e->ring);
+	e->ring = -1;
+#endif
+}
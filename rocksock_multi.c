@@ -0,0 +1,76 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "rocksock.h"
+
+int rocksock_multi_init(rs_multi* m, rocksock* socks, rs_ioOp* ops, struct pollfd* pfds, size_t inflight, rs_ioBackend backend, unsigned long timeout) {
+	if(!m || !socks || !ops || !pfds || !inflight) return RS_E_NULL;
+	memset(m, 0, sizeof(*m));
+	m->socks = socks;
+	m->inflight = inflight;
+	m->timeout = timeout;
+	return rocksock_ioengine_init(&m->engine, ops, pfds, inflight, backend);
+}
+
+/* starts the next job on sock, returns 0 if there was none */
+static int start_job(rs_multi* m, rocksock* sock) {
+	rs_multiJob *job;
+	int ret;
+	while(m->next < m->njobs) {
+		job = &m->jobs[m->next++];
+		rocksock_init(sock, job->proxies);
+		rocksock_set_timeout(sock, m->timeout);
+		if(job->proxies && job->nproxies > 0) sock->lastproxy = job->nproxies - 1;
+		ret = rocksock_ioengine_connect(&m->engine, sock, job->host, job->port, job->useSSL, job);
+		if(!ret) return 1;
+		m->cb(job, sock, ret, m->userdata);
+		rocksock_disconnect(sock);
+	}
+	return 0;
+}
+
+int rocksock_multi_run(rs_multi* m, rs_multiJob* jobs, size_t njobs, rs_multiCallback cb, void* userdata) {
+	rs_ioCompletion c[64];
+	rs_ioBackend backend;
+	size_t i, used;
+	int n, j;
+	if(!m || (!jobs && njobs) || !cb) {
+		errno = EINVAL;
+		return -1;
+	}
+	m->jobs = jobs;
+	m->njobs = njobs;
+	m->next = 0;
+	m->cb = cb;
+	m->userdata = userdata;
+	for(used = 0; used < m->inflight && start_job(m, &m->socks[used]); used++);
+	while((n = rocksock_ioengine_run(&m->engine, c, sizeof(c)/sizeof(c[0]))) > 0) {
+		for(j = 0; j < n; j++) {
+			cb(c[j].data, c[j].sock, c[j].error, userdata);
+			rocksock_disconnect(c[j].sock);
+			/* the rocksock of a finished job takes the next one */
+			start_job(m, c[j].sock);
+		}
+	}
+	/* the connects still in flight are abandoned, with their sockets, and
+	   the engine starts over so that m can be run again. a new ring
+	   makes sure no completion of the old operations turns up. */
+	if(n == -1) {
+		j = errno;
+		for(i = 0; i < used; i++) rocksock_disconnect(&m->socks[i]);
+		backend = rocksock_ioengine_backend(&m->engine);
+		rocksock_ioengine_free(&m->engine);
+		rocksock_ioengine_init(&m->engine, m->engine.ops, m->engine.pfds, m->engine.size, backend);
+		errno = j;
+	}
+	return n;
+}
+
+void rocksock_multi_free(rs_multi* m) {
+	rocksock_ioengine_free(&m->engine);
+}
@@ -25,9 +25,11 @@ void rocksock_init_ssl(void) {
 	SSL_library_init();
 	SSL_load_error_strings();
 	SSLeay_add_ssl_algorithms();
+	rocksock_ssl_default_init();
 }
 
 void rocksock_free_ssl(void) {
+	rocksock_ssl_default_free();
 	// TODO: there are still 3 memblocks allocated from SSL_library_init (88 bytes)
 	ERR_remove_state(0);
 	ERR_free_strings();
@@ -52,24 +54,72 @@ int rocksock_ssl_recv(rocksock* sock, char* buf, size_t sz) {
 	return ret;
 }
 
+int rocksock_ssl_shutdown(rocksock* sock) {
+	int ret = SSL_shutdown(sock->ssl);
+	if (ret >= 0) return 0;
+	switch(SSL_get_error(sock->ssl, ret)) {
+		case SSL_ERROR_WANT_READ: case SSL_ERROR_WANT_WRITE: errno = EWOULDBLOCK; break;
+		case SSL_ERROR_SYSCALL: break;
+		default: errno = 0; break;
+	}
+	return -1;
+}
+
+void* rocksock_ssl_ctx_new(const char* ciphers, const char* cafile, const char* capath) {
+	SSL_CTX *ctx = SSL_CTX_new(SSLv23_client_method());
+	if (!ctx) goto err;
+	if (ciphers && !SSL_CTX_set_cipher_list(ctx, ciphers)) goto err;
+	if (cafile || capath) {
+		if (!SSL_CTX_load_verify_locations(ctx, cafile, capath)) goto err;
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, 0);
+	}
+	return ctx;
+err:
+	ERR_print_errors_fp(stderr);
+	SSL_CTX_free(ctx);
+	return 0;
+}
+
+void rocksock_ssl_ctx_free(void* ctx) {
+	SSL_CTX_free(ctx);
+}
+
 int rocksock_ssl_connect_fd(rocksock* sock) {
-	sock->sslctx = SSL_CTX_new(SSLv23_client_method());
-	if (!sock->sslctx) {
-		ERR_print_errors_fp(stderr);
+	rs_sslContext *c = rocksock_ssl_acquire(sock);
+	if (!c)
 		return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
-	}
-	sock->ssl = SSL_new(sock->sslctx);
+	sock->sslctx = c;
+	sock->ssl = SSL_new(c->ctx);
 	if (!sock->ssl) {
 		ERR_print_errors_fp(stderr);
+		rocksock_sslctx_release(c);
+		sock->sslctx = 0;
 		return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
 	}
 	SSL_set_fd(sock->ssl, sock->socket);
+	/* only checked if the context verifies the peer */
+	SSL_set1_host(sock->ssl, sock->cs.target.host);
+	rocksock_sslcache_get(sock);
+#ifdef SSL_OP_ENABLE_KTLS
+	/* only takes effect if the kernel supports the negotiated cipher */
+	SSL_set_options(sock->ssl, SSL_OP_ENABLE_KTLS);
+#endif
+	return 0;
+}
+
+int rocksock_ssl_connect_step(rocksock* sock, int* want) {
 	int ret = SSL_connect(sock->ssl);
+	*want = RS_WANT_NONE;
 	if(ret != 1) {
-		if((ret = SSL_get_error(sock->ssl, ret)) == SSL_ERROR_WANT_READ)
-			return rocksock_seterror(sock, RS_ET_OWN, RS_E_HIT_CONNECTTIMEOUT, ROCKSOCK_FILENAME, __LINE__);
+		switch((ret = SSL_get_error(sock->ssl, ret))) {
+			case SSL_ERROR_WANT_READ:
+				*want = RS_WANT_READ;
+				return 0;
+			case SSL_ERROR_WANT_WRITE:
+				*want = RS_WANT_WRITE;
+				return 0;
+		}
 		//ERR_print_errors_fp(stderr);
-		//printf("%dxxx\n", SSL_get_error(sock->ssl, ret));
 		return rocksock_seterror(sock, RS_ET_SSL, ret, ROCKSOCK_FILENAME, __LINE__);
 	}
 	return 0;
@@ -77,17 +127,67 @@ int rocksock_ssl_connect_fd(rocksock* sock) {
 
 void rocksock_ssl_free_context(rocksock *sock) {
         if(sock->ssl) {
-                SSL_shutdown(sock->ssl);
+                rocksock_sslcache_put(sock);
+                /* a second call would wait for the peer's close_notify */
+                if(!(SSL_get_shutdown(sock->ssl) & SSL_SENT_SHUTDOWN))
+                        SSL_shutdown(sock->ssl);
                 SSL_free(sock->ssl);
-                SSL_CTX_free(sock->sslctx);
+                rocksock_sslctx_release(sock->sslctx);
                 sock->ssl = 0;
+                sock->sslctx = 0;
         }
 }
 
+void* rocksock_ssl_get_session(rocksock* sock) {
+	SSL_SESSION *s = SSL_get1_session(sock->ssl);
+	if(s && !SSL_SESSION_is_resumable(s)) {
+		SSL_SESSION_free(s);
+		s = 0;
+	}
+	return s;
+}
+
+void rocksock_ssl_set_session(rocksock* sock, void* session) {
+	SSL_set_session(sock->ssl, session);
+}
+
+void rocksock_ssl_session_free(void* session) {
+	SSL_SESSION_free(session);
+}
+
+int rocksock_ssl_session_reused(rocksock* sock) {
+	return SSL_session_reused(sock->ssl);
+}
+
 int rocksock_ssl_pending(rocksock *sock) {
 	return SSL_pending(sock->ssl);
 }
 
+int rocksock_ssl_ktls_send(rocksock *sock) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	return BIO_get_ktls_send(SSL_get_wbio(sock->ssl));
+#else
+	return 0;
+#endif
+}
+
+ssize_t rocksock_ssl_sendfile(rocksock* sock, int fd, off_t offset, size_t sz) {
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	ossl_ssize_t ret = SSL_sendfile(sock->ssl, fd, offset, sz, 0);
+	if (ret < 0) switch(SSL_get_error(sock->ssl, ret)) {
+		case SSL_ERROR_WANT_WRITE: errno = EWOULDBLOCK; break;
+		/* errno is the one of the failed syscall */
+		case SSL_ERROR_SYSCALL: break;
+		/* no errno, the caller reports an ssl error */
+		default: errno = 0; break;
+	}
+	return ret;
+#else
+	errno = EOPNOTSUPP;
+	return -1;
+#endif
+}
+
 int rocksock_ssl_peek(rocksock* sock, int *result) {
         char buf[4];
 	int ret;
@@ -9,7 +9,7 @@
 #define _GNU_SOURCE
 
 #include <stdio.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <errno.h>
 
@@ -33,23 +33,21 @@ int rocksock_peek(rocksock* sock, int *result) {
 	if(!result)
 		return rocksock_seterror(sock, RS_ET_OWN, RS_E_NULL, ROCKSOCK_FILENAME, __LINE__);
 	if (sock->socket == -1) return rocksock_seterror(sock, RS_ET_OWN, RS_E_NO_SOCKET, ROCKSOCK_FILENAME, __LINE__);
+	if(sock->rpos < sock->rlen) {
+		*result = 1;
+		return rocksock_seterror(sock, RS_ET_OWN, 0, NULL, 0);
+	}
 #ifdef USE_SSL
 	if(sock->ssl && rocksock_ssl_pending(sock)) {
 		*result = 1;
 		goto no_err;
 	}
 #endif
-	fd_set readfds;
-
-	struct timeval tv;
-	tv.tv_sec = 0;
-	tv.tv_usec = 1;
-	FD_ZERO(&readfds);
-	FD_SET(sock->socket, &readfds);
+	struct pollfd pfd = {.fd = sock->socket, .events = POLLIN};
 
-	readv = select(sock->socket + 1, &readfds, 0, 0, &tv);
+	readv = poll(&pfd, 1, 0);
 	if(readv < 0) return rocksock_seterror(sock, RS_ET_SYS, errno, ROCKSOCK_FILENAME, __LINE__);
-	*result = FD_ISSET(sock->socket, &readfds);
+	*result = readv > 0 && (pfd.revents & (POLLIN | POLLHUP | POLLERR));
 #ifdef USE_SSL
 	if(sock->ssl && *result) {
 		return rocksock_ssl_peek(sock, result);
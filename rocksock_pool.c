@@ -0,0 +1,283 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+
+//RcB: LINK "-lpthread"
+
+#ifndef ROCKSOCK_FILENAME
+#define ROCKSOCK_FILENAME __FILE__
+#endif
+
+enum {
+	PE_FREE = 0,
+	PE_IDLE,
+	/* taken out by checkout for the liveness check */
+	PE_BUSY,
+};
+
+int rocksock_pool_init(rs_pool* pool, rs_poolEntry* entries, size_t count, unsigned long idle_timeout, unsigned max_per_key) {
+	if(!pool || !entries || !count) return RS_E_NULL;
+	memset(entries, 0, count * sizeof(*entries));
+	pool->entries = entries;
+	pool->size = count;
+	pool->idle_timeout = idle_timeout;
+	pool->max_per_key = max_per_key;
+	pool->hits = pool->misses = 0;
+	if(pthread_mutex_init(&pool->lock, 0)) return RS_E_NULL;
+	return 0;
+}
+
+/* FNV-1a over everything that makes a connection reusable */
+static unsigned long long hash_bytes(unsigned long long h, const void* data, size_t len) {
+	const unsigned char *p = data;
+	while(len--) h = (h ^ *p++) * 1099511628211ULL;
+	return h;
+}
+
+static unsigned long long hash_str(unsigned long long h, const char* s) {
+	/* include the terminator so that adjacent strings can't run together */
+	return hash_bytes(h, s, strlen(s) + 1);
+}
+
+static char* pack_str(char* p, const char* s) {
+	size_t l = strlen(s) + 1;
+	memcpy(p, s, l);
+	return p + l;
+}
+
+/* fills the key fields of k, the proxy chain is packed into k->chain.
+   returns -1 if it doesn't fit, such connections aren't pooled. */
+static int make_key(rocksock* sock, const char* host, unsigned short port, int useSSL, rs_poolEntry* k) {
+	unsigned long long h = 14695981039346656037ULL;
+	char *p = k->chain;
+	ptrdiff_t i;
+	for(i = 0; i <= sock->lastproxy; i++) {
+		rs_proxy *px = &sock->proxies[i];
+		if((size_t) (p - k->chain) + 3 + strlen(px->hostinfo.host) + 1 +
+		   strlen(px->username) + 1 + strlen(px->password) + 1 > sizeof(k->chain))
+			return -1;
+		*p++ = px->proxytype;
+		*p++ = px->hostinfo.port >> 8;
+		*p++ = px->hostinfo.port & 0xff;
+		p = pack_str(p, px->hostinfo.host);
+		p = pack_str(p, px->username);
+		p = pack_str(p, px->password);
+	}
+	k->chainlen = p - k->chain;
+	memcpy(k->host, host, strlen(host) + 1);
+	k->port = port;
+	k->useSSL = useSSL;
+	h = hash_bytes(h, k->chain, k->chainlen);
+	h = hash_str(h, host);
+	h = hash_bytes(h, &port, sizeof(port));
+	k->key = hash_bytes(h, &useSSL, sizeof(useSSL));
+	return 0;
+}
+
+/* the hash rules out most mismatches, the rest is compared exactly */
+static int same_key(const rs_poolEntry* e, const rs_poolEntry* k) {
+	return e->key == k->key && e->port == k->port && e->useSSL == k->useSSL &&
+	       e->chainlen == k->chainlen && !memcmp(e->chain, k->chain, k->chainlen) &&
+	       !strcmp(e->host, k->host);
+}
+
+/* moves the connection of e into sock */
+static void entry_to_sock(rs_poolEntry* e, rocksock* sock) {
+	sock->socket = e->socket;
+	sock->rcvtimeo = e->rcvtimeo;
+	sock->sndtimeo = e->sndtimeo;
+	sock->ssl = e->ssl;
+	sock->sslctx = e->sslctx;
+	e->socket = -1;
+	e->ssl = e->sslctx = 0;
+}
+
+static void entry_close(rs_poolEntry* e) {
+	rocksock tmp;
+	rocksock_init(&tmp, 0);
+	/* the target is needed to keep the tls session */
+	memcpy(tmp.cs.target.host, e->host, strlen(e->host) + 1);
+	tmp.cs.target.port = e->port;
+	entry_to_sock(e, &tmp);
+	rocksock_disconnect(&tmp);
+	e->state = PE_FREE;
+}
+
+static int entry_expired(rs_pool* pool, rs_poolEntry* e, long long now) {
+	return pool->idle_timeout && now - e->idle_since >= (long long) pool->idle_timeout;
+}
+
+/* an idle connection must not have anything to say, if it does, it's
+   most likely the eof of a server-side close. the socket is non-blocking
+   during the check so that a tls record without application data (e.g. a
+   tls 1.3 session ticket) doesn't make the peek wait for the read timeout. */
+static int entry_alive(rocksock* sock) {
+	int flags, avail = 0, ret;
+	flags = fcntl(sock->socket, F_GETFL);
+	if(flags == -1) return 0;
+	fcntl(sock->socket, F_SETFL, flags | O_NONBLOCK);
+	ret = rocksock_peek(sock, &avail);
+	fcntl(sock->socket, F_SETFL, flags);
+	if(ret == RS_E_HIT_READTIMEOUT && sock->lasterror.errortype == RS_ET_OWN) ret = avail = 0;
+	return !ret && !avail;
+}
+
+/* finds the most recently checked in idle connection for k and marks it
+   busy. expired ones are left to rocksock_pool_expire and eviction, since
+   closing them can't be done under the lock. */
+static rs_poolEntry* take_entry(rs_pool* pool, const rs_poolEntry* k) {
+	rs_poolEntry *e, *best = 0;
+	long long now = rocksock_now_ms();
+	size_t i;
+	for(i = 0; i < pool->size; i++) {
+		e = &pool->entries[i];
+		if(e->state != PE_IDLE || !same_key(e, k) || entry_expired(pool, e, now)) continue;
+		if(!best || e->idle_since > best->idle_since) best = e;
+	}
+	if(best) best->state = PE_BUSY;
+	return best;
+}
+
+int rocksock_pool_checkout(rs_pool* pool, rocksock* sock, const char* host, unsigned short port, int useSSL) {
+	rs_poolEntry *e, k;
+	int alive;
+	if(!sock) return RS_E_NULL;
+	if(!pool || !host) return rocksock_seterror(sock, RS_ET_OWN, RS_E_NULL, ROCKSOCK_FILENAME, __LINE__);
+	if(strlen(host) >= sizeof(e->host))
+		return rocksock_seterror(sock, RS_ET_OWN, RS_E_HOSTNAME_TOO_LONG, ROCKSOCK_FILENAME, __LINE__);
+	if(make_key(sock, host, port, useSSL, &k))
+		return rocksock_connect(sock, host, port, useSSL);
+	for(;;) {
+		pthread_mutex_lock(&pool->lock);
+		e = take_entry(pool, &k);
+		if(!e) pool->misses++;
+		pthread_mutex_unlock(&pool->lock);
+		if(!e) break;
+		/* the check happens outside the lock since it may read a tls record */
+		entry_to_sock(e, sock);
+		alive = entry_alive(sock);
+		pthread_mutex_lock(&pool->lock);
+		e->state = PE_FREE;
+		if(alive) pool->hits++;
+		pthread_mutex_unlock(&pool->lock);
+		if(alive) {
+			memcpy(sock->cs.target.host, host, strlen(host) + 1);
+			sock->cs.target.port = port;
+			sock->cs.useSSL = useSSL;
+			sock->connected = 1;
+			return rocksock_seterror(sock, RS_ET_OWN, 0, NULL, 0);
+		}
+		rocksock_disconnect(sock);
+	}
+	return rocksock_connect(sock, host, port, useSSL);
+}
+
+int rocksock_pool_checkin(rs_pool* pool, rocksock* sock) {
+	rs_poolEntry *e, *slot = 0, *oldest = 0, k, evicted;
+	rs_errorInfo err;
+	unsigned n = 0;
+	size_t i;
+	int ret;
+	if(!sock) return RS_E_NULL;
+	if(!pool) return rocksock_seterror(sock, RS_ET_OWN, RS_E_NULL, ROCKSOCK_FILENAME, __LINE__);
+	if(sock->socket == -1 || !sock->connected) {
+		rocksock_disconnect(sock);
+		return rocksock_seterror(sock, RS_ET_OWN, RS_E_NO_SOCKET, ROCKSOCK_FILENAME, __LINE__);
+	}
+	/* buffered data would otherwise go to whoever checks it out next */
+	if(sock->wlen && (ret = rocksock_flush(sock))) {
+		err = sock->lasterror;
+		rocksock_disconnect(sock);
+		sock->lasterror = err;
+		return ret;
+	}
+	if(make_key(sock, sock->cs.target.host, sock->cs.target.port, sock->cs.useSSL, &k))
+		return rocksock_disconnect(sock);
+
+	evicted.state = PE_FREE;
+	pthread_mutex_lock(&pool->lock);
+	for(i = 0; i < pool->size; i++) {
+		e = &pool->entries[i];
+		if(e->state == PE_FREE) {
+			if(!slot) slot = e;
+			continue;
+		}
+		if(e->state == PE_IDLE && same_key(e, &k)) n++;
+		if(e->state == PE_IDLE && (!oldest || e->idle_since < oldest->idle_since))
+			oldest = e;
+	}
+	if(pool->max_per_key && n >= pool->max_per_key) slot = 0;
+	else if(!slot && oldest) {
+		/* evict the connection that has been idle the longest, it's
+		   closed once the lock is released */
+		evicted = *oldest;
+		slot = oldest;
+	}
+	if(slot) {
+		slot->key = k.key;
+		memcpy(slot->chain, k.chain, k.chainlen);
+		slot->chainlen = k.chainlen;
+		memcpy(slot->host, k.host, strlen(k.host) + 1);
+		slot->port = k.port;
+		slot->useSSL = k.useSSL;
+		slot->idle_since = rocksock_now_ms();
+		slot->socket = sock->socket;
+		slot->rcvtimeo = sock->rcvtimeo;
+		slot->sndtimeo = sock->sndtimeo;
+		slot->ssl = sock->ssl;
+		slot->sslctx = sock->sslctx;
+		slot->state = PE_IDLE;
+		sock->socket = -1;
+		sock->ssl = sock->sslctx = 0;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	if(evicted.state == PE_IDLE) entry_close(&evicted);
+	/* no-op if the connection was pooled */
+	return rocksock_disconnect(sock);
+}
+
+void rocksock_pool_expire(rs_pool* pool) {
+	rs_poolEntry e;
+	long long now = rocksock_now_ms();
+	size_t i;
+	pthread_mutex_lock(&pool->lock);
+	for(i = 0; i < pool->size; i++) {
+		if(pool->entries[i].state != PE_IDLE || !entry_expired(pool, &pool->entries[i], now))
+			continue;
+		/* closing may wait for the peer (tls shutdown), so it's done on
+		   a copy without holding the lock */
+		e = pool->entries[i];
+		pool->entries[i].state = PE_FREE;
+		pthread_mutex_unlock(&pool->lock);
+		entry_close(&e);
+		pthread_mutex_lock(&pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void rocksock_pool_stats(rs_pool* pool, unsigned long *hits, unsigned long *misses) {
+	pthread_mutex_lock(&pool->lock);
+	if(hits) *hits = pool->hits;
+	if(misses) *misses = pool->misses;
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void rocksock_pool_free(rs_pool* pool) {
+	size_t i;
+	for(i = 0; i < pool->size; i++)
+		if(pool->entries[i].state == PE_IDLE) entry_close(&pool->entries[i]);
+	pthread_mutex_destroy(&pool->lock);
+}
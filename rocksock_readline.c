@@ -9,19 +9,49 @@
 #define _GNU_SOURCE
 
 #include <stddef.h>
+#include <string.h>
 #include "rocksock_internal.h"
 
 #ifndef ROCKSOCK_FILENAME
 #define ROCKSOCK_FILENAME __FILE__
 #endif
 
+/* readline on top of the read buffer: everything available is read at
+   once, and scanned for the line end with memchr. */
+static int readline_buffered(rocksock* sock, char* buffer, size_t bufsize, size_t* bytesread) {
+	size_t avail, l, n;
+	char *nl;
+	int ret;
+	for(;;) {
+		avail = sock->rlen - sock->rpos;
+		nl = memchr(sock->rbuf + sock->rpos, '\n', avail);
+		l = nl ? (size_t) (nl - (sock->rbuf + sock->rpos)) + 1 : avail;
+		if(l > bufsize - *bytesread) l = bufsize - *bytesread;
+		memcpy(buffer + *bytesread, sock->rbuf + sock->rpos, l);
+		sock->rpos += l;
+		*bytesread += l;
+		if(nl && sock->rbuf + sock->rpos > nl) {
+			*bytesread -= 1;
+			buffer[*bytesread] = 0;
+			return 0;
+		}
+		if(*bytesread == bufsize) break;
+		/* the buffer is empty, so recv refills it with a single read */
+		sock->rpos = sock->rlen = 0;
+		ret = rocksock_recv(sock, sock->rbuf, sock->rbufsize, 0, &n);
+		if(ret || !n) return ret;
+		sock->rlen = n;
+	}
+	return rocksock_seterror(sock, RS_ET_OWN, RS_E_OUT_OF_BUFFER,
+	                         ROCKSOCK_FILENAME, __LINE__);
+}
+
 // tries to read exactly one line, until '\n', then overwrites the \n with \0
 // bytesread contains the number of bytes read till \n was encountered
 // (so 0 in case \n was the first char).
 // returns RS_E_OUT_OF_BUFFER if the line doesnt fit into the buffer.
 int rocksock_readline(rocksock* sock, char* buffer, size_t bufsize, size_t* bytesread) {
-	// TODO: make more efficient by peeking into the buffer (Flag MSG_PEEK to recv), instead of reading byte by byte
-	// would need a different approach for ssl though.
+	// without a read buffer (rocksock_set_readbuffer), this reads byte by byte.
 	if (!sock) return RS_E_NULL;
 	if (!buffer || !bufsize || !bytesread)
 		return rocksock_seterror(sock, RS_ET_OWN, RS_E_NULL,
@@ -30,6 +60,7 @@ int rocksock_readline(rocksock* sock, char* buffer, size_t bufsize, size_t* byte
 	size_t bytesread2 = 0;
 	int ret;
 	*bytesread = 0;
+	if (sock->rbuf) return readline_buffered(sock, buffer, bufsize, bytesread);
 	while(*bytesread < bufsize) {
 		ret = rocksock_recv(sock, ptr, 1, 1, &bytesread2);
 		if(ret || !bytesread2) return ret;
@@ -0,0 +1,255 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+#ifdef USE_SSL
+#include "rocksock_ssl_internal.h"
+#endif
+
+#ifndef ROCKSOCK_FILENAME
+#define ROCKSOCK_FILENAME __FILE__
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifdef SPLICE_F_MOVE
+#define HAVE_SPLICE
+#endif
+
+/* bytes per splice, the default capacity of a pipe */
+#define RELAY_CHUNK 65536
+
+/* results of the non-blocking transfers besides a byte count */
+enum {
+	IO_WAIT = -1,
+	IO_ERROR = -2,
+};
+
+static ssize_t io_result(rocksock* sock, ssize_t n, int* err) {
+	if(n >= 0) return n;
+	if(errno == EAGAIN || errno == EWOULDBLOCK) return IO_WAIT;
+	if(errno) *err = rocksock_seterror(sock, RS_ET_SYS, errno, ROCKSOCK_FILENAME, __LINE__);
+	else *err = rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
+	return IO_ERROR;
+}
+
+/* reads from or writes to sock without blocking */
+static ssize_t sock_io(rocksock* sock, int wr, char* buf, size_t len, int* err) {
+	ssize_t n;
+	do {
+		errno = 0;
+#ifdef USE_SSL
+		if(sock->ssl)
+			n = wr ? rocksock_ssl_send(sock, buf, len) : rocksock_ssl_recv(sock, buf, len);
+		else
+#endif
+		n = wr ? send(sock->socket, buf, len, MSG_NOSIGNAL) : recv(sock->socket, buf, len, 0);
+	} while(n < 0 && errno == EINTR);
+	return io_result(sock, n, err);
+}
+
+#ifdef USE_SSL
+/* sends close_notify without blocking */
+static ssize_t ssl_close(rocksock* sock, int* err) {
+	ssize_t n;
+	do {
+		errno = 0;
+		n = rocksock_ssl_shutdown(sock);
+	} while(n < 0 && errno == EINTR);
+	return io_result(sock, n, err);
+}
+#endif
+
+#ifdef HAVE_SPLICE
+/* errors are blamed on sock, the socket end of the splice */
+static ssize_t pipe_io(rocksock* sock, int in, int out, size_t len, int* err) {
+	ssize_t n;
+	do n = splice(in, 0, out, 0, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	while(n < 0 && errno == EINTR);
+	return io_result(sock, n, err);
+}
+#endif
+
+static size_t pending(rs_relay* r, int d) {
+	return r->splice ? r->inpipe[d] : r->blen[d] - r->bpos[d];
+}
+
+static void moved(rs_relay* r, int d, size_t n) {
+	r->bytes[d] += n;
+	r->lastactive = rocksock_now_ms();
+}
+
+/* moves data from socks[d] to socks[!d] until either would block */
+static int pump(rs_relay* r, int d) {
+	rocksock *src = r->socks[d], *dst = r->socks[!d];
+	size_t half = r->bufsize / 2;
+	char *buf = r->buf + d * half;
+	ssize_t n;
+	int err = 0;
+
+	/* what's left in the read buffer of src goes first */
+	while(src->rpos < src->rlen) {
+		n = sock_io(dst, 1, src->rbuf + src->rpos, src->rlen - src->rpos, &err);
+		if(n < 0) return n == IO_WAIT ? 0 : err;
+		src->rpos += n;
+		moved(r, d, n);
+	}
+	for(;;) {
+		if(!pending(r, d) && !r->eof[d]) {
+#ifdef HAVE_SPLICE
+			if(r->splice) n = pipe_io(src, src->socket, r->pipes[d][1], RELAY_CHUNK, &err);
+			else
+#endif
+			n = sock_io(src, 0, buf, half, &err);
+			if(n == IO_ERROR) return err;
+			if(n == IO_WAIT) break;
+			if(!n) r->eof[d] = 1;
+			else if(r->splice) r->inpipe[d] = n;
+			else {
+				r->bpos[d] = 0;
+				r->blen[d] = n;
+			}
+		}
+		if(!pending(r, d)) break;
+#ifdef HAVE_SPLICE
+		if(r->splice) n = pipe_io(dst, r->pipes[d][0], dst->socket, r->inpipe[d], &err);
+		else
+#endif
+		n = sock_io(dst, 1, buf + r->bpos[d], r->blen[d] - r->bpos[d], &err);
+		if(n == IO_ERROR) return err;
+		if(n == IO_WAIT) break;
+		if(r->splice) r->inpipe[d] -= n;
+		else r->bpos[d] += n;
+		moved(r, d, n);
+	}
+	if(r->eof[d] && !pending(r, d) && !r->shut[d]) {
+		/* pass the eof on, the other direction keeps going. a tls peer
+		   gets close_notify first, so it can tell the eof from a
+		   truncation attack. */
+#ifdef USE_SSL
+		if(dst->ssl && (n = ssl_close(dst, &err)) < 0) return n == IO_WAIT ? 0 : err;
+#endif
+		shutdown(dst->socket, SHUT_WR);
+		r->shut[d] = 1;
+	}
+	return 0;
+}
+
+static void close_pipes(rs_relay* r) {
+	int i;
+	for(i = 0; i < 4; i++) if(r->pipes[i / 2][i % 2] != -1) {
+		close(r->pipes[i / 2][i % 2]);
+		r->pipes[i / 2][i % 2] = -1;
+	}
+}
+
+int rocksock_relay_init(rs_relay* r, rocksock* a, rocksock* b, char* buf, size_t bufsize, unsigned long idle_timeout) {
+	int i, ret, ssl = 0;
+	if(!r || !a || !b) return RS_E_NULL;
+	if(a->socket == -1) return rocksock_seterror(a, RS_ET_OWN, RS_E_NO_SOCKET, ROCKSOCK_FILENAME, __LINE__);
+	if(b->socket == -1) return rocksock_seterror(b, RS_ET_OWN, RS_E_NO_SOCKET, ROCKSOCK_FILENAME, __LINE__);
+	memset(r, 0, sizeof(*r));
+	r->socks[0] = a;
+	r->socks[1] = b;
+	r->buf = buf;
+	r->bufsize = buf ? bufsize : 0;
+	r->idle_timeout = idle_timeout;
+	for(i = 0; i < 4; i++) r->pipes[i / 2][i % 2] = -1;
+	r->fdflags[0] = r->fdflags[1] = -1;
+	/* whatever the caller left in the write buffers goes out first */
+	if((ret = rocksock_flush(a)) || (ret = rocksock_flush(b))) return ret;
+#ifdef USE_SSL
+	ssl = a->ssl || b->ssl;
+#endif
+#ifdef HAVE_SPLICE
+	if(!ssl) {
+		if(!pipe2(r->pipes[0], O_NONBLOCK) && !pipe2(r->pipes[1], O_NONBLOCK)) r->splice = 1;
+		else {
+			ret = errno;
+			close_pipes(r);
+			if(r->bufsize < 2) return rocksock_seterror(a, RS_ET_SYS, ret, ROCKSOCK_FILENAME, __LINE__);
+		}
+	}
+#endif
+	if(!r->splice && r->bufsize < 2)
+		return rocksock_seterror(a, RS_ET_OWN, RS_E_OUT_OF_BUFFER, ROCKSOCK_FILENAME, __LINE__);
+	for(i = 0; i < 2; i++) {
+		r->fdflags[i] = fcntl(r->socks[i]->socket, F_GETFL);
+		if(r->fdflags[i] != -1) fcntl(r->socks[i]->socket, F_SETFL, r->fdflags[i] | O_NONBLOCK);
+	}
+	r->lastactive = rocksock_now_ms();
+	return rocksock_seterror(a, RS_ET_OWN, 0, NULL, 0);
+}
+
+int rocksock_relay_step(rs_relay* r) {
+	int d, ret;
+	if(!r) return RS_E_NULL;
+	for(d = 0; d < 2; d++)
+		if((ret = pump(r, d))) return ret;
+	if(r->idle_timeout && !(r->shut[0] && r->shut[1]) &&
+	   rocksock_now_ms() - r->lastactive >= (long long) r->idle_timeout)
+		return rocksock_seterror(r->socks[0], RS_ET_OWN, RS_E_HIT_TIMEOUT, ROCKSOCK_FILENAME, __LINE__);
+	return rocksock_seterror(r->socks[0], RS_ET_OWN, 0, NULL, 0);
+}
+
+int rocksock_relay_pollfds(rs_relay* r, struct pollfd* pfd, int* timeout_ms) {
+	short events[2] = {0, 0};
+	long long left;
+	int d, n = 0;
+	*timeout_ms = -1;
+	for(d = 0; d < 2; d++) {
+		if(r->shut[d]) continue;
+		/* a direction either waits for its destination to take the
+		   data at hand (or the close_notify after the eof), or for its
+		   source to deliver more */
+		if(pending(r, d) || r->socks[d]->rpos < r->socks[d]->rlen || r->eof[d]) events[!d] |= POLLOUT;
+		else events[d] |= POLLIN;
+	}
+	for(d = 0; d < 2; d++) if(events[d]) {
+		pfd[n].fd = r->socks[d]->socket;
+		pfd[n].events = events[d];
+		pfd[n].revents = 0;
+		n++;
+	}
+	if(n && r->idle_timeout) {
+		left = r->lastactive + r->idle_timeout - rocksock_now_ms();
+		*timeout_ms = left < 0 ? 0 : left > INT_MAX ? INT_MAX : left;
+	}
+	return n;
+}
+
+int rocksock_relay(rs_relay* r) {
+	struct pollfd pfd[2];
+	int n, timeout, ret;
+	if(!r) return RS_E_NULL;
+	for(;;) {
+		if((ret = rocksock_relay_step(r))) return ret;
+		if(!(n = rocksock_relay_pollfds(r, pfd, &timeout))) return 0;
+		if(poll(pfd, n, timeout) == -1 && errno != EINTR)
+			return rocksock_seterror(r->socks[0], RS_ET_SYS, errno, ROCKSOCK_FILENAME, __LINE__);
+	}
+}
+
+void rocksock_relay_free(rs_relay* r) {
+	int i;
+	close_pipes(r);
+	for(i = 0; i < 2; i++)
+		if(r->fdflags[i] != -1 && r->socks[i]->socket != -1)
+			fcntl(r->socks[i]->socket, F_SETFL, r->fdflags[i]);
+}
@@ -0,0 +1,113 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+#ifdef USE_SSL
+#include "rocksock_ssl_internal.h"
+#endif
+
+#ifndef ROCKSOCK_FILENAME
+#define ROCKSOCK_FILENAME __FILE__
+#endif
+
+/* size of the copy buffer, one full tls record */
+#define RS_SENDFILE_BUF 16384
+
+enum {
+	SF_SENDFILE,
+	SF_KTLS,
+	SF_COPY,
+};
+
+/* reads a chunk of the file into buf and sends it the regular way, but
+   past the write buffer, which would only copy it once more */
+static int copy_chunk(rocksock* sock, char* buf, int fd, off_t offset, size_t len, ssize_t* sent) {
+	struct iovec iov = {.iov_base = buf};
+	ssize_t n;
+	size_t w;
+	int ret;
+	*sent = 0;
+	if(len > RS_SENDFILE_BUF) len = RS_SENDFILE_BUF;
+	do n = pread(fd, buf, len, offset);
+	while(n == -1 && errno == EINTR);
+	if(n == -1) return rocksock_seterror(sock, RS_ET_SYS, errno, ROCKSOCK_FILENAME, __LINE__);
+	*sent = n;
+	if(!n) return 0;
+	iov.iov_len = n;
+	ret = rocksock_transfer(sock, RS_OT_SEND, &iov, 1, 0, &w, 0);
+	*sent = w;
+	return ret;
+}
+
+int rocksock_sendfile(rocksock* sock, int fd, off_t offset, size_t len, size_t* bytessent) {
+	char buf[RS_SENDFILE_BUF];
+	int ret, mode = SF_SENDFILE;
+	ssize_t n;
+	if (!sock) return RS_E_NULL;
+	if (fd == -1 || offset < 0 || !bytessent)
+		return rocksock_seterror(sock, RS_ET_OWN, RS_E_NULL, ROCKSOCK_FILENAME, __LINE__);
+	*bytessent = 0;
+	if (sock->socket == -1) return rocksock_seterror(sock, RS_ET_OWN, RS_E_NO_SOCKET, ROCKSOCK_FILENAME, __LINE__);
+
+	/* whatever was buffered must go out before the file */
+	ret = rocksock_flush(sock);
+	if (ret) return ret;
+	ret = rocksock_apply_timeout(sock, RS_OT_SEND);
+	if (ret) return ret;
+#ifdef USE_SSL
+	if(sock->ssl) mode = rocksock_ssl_ktls_send(sock) ? SF_KTLS : SF_COPY;
+#endif
+
+	while(*bytessent < len) {
+		if(*bytessent && sock->deadline && (ret = rocksock_apply_timeout(sock, RS_OT_SEND)))
+			return ret;
+		switch(mode) {
+			case SF_SENDFILE:
+				n = sendfile(sock->socket, fd, &offset, len - *bytessent);
+				/* e.g. a file type that doesn't support it */
+				if(n == -1 && !*bytessent && (errno == EINVAL || errno == ENOSYS)) {
+					mode = SF_COPY;
+					continue;
+				}
+				break;
+#ifdef USE_SSL
+			case SF_KTLS:
+				errno = 0;
+				n = rocksock_ssl_sendfile(sock, fd, offset, len - *bytessent);
+				if(n > 0) offset += n;
+				else if(n == -1 && !errno)
+					return rocksock_seterror(sock, RS_ET_OWN, RS_E_SSL_GENERIC, ROCKSOCK_FILENAME, __LINE__);
+				break;
+#endif
+			default:
+				ret = copy_chunk(sock, buf, fd, offset, len - *bytessent, &n);
+				*bytessent += n;
+				offset += n;
+				if(ret) return ret;
+				if(!n) goto eof;
+				continue;
+		}
+		if(n == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EWOULDBLOCK || errno == EAGAIN)
+				return rocksock_seterror(sock, RS_ET_OWN, RS_E_HIT_WRITETIMEOUT, ROCKSOCK_FILENAME, __LINE__);
+			return rocksock_seterror(sock, RS_ET_SYS, errno, ROCKSOCK_FILENAME, __LINE__);
+		}
+		if(!n) break;
+		*bytessent += n;
+	}
+eof:
+	return rocksock_seterror(sock, RS_ET_OWN, 0, NULL, 0);
+}
@@ -2,6 +2,81 @@
    provided so examples/user programs don't need to put ifdefs around their
    usage. */
 #ifndef USE_SSL
+#include "rocksock.h"
+
 void rocksock_init_ssl(void) {}
 void rocksock_free_ssl(void) {}
+int rocksock_sslctx_init(rs_sslContext* c, const char* ciphers, const char* cafile, const char* capath) {
+	(void) c; (void) ciphers; (void) cafile; (void) capath;
+	return RS_E_NO_SSL;
+}
+void rocksock_sslctx_release(rs_sslContext* c) { (void) c; }
+#else
+
+/* shared, reference counted client contexts. the backends only know how
+   to create and free them. */
+
+#include <pthread.h>
+#include "rocksock_ssl_internal.h"
+
+static rs_sslContext default_ctx;
+/* whether init holds a reference on default_ctx, free drops it */
+static int default_held;
+static pthread_mutex_t default_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long next_gen;
+
+int rocksock_sslctx_init(rs_sslContext* c, const char* ciphers, const char* cafile, const char* capath) {
+	if(!c) return RS_E_NULL;
+	c->ctx = rocksock_ssl_ctx_new(ciphers, cafile, capath);
+	if(!c->ctx) return RS_E_SSL_GENERIC;
+	c->gen = __sync_add_and_fetch(&next_gen, 1);
+	__atomic_store_n(&c->refs, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void rocksock_sslctx_release(rs_sslContext* c) {
+	if(c->ctx && !__sync_sub_and_fetch(&c->refs, 1)) {
+		rocksock_sslcache_drop(c->gen);
+		rocksock_ssl_ctx_free(c->ctx);
+		c->ctx = 0;
+	}
+}
+
+/* (re)creates the default context after a free, unless connections
+   from before still use it */
+void rocksock_ssl_default_init(void) {
+	pthread_mutex_lock(&default_lock);
+	if(!default_held) {
+		if(default_ctx.ctx) __sync_add_and_fetch(&default_ctx.refs, 1);
+		else rocksock_sslctx_init(&default_ctx, 0, 0, 0);
+		default_held = default_ctx.ctx != 0;
+	}
+	pthread_mutex_unlock(&default_lock);
+}
+
+void rocksock_ssl_default_free(void) {
+	pthread_mutex_lock(&default_lock);
+	if(default_held) rocksock_sslctx_release(&default_ctx);
+	default_held = 0;
+	pthread_mutex_unlock(&default_lock);
+}
+
+/* takes a reference unless the last one is already gone, in which case
+   the context is being freed */
+static int ref_get(rs_sslContext* c) {
+	int refs = __atomic_load_n(&c->refs, __ATOMIC_ACQUIRE);
+	while(refs > 0)
+		if(__atomic_compare_exchange_n(&c->refs, &refs, refs + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			return 1;
+	return 0;
+}
+
+rs_sslContext* rocksock_ssl_acquire(rocksock* sock) {
+	rs_sslContext *c = sock->sslcontext;
+	if(!c) {
+		rocksock_ssl_default_init();
+		c = &default_ctx;
+	}
+	return ref_get(c) ? c : 0;
+}
 #endif
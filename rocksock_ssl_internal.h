@@ -1,15 +1,51 @@
 #ifndef ROCKSOCK_SSL_PRIVATE_H
 #define ROCKSOCK_SSL_PRIVATE_H
 
+#include <sys/types.h>
 #include "rocksock.h"
 
 const char* rocksock_ssl_strerror(rocksock *sock, int error);
+/* backend part of rs_sslContext, returns NULL on failure */
+void* rocksock_ssl_ctx_new(const char* ciphers, const char* cafile, const char* capath);
+void rocksock_ssl_ctx_free(void* ctx);
+/* creates the default context, if it doesn't exist yet */
+void rocksock_ssl_default_init(void);
+void rocksock_ssl_default_free(void);
+/* takes a reference to the context sock is going to use,
+   to be dropped with rocksock_sslctx_release. */
+rs_sslContext* rocksock_ssl_acquire(rocksock* sock);
+/* session resumption. get_session returns a reference to the resumable
+   session of the connection or NULL. */
+void* rocksock_ssl_get_session(rocksock* sock);
+void rocksock_ssl_set_session(rocksock* sock, void* session);
+void rocksock_ssl_session_free(void* session);
+int rocksock_ssl_session_reused(rocksock* sock);
+/* the session cache, see rocksock_sslcache_use: get offers a cached
+   session to a new connection, count records whether the finished
+   handshake resumed it, put stores the session before it's freed. */
+void rocksock_sslcache_get(rocksock* sock);
+void rocksock_sslcache_count(rocksock* sock);
+void rocksock_sslcache_put(rocksock* sock);
+/* frees the cached sessions of the context with generation gen */
+void rocksock_sslcache_drop(unsigned long gen);
 int rocksock_ssl_send(rocksock* sock, char* buf, size_t sz);
 int rocksock_ssl_recv(rocksock* sock, char* buf, size_t sz);
+/* sends close_notify without waiting for the peer's, reading is still
+   possible afterwards. returns 0, or -1 with errno set like send does;
+   errno 0 means an ssl error. */
+int rocksock_ssl_shutdown(rocksock* sock);
+/* sets up the ssl object on sock->socket, the handshake is done by
+   rocksock_ssl_connect_step, which returns 0 and sets *want to
+   RS_WANT_NONE once it's complete. */
 int rocksock_ssl_connect_fd(rocksock* sock);
+int rocksock_ssl_connect_step(rocksock* sock, int* want);
 void rocksock_ssl_free_context(rocksock *sock);
 int rocksock_ssl_peek(rocksock* sock, int *result);
 int rocksock_ssl_pending(rocksock *sock);
+/* whether the session keys were handed to the kernel (ktls), so that
+   rocksock_ssl_sendfile can be used. */
+int rocksock_ssl_ktls_send(rocksock *sock);
+ssize_t rocksock_ssl_sendfile(rocksock* sock, int fd, off_t offset, size_t sz);
 
 /* if you want cyassl, put both -DUSE_SSL and -DUSE_CYASSL
    in your CFLAGS */
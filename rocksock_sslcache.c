@@ -0,0 +1,151 @@
+/*
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#undef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <pthread.h>
+
+#include "rocksock.h"
+#include "rocksock_internal.h"
+#ifdef USE_SSL
+#include "rocksock_ssl_internal.h"
+#endif
+
+//RcB: LINK "-lpthread"
+
+static rs_sslCache *sslcache;
+
+int rocksock_sslcache_init(rs_sslCache* cache, rs_sslCacheEntry* entries, size_t count) {
+	if(!cache || !entries || !count) return RS_E_NULL;
+	memset(entries, 0, count * sizeof(*entries));
+	cache->entries = entries;
+	cache->size = count;
+	cache->tick = 0;
+	cache->hits = cache->misses = 0;
+	if(pthread_mutex_init(&cache->lock, 0)) return RS_E_NULL;
+	return 0;
+}
+
+void rocksock_sslcache_use(rs_sslCache* cache) {
+	sslcache = cache;
+}
+
+void rocksock_sslcache_stats(rs_sslCache* cache, unsigned long *hits, unsigned long *misses) {
+	pthread_mutex_lock(&cache->lock);
+	if(hits) *hits = cache->hits;
+	if(misses) *misses = cache->misses;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void rocksock_sslcache_free(rs_sslCache* cache) {
+	size_t i;
+	if(sslcache == cache) sslcache = 0;
+#ifdef USE_SSL
+	for(i = 0; i < cache->size; i++)
+		if(cache->entries[i].session) rocksock_ssl_session_free(cache->entries[i].session);
+#else
+	(void) i;
+#endif
+	pthread_mutex_destroy(&cache->lock);
+}
+
+#ifdef USE_SSL
+
+static unsigned hash_target(const char* host, unsigned short port) {
+	unsigned h = 2166136261u;
+	while(*host) h = (h ^ (unsigned char) *host++) * 16777619u;
+	h = (h ^ (port & 0xff)) * 16777619u;
+	return (h ^ (port >> 8)) * 16777619u;
+}
+
+/* sessions are only resumed with the context they were made with, so that
+   one from a context that doesn't verify the peer can't skip verification
+   in another one. contexts are told apart by their generation, a new one
+   may well be at the address of a freed one. */
+static rs_sslCacheEntry* find_entry(rs_sslCache* cache, const rs_hostInfo* target, unsigned hash, unsigned long gen) {
+	size_t i;
+	for(i = 0; i < cache->size; i++) {
+		rs_sslCacheEntry *e = &cache->entries[i];
+		if(e->session && e->hash == hash && e->gen == gen && e->port == target->port &&
+		   !strcmp(e->host, target->host)) return e;
+	}
+	return 0;
+}
+
+static unsigned long ctx_gen(rocksock* sock) {
+	return ((rs_sslContext*) sock->sslctx)->gen;
+}
+
+void rocksock_sslcache_get(rocksock* sock) {
+	rs_sslCache *cache = sslcache;
+	rs_sslCacheEntry *e;
+	const rs_hostInfo *t = &sock->cs.target;
+	if(!cache) return;
+	pthread_mutex_lock(&cache->lock);
+	e = find_entry(cache, t, hash_target(t->host, t->port), ctx_gen(sock));
+	if(e) {
+		e->lastused = ++cache->tick;
+		rocksock_ssl_set_session(sock, e->session);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void rocksock_sslcache_count(rocksock* sock) {
+	rs_sslCache *cache = sslcache;
+	int reused;
+	if(!cache) return;
+	reused = rocksock_ssl_session_reused(sock);
+	pthread_mutex_lock(&cache->lock);
+	if(reused) cache->hits++;
+	else cache->misses++;
+	pthread_mutex_unlock(&cache->lock);
+}
+
+void rocksock_sslcache_put(rocksock* sock) {
+	rs_sslCache *cache = sslcache;
+	rs_sslCacheEntry *e;
+	const rs_hostInfo *t = &sock->cs.target;
+	void *old = 0, *session;
+	unsigned hash;
+	size_t i;
+	if(!cache || !(session = rocksock_ssl_get_session(sock))) return;
+	hash = hash_target(t->host, t->port);
+	pthread_mutex_lock(&cache->lock);
+	if(!(e = find_entry(cache, t, hash, ctx_gen(sock)))) {
+		e = &cache->entries[0];
+		for(i = 1; i < cache->size && e->session; i++)
+			if(cache->entries[i].lastused < e->lastused) e = &cache->entries[i];
+		memcpy(e->host, t->host, strlen(t->host) + 1);
+		e->port = t->port;
+		e->hash = hash;
+		e->gen = ctx_gen(sock);
+	}
+	old = e->session;
+	e->session = session;
+	e->lastused = ++cache->tick;
+	pthread_mutex_unlock(&cache->lock);
+	if(old) rocksock_ssl_session_free(old);
+}
+
+void rocksock_sslcache_drop(unsigned long gen) {
+	rs_sslCache *cache = sslcache;
+	size_t i;
+	if(!cache) return;
+	pthread_mutex_lock(&cache->lock);
+	for(i = 0; i < cache->size; i++) {
+		rs_sslCacheEntry *e = &cache->entries[i];
+		if(e->session && e->gen == gen) {
+			rocksock_ssl_session_free(e->session);
+			e->session = 0;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+#endif
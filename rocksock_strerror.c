@@ -13,7 +13,7 @@ static const char rs_errorMap[][3] = {
 	"0" , "1" , "2" , "3" , "4" , "5" , "6" , "7",
 	"8" , "9" , "10", "11", "12", "13", "14", "15",
 	"16", "17", "18", "19", "20", "21", "22", "23",
-	"24", "25", "26", "27"
+	"24", "25", "26", "27", "28", "29", "30"
 };
 
 #else
@@ -74,7 +74,13 @@ static const char* rs_errorMap[] = {
 	//RS_E_HOSTNAME_TOO_LONG = 26,
 	"hostname exceeds 255 chars",
 	//RS_E_INVALID_PROXY_URL = 27,
-	"invalid proxy URL string"
+	"invalid proxy URL string",
+	//RS_E_DNS_NOT_FOUND = 28,
+	"dns: host not found",
+	//RS_E_DNS_FAILURE = 29,
+	"dns: server failure or malformed response",
+	//RS_E_EARLY_DATA_SSL = 30,
+	"early data can't be sent over ssl"
 };
 
 #endif
@@ -7,6 +7,9 @@
  *
  */
 
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
 #include <string.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -18,6 +21,11 @@
 #include <errno.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 
 #include "rocksockserver.h"
 
@@ -74,6 +82,16 @@ int rocksockserver_resolve_host(rs_hostInfo* hostinfo) {
 #endif
 }
 
+static int set_reuseport(int fd) {
+#ifdef SO_REUSEPORT
+	int yes = 1;
+	return setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int));
+#else
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
+
 /* returns 0 on success.
    possible error return codes:
    -1: erroneus parameter
@@ -82,7 +100,7 @@ int rocksockserver_resolve_host(rs_hostInfo* hostinfo) {
    -4: listen() failed
    positive number: dns error, pass to gai_strerror()
 */
-int rocksockserver_init(rocksockserver* srv, const char* listenip, unsigned short port, void* userdata) {
+static int init_listener(rocksockserver* srv, const char* listenip, unsigned short port, void* userdata, int reuseport) {
 	int ret = 0;
 	int yes = 1;
 	rs_hostInfo conn;
@@ -90,6 +108,27 @@ int rocksockserver_init(rocksockserver* srv, const char* listenip, unsigned shor
 	conn.host = listenip;
 	conn.port = port;
 	FD_ZERO(&srv->master);
+	FD_ZERO(&srv->wantwrite);
+	FD_ZERO(&srv->wantread);
+	srv->wantwrite_default = 1;
+	srv->signalfd = -1;
+	srv->perr = NULL;
+	srv->epfd = -1;
+	srv->events = NULL;
+	srv->nevents = 0;
+	srv->worker = 0;
+	srv->queues = NULL;
+	srv->nqueues = 0;
+	srv->freechunks = NULL;
+	srv->nfree = srv->chunksize = 0;
+	srv->high_watermark = srv->low_watermark = 0;
+	srv->on_drain = NULL;
+	srv->accept_max = 64;
+#ifdef SOCK_CLOEXEC
+	srv->accept_flags = SOCK_CLOEXEC;
+#else
+	srv->accept_flags = 0;
+#endif
 	srv->userdata = userdata;
 	srv->sleeptime_us = 20000; // set a reasonable default value. it's a compromise between throughput and cpu usage basically.
 	ret = rocksockserver_resolve_host(&conn);
@@ -105,7 +144,8 @@ int rocksockserver_init(rocksockserver* srv, const char* listenip, unsigned shor
 		// lose the pesky "address already in use" error message
 		setsockopt(srv->listensocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
 
-		if (bind(srv->listensocket, p->ai_addr, p->ai_addrlen) < 0) {
+		if ((reuseport && set_reuseport(srv->listensocket)) ||
+		    bind(srv->listensocket, p->ai_addr, p->ai_addrlen) < 0) {
 			close(srv->listensocket);
 			continue;
 		}
@@ -125,7 +165,8 @@ int rocksockserver_init(rocksockserver* srv, const char* listenip, unsigned shor
 		return -3;
 	}
 	setsockopt(srv->listensocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(int));
-	if(bind(srv->listensocket, (struct sockaddr*) &conn.hostaddr, sizeof(struct sockaddr_in)) < 0) {
+	if((reuseport && set_reuseport(srv->listensocket)) ||
+	   bind(srv->listensocket, (struct sockaddr*) &conn.hostaddr, sizeof(struct sockaddr_in)) < 0) {
 		close(srv->listensocket);
 		LOGP("bind");
 		return -2;
@@ -137,17 +178,89 @@ int rocksockserver_init(rocksockserver* srv, const char* listenip, unsigned shor
 		LOGP("listen");
 		ret = -4;
 	} else {
+		// so accept_client can take all pending connections
+		fcntl(srv->listensocket, F_SETFL, fcntl(srv->listensocket, F_GETFL) | O_NONBLOCK);
 		FD_SET(srv->listensocket, &srv->master);
+		FD_SET(srv->listensocket, &srv->wantread);
 		srv->maxfd = srv->listensocket;
 	}
 	return ret;
 }
 
+int rocksockserver_init(rocksockserver* srv, const char* listenip, unsigned short port, void* userdata) {
+	return init_listener(srv, listenip, port, userdata, 0);
+}
+
+int rocksockserver_init_reuseport(rocksockserver* srv, const char* listenip, unsigned short port, void* userdata) {
+	return init_listener(srv, listenip, port, userdata, 1);
+}
+
+#ifdef __linux__
+/* drops the events of fd from the batch being handled, since the fd
+   may be reused by an accept later in the same batch */
+static void forget_events(rocksockserver* srv, int fd) {
+	int i;
+	for(i = 0; i < srv->nevents; i++)
+		if(srv->events[i].data.fd == fd) srv->events[i].data.fd = -1;
+}
+#endif
+
+static rs_outQueue* queue_of(rocksockserver* srv, int fd) {
+	return fd >= 0 && (size_t) fd < srv->nqueues ? &srv->queues[fd] : NULL;
+}
+
+// polls fd for what its queue state asks for
+static void update_interest(rocksockserver* srv, int fd, rs_outQueue* q) {
+	int rd = !q->paused, wr = q->wantwrite || q->head;
+#ifdef __linux__
+	if(srv->epfd != -1) {
+		struct epoll_event ev = {.events = (rd ? EPOLLIN : 0) | (wr ? EPOLLOUT : 0), .data.fd = fd};
+		epoll_ctl(srv->epfd, EPOLL_CTL_MOD, fd, &ev);
+		return;
+	}
+#endif
+	if(fd >= USER_MAX_FD || !FD_ISSET(fd, &srv->master)) return;
+	if(rd) FD_SET(fd, &srv->wantread);
+	else FD_CLR(fd, &srv->wantread);
+	if(wr) FD_SET(fd, &srv->wantwrite);
+	else FD_CLR(fd, &srv->wantwrite);
+}
+
+// gives the chunks of fd back to the pool
+static void reset_queue(rocksockserver* srv, int fd) {
+	rs_outQueue* q = queue_of(srv, fd);
+	rs_outChunk* c;
+	if(!q) return;
+	while((c = q->head)) {
+		q->head = c->next;
+		c->next = srv->freechunks;
+		srv->freechunks = c;
+		srv->nfree++;
+	}
+	q->tail = NULL;
+	q->bytes = 0;
+	q->paused = 0;
+	q->wantwrite = srv->wantwrite_default;
+}
+
 int rocksockserver_disconnect_client(rocksockserver* srv, int client) {
+#ifdef __linux__
+	if(srv->epfd != -1) {
+		if(client < 0) return -1;
+		if(epoll_ctl(srv->epfd, EPOLL_CTL_DEL, client, NULL)) return 1;
+		forget_events(srv, client);
+		reset_queue(srv, client);
+		close(client);
+		return 0;
+	}
+#endif
 	if(client < 0 || client > USER_MAX_FD) return -1;
 	if(FD_ISSET(client, &srv->master)) {
 		close(client);
+		reset_queue(srv, client);
 		FD_CLR(client, &srv->master);
+		FD_CLR(client, &srv->wantwrite);
+		FD_CLR(client, &srv->wantread);
 		if(client == srv->maxfd)
 			srv->maxfd--;
 		srv->numfds--;
@@ -157,11 +270,293 @@ int rocksockserver_disconnect_client(rocksockserver* srv, int client) {
 }
 
 void rocksockserver_watch_fd(rocksockserver* srv, int newfd) {
+	reset_queue(srv, newfd);
+#ifdef __linux__
+	if(srv->epfd != -1) {
+		struct epoll_event ev = {.events = EPOLLIN, .data.fd = newfd};
+		if(srv->wantwrite_default) ev.events |= EPOLLOUT;
+		epoll_ctl(srv->epfd, EPOLL_CTL_ADD, newfd, &ev);
+		return;
+	}
+#endif
 	FD_SET(newfd, &srv->master);
+	FD_SET(newfd, &srv->wantread);
+	if(srv->wantwrite_default) FD_SET(newfd, &srv->wantwrite);
 	if (newfd > srv->maxfd)
 		srv->maxfd = newfd;
 }
 
+void rocksockserver_unwatch_fd(rocksockserver* srv, int fd) {
+#ifdef __linux__
+	if(srv->epfd != -1) {
+		if(!epoll_ctl(srv->epfd, EPOLL_CTL_DEL, fd, NULL)) forget_events(srv, fd);
+		reset_queue(srv, fd);
+		return;
+	}
+#endif
+	if(fd < 0 || fd >= USER_MAX_FD) return;
+	reset_queue(srv, fd);
+	FD_CLR(fd, &srv->master);
+	FD_CLR(fd, &srv->wantwrite);
+	FD_CLR(fd, &srv->wantread);
+	while(srv->maxfd > srv->listensocket && !FD_ISSET(srv->maxfd, &srv->master))
+		srv->maxfd--;
+}
+
+void rocksockserver_want_write(rocksockserver* srv, int fd, int on) {
+	rs_outQueue* q;
+	if(fd == -1) {
+		srv->wantwrite_default = on;
+		return;
+	}
+	if((q = queue_of(srv, fd))) {
+		q->wantwrite = on;
+		update_interest(srv, fd, q);
+		return;
+	}
+#ifdef __linux__
+	if(srv->epfd != -1) {
+		struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+		if(on) ev.events |= EPOLLOUT;
+		epoll_ctl(srv->epfd, EPOLL_CTL_MOD, fd, &ev);
+		return;
+	}
+#endif
+	if(fd < 0 || fd >= USER_MAX_FD || !FD_ISSET(fd, &srv->master)) return;
+	if(on) FD_SET(fd, &srv->wantwrite);
+	else FD_CLR(fd, &srv->wantwrite);
+}
+
+size_t rocksockserver_pending(rocksockserver* srv, int fd) {
+	rs_outQueue* q = queue_of(srv, fd);
+	return q ? q->bytes : 0;
+}
+
+#define CHUNK_DATA(c) ((char*) ((c) + 1))
+#define FLUSH_IOV 64
+
+// writes out as much of the queue as the socket takes. returns -1 on error
+static int flush_queue(rocksockserver* srv, int fd, rs_outQueue* q) {
+	struct iovec iov[FLUSH_IOV];
+	struct msghdr msg = {.msg_iov = iov};
+	rs_outChunk* c;
+	ssize_t n;
+	size_t total, done;
+	while(q->head) {
+		total = 0;
+		for(msg.msg_iovlen = 0, c = q->head; c && msg.msg_iovlen < FLUSH_IOV; c = c->next) {
+			iov[msg.msg_iovlen].iov_base = CHUNK_DATA(c) + c->pos;
+			iov[msg.msg_iovlen++].iov_len = c->len - c->pos;
+			total += c->len - c->pos;
+		}
+		if((n = sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1) {
+			if(errno == EINTR) continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK) break;
+			return -1;
+		}
+		q->bytes -= n;
+		for(done = n; done; ) {
+			c = q->head;
+			if(done < c->len - c->pos) {
+				c->pos += done;
+				break;
+			}
+			done -= c->len - c->pos;
+			q->head = c->next;
+			c->next = srv->freechunks;
+			srv->freechunks = c;
+			srv->nfree++;
+		}
+		// the socket buffer is full
+		if((size_t) n < total) break;
+	}
+	if(!q->head) q->tail = NULL;
+	return 0;
+}
+
+int rocksockserver_send(rocksockserver* srv, int fd, const void* buf, size_t len) {
+	rs_outQueue* q = queue_of(srv, fd);
+	const char* p = buf;
+	rs_outChunk* c;
+	size_t room, n, need;
+	ssize_t sent;
+	int was_empty;
+	// all of buf must fit into the queue before any of it goes out, so
+	// that a failure leaves nothing half sent
+	if(!q) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	room = q->tail ? srv->chunksize - q->tail->len : 0;
+	need = len > room ? (len - room + srv->chunksize - 1) / srv->chunksize : 0;
+	if(need > srv->nfree) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	if((was_empty = !q->head)) {
+		// nothing queued, the socket may take it all
+		while((sent = send(fd, p, len, MSG_NOSIGNAL | MSG_DONTWAIT)) == -1 && errno == EINTR);
+		if(sent == -1) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+			sent = 0;
+		}
+		p += sent;
+		len -= sent;
+		if(!len) return 0;
+	}
+	while(len) {
+		if(!q->tail || q->tail->len == srv->chunksize) {
+			c = srv->freechunks;
+			srv->freechunks = c->next;
+			srv->nfree--;
+			c->next = NULL;
+			c->len = c->pos = 0;
+			if(q->tail) q->tail->next = c;
+			else q->head = c;
+			q->tail = c;
+		}
+		c = q->tail;
+		n = srv->chunksize - c->len;
+		if(n > len) n = len;
+		memcpy(CHUNK_DATA(c) + c->len, p, n);
+		c->len += n;
+		p += n;
+		len -= n;
+		q->bytes += n;
+	}
+	if(srv->high_watermark && !q->paused && q->bytes >= srv->high_watermark) {
+		q->paused = 1;
+		update_interest(srv, fd, q);
+	} else if(was_empty)
+		update_interest(srv, fd, q);
+	return 0;
+}
+
+static int accept_one(rocksockserver* srv, struct sockaddr_storage* remoteaddr) {
+	socklen_t addrlen = sizeof(*remoteaddr);
+	int fd;
+#ifdef SOCK_CLOEXEC
+	fd = accept4(srv->listensocket, (struct sockaddr *)remoteaddr, &addrlen, srv->accept_flags);
+#else
+	fd = accept(srv->listensocket, (struct sockaddr *)remoteaddr, &addrlen);
+	if(fd != -1 && (srv->accept_flags & SOCK_NONBLOCK))
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#endif
+	return fd;
+}
+
+// takes up to accept_max pending connections
+static void accept_client(rocksockserver* srv,
+			int (*on_clientconnect) (void* userdata, struct sockaddr_storage* clientaddr, int fd)
+) {
+	struct sockaddr_storage remoteaddr; // client address
+	int newfd, i;
+
+	for(i = 0; i < srv->accept_max; i++) {
+		if((newfd = accept_one(srv, &remoteaddr)) == -1) {
+			if(errno == EINTR || errno == ECONNABORTED) continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK) LOGP("accept");
+			break;
+		}
+		if(srv->epfd == -1 && newfd >= USER_MAX_FD) {
+			close(newfd); // only USER_MAX_FD connections can be handled.
+			continue;
+		}
+		rocksockserver_watch_fd(srv, newfd);
+		if(on_clientconnect) on_clientconnect(srv->userdata, &remoteaddr, newfd);
+	}
+}
+
+// flushes the queue of k first, on_clientwantsdata only gets called
+// when there's nothing queued
+static void write_client(rocksockserver* srv, int k,
+			int (*on_clientwantsdata) (void* userdata, int fd)
+) {
+	rs_outQueue* q = queue_of(srv, k);
+	if(q && q->head) {
+		if(flush_queue(srv, k, q)) {
+			LOGP("send");
+			rocksockserver_disconnect_client(srv, k);
+			return;
+		}
+		if(q->paused && q->bytes <= srv->low_watermark) q->paused = 0;
+		else if(q->head) return;
+		update_interest(srv, k, q);
+		if(!q->head && srv->on_drain) srv->on_drain(srv->userdata, k);
+		return;
+	}
+	if(on_clientwantsdata) on_clientwantsdata(srv->userdata, k);
+}
+
+static void read_client(rocksockserver* srv, int k,
+			char* buf, size_t bufsize,
+			int (*on_clientread) (void* userdata, int fd, size_t nread),
+			int (*on_clientdisconnect) (void* userdata, int fd)
+) {
+	ptrdiff_t nbytes;
+	if(buf && k != srv->signalfd) {
+		if ((nbytes = recv(k, buf, bufsize, 0)) <= 0) {
+			if (nbytes == 0) {
+				if(on_clientdisconnect) on_clientdisconnect(srv->userdata, k);
+			} else {
+				LOGP("recv");
+			}
+			rocksockserver_disconnect_client(srv, k);
+		} else {
+			if(on_clientread) on_clientread(srv->userdata, k, nbytes);
+		}
+	} else {
+
+		if(on_clientread) on_clientread(srv->userdata, k, 0);
+	}
+}
+
+#ifdef __linux__
+#define EPOLL_BATCH 256
+
+static int epoll_loop(rocksockserver* srv,
+			char* buf, size_t bufsize,
+			int (*on_clientconnect) (void* userdata, struct sockaddr_storage* clientaddr, int fd),
+			int (*on_clientread) (void* userdata, int fd, size_t nread),
+			int (*on_clientwantsdata) (void* userdata, int fd),
+			int (*on_clientdisconnect) (void* userdata, int fd)
+) {
+	struct epoll_event events[EPOLL_BATCH];
+	int i, n, k;
+
+	srv->events = events;
+	for(;;) {
+		srv->nevents = 0;
+		if((n = epoll_wait(srv->epfd, events, EPOLL_BATCH, -1)) == -1) {
+			if(errno != EINTR) {
+				LOGP("epoll_wait");
+				/* nevents is 0 already, events is gone once we return */
+				srv->events = NULL;
+				return 1;
+			}
+			continue;
+		}
+		srv->nevents = n;
+		for(i = 0; i < n; i++) {
+			if((k = events[i].data.fd) == -1) continue;
+			if(k == srv->listensocket) {
+				accept_client(srv, on_clientconnect);
+				continue;
+			}
+			if(events[i].events & EPOLLOUT) {
+				write_client(srv, k, on_clientwantsdata);
+				/* disconnected by the callback */
+				if(events[i].data.fd == -1) continue;
+			}
+			if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				read_client(srv, k, buf, bufsize, on_clientread, on_clientdisconnect);
+		}
+		if(srv->wantwrite_default) microsleep(srv->sleeptime_us);
+	}
+	return 0;
+}
+#endif
+
 int rocksockserver_loop(rocksockserver* srv,
 			char* buf, size_t bufsize,
 			int (*on_clientconnect) (void* userdata, struct sockaddr_storage* clientaddr, int fd),
@@ -170,22 +565,23 @@ int rocksockserver_loop(rocksockserver* srv,
 			int (*on_clientdisconnect) (void* userdata, int fd)
 ) {
 	fd_set read_fds, write_fds;
-	int newfd, k;
+	int k;
 	int lastfd = 3;
 #ifdef IS_LITTLE_ENDIAN
 	int i;
 	size_t j;
 #endif
-	ptrdiff_t nbytes;
-	struct sockaddr_storage remoteaddr; // client address
-	socklen_t addrlen;
 	char* fdptr;
 	fd_set* setptr;
 
+#ifdef __linux__
+	if(srv->epfd != -1)
+		return epoll_loop(srv, buf, bufsize, on_clientconnect, on_clientread, on_clientwantsdata, on_clientdisconnect);
+#endif
 	for(;;) {
 
-		read_fds = srv->master;
-		write_fds = srv->master;
+		read_fds = srv->wantread;
+		write_fds = srv->wantwrite;
 
 		if ((srv->numfds = select(srv->maxfd+1, &read_fds, &write_fds, NULL, NULL)) && srv->numfds == -1)
 			LOGP("select");
@@ -249,49 +645,21 @@ int rocksockserver_loop(rocksockserver* srv,
 		//printf("read_fd %d\n", k);
 		if (k == srv->listensocket) {
 			// new connection available
-			addrlen = sizeof(remoteaddr);
-			newfd = accept(srv->listensocket, (struct sockaddr *)&remoteaddr, &addrlen);
-
-			if (newfd == -1) {
-				LOGP("accept");
-			} else {
-				if(newfd >= USER_MAX_FD)
-					close(newfd); // only USER_MAX_FD connections can be handled.
-				else {
-					FD_SET(newfd, &srv->master);
-					if (newfd > srv->maxfd)
-						srv->maxfd = newfd;
-					if(on_clientconnect) on_clientconnect(srv->userdata, &remoteaddr, newfd);
-				}
-			}
-		} else {
-			if(buf && k != srv->signalfd) {
-				if ((nbytes = recv(k, buf, bufsize, 0)) <= 0) {
-					if (nbytes == 0) {
-						if(on_clientdisconnect) on_clientdisconnect(srv->userdata, k);
-					} else {
-						LOGP("recv");
-					}
-					rocksockserver_disconnect_client(srv, k);
-				} else {
-					if(on_clientread) on_clientread(srv->userdata, k, nbytes);
-				}
-			} else {
-
-				if(on_clientread) on_clientread(srv->userdata, k, 0);
-			}
-		}
+			accept_client(srv, on_clientconnect);
+		// not if the write handler disconnected or paused it
+		} else if(FD_ISSET(k, &srv->wantread))
+			read_client(srv, k, buf, bufsize, on_clientread, on_clientdisconnect);
 		goto zzz;
 
 		handlewrite:
 
 		//printf("write_fd %d\n", k);
-		if(on_clientwantsdata) on_clientwantsdata(srv->userdata, k);
+		write_client(srv, k, on_clientwantsdata);
 
 		zzz:
 		if(srv->numfds > 0) goto nextfd;
 		lastfd = k;
-		microsleep(srv->sleeptime_us);
+		if(srv->wantwrite_default) microsleep(srv->sleeptime_us);
 	}
 	return 0;
 }
@@ -12,17 +12,50 @@
 #define _ROCKSOCKSERVER_H_
 
 #include <netdb.h>
+#include <pthread.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/select.h>
 
+/* rocksockserver_set_accept takes SOCK_NONBLOCK, also without accept4 */
+#ifndef SOCK_NONBLOCK
+#define SOCK_NONBLOCK O_NONBLOCK
+#endif
+
 #if (! defined(USER_MAX_FD)) || (USER_MAX_FD > FD_SETSIZE)
 #undef USER_MAX_FD
 #define USER_MAX_FD FD_SETSIZE
 #endif
 
+typedef enum {
+	RS_SB_SELECT = 0,
+	RS_SB_EPOLL,
+} rs_serverBackend;
+
+struct epoll_event;
+
+/* a buffer of the output pool, the data follows the struct */
+typedef struct rs_outChunk {
+	struct rs_outChunk* next;
+	size_t len, pos;
+} rs_outChunk;
+
+/* output queue of a client, see rocksockserver_set_outqueue */
+typedef struct {
+	rs_outChunk *head, *tail;
+	size_t bytes;
+	/* reading stopped at the high watermark, write interest of the user */
+	int paused, wantwrite;
+} rs_outQueue;
+
 typedef void (*perror_func)(const char*);
 typedef struct {
 	fd_set master;
+	/* fds polled for writability, and whether new fds start out in it */
+	fd_set wantwrite;
+	int wantwrite_default;
+	/* fds polled for readability, all but the paused ones */
+	fd_set wantread;
 	int listensocket;
 	int maxfd;
 	int numfds;
@@ -30,14 +63,119 @@ typedef struct {
 	void* userdata;
 	long sleeptime_us;
 	perror_func perr;
+	/* epoll backend: -1 if unused, and the batch of events being handled */
+	int epfd;
+	struct epoll_event* events;
+	int nevents;
+	/* index of the shard this server is, 0 otherwise */
+	int worker;
+	/* connections accepted per round at most, and the accept4 flags */
+	int accept_max;
+	int accept_flags;
+	/* output queues indexed by fd, the free chunks of the pool */
+	rs_outQueue* queues;
+	size_t nqueues;
+	rs_outChunk* freechunks;
+	size_t nfree, chunksize;
+	size_t high_watermark, low_watermark;
+	int (*on_drain) (void* userdata, int fd);
 } rocksockserver;
 
+typedef int (*rs_onClientConnect) (void* userdata, struct sockaddr_storage* clientaddr, int fd);
+typedef int (*rs_onClientRead) (void* userdata, int fd, size_t nread);
+typedef int (*rs_onClientWantsData) (void* userdata, int fd);
+typedef int (*rs_onClientDisconnect) (void* userdata, int fd);
+
+/* one worker of a sharded server, see rocksockserver_shards_init */
+typedef struct {
+	rocksockserver srv;
+	pthread_t thread;
+	/* cpu the worker is pinned to, or -1 */
+	int cpu;
+	char* buf;
+	size_t bufsize;
+	rs_onClientConnect on_clientconnect;
+	rs_onClientRead on_clientread;
+	rs_onClientWantsData on_clientwantsdata;
+	rs_onClientDisconnect on_clientdisconnect;
+	int ret;
+	/* lets the thread start its loop, or not */
+	void* gate;
+} rs_serverShard;
+
+typedef enum {
+	/* pin worker i to the i-th cpu the process may run on */
+	RS_SF_PIN = 1 << 0,
+	/* hand connections to the worker on the cpu that received them:
+	   SO_INCOMING_CPU on each listener, and a classic bpf program on the
+	   SO_REUSEPORT group mapping the cpu of worker i (the one it's pinned
+	   to, or the i-th cpu of the process) to its listener, other cpus to
+	   listener (cpu % n). works best with RS_SF_PIN and one worker per
+	   cpu; workers past the number of cpus get no connections. */
+	RS_SF_STEER = 1 << 1,
+} rs_shardFlags;
+
 void rocksockserver_set_sleeptime(rocksockserver* srv, long microsecs);
 int rocksockserver_disconnect_client(rocksockserver* srv, int client);
 int rocksockserver_init(rocksockserver* srv, const char* listenip, unsigned short port, void* userdata);
+/* like rocksockserver_init, with SO_REUSEPORT set on the listen socket,
+   so several servers (threads or processes) can listen on the same port
+   and the kernel spreads the connections among them. */
+int rocksockserver_init_reuseport(rocksockserver* srv, const char* listenip, unsigned short port, void* userdata);
 void rocksockserver_watch_fd(rocksockserver* srv, int newfd);
+/* stops watching fd without closing it, e.g. a socket owned by a rocksock */
+void rocksockserver_unwatch_fd(rocksockserver* srv, int fd);
+/* on_clientwantsdata is called for fds with write interest only. new fds
+   get it by default, and as every connected socket is writable nearly all
+   of the time, the loop sleeps sleeptime_us after each round to not spin.
+   turning it on only while output is pending lets the loop block until
+   something happens instead, fd -1 changes the default for fds watched
+   from then on. once the default is off, the loop never sleeps.
+   an fd turned off can still get a call from the round in progress. */
+void rocksockserver_want_write(rocksockserver* srv, int fd, int on);
+/* listen backlog of the server socket, 10 after init. returns 0 or -1 */
+int rocksockserver_set_backlog(rocksockserver* srv, int backlog);
+/* the loop accepts pending connections until there are none left or max
+   (64 after init) have been taken, whatever comes first. flags are passed
+   to accept4, the default is SOCK_CLOEXEC; SOCK_NONBLOCK hands out client
+   fds in non-blocking mode. */
+void rocksockserver_set_accept(rocksockserver* srv, int max, int flags);
+/* TCP_DEFER_ACCEPT: connections are only reported once the client sent
+   something, or they're dropped after about that many seconds. only for
+   protocols where the client speaks first. returns 0 or -1 */
+int rocksockserver_set_defer_accept(rocksockserver* srv, int seconds);
+/* output queues for rocksockserver_send, from caller-allocated storage:
+   queues has nqueues entries, one per fd, so fds from nqueues on can't
+   queue anything. pool is carved into chunks of chunksize bytes shared by
+   all clients. call it after init and before the loop.
+   returns 0, or -1 if the pool doesn't hold a single chunk. */
+int rocksockserver_set_outqueue(rocksockserver* srv, rs_outQueue* queues, size_t nqueues,
+                                char* pool, size_t poolsize, size_t chunksize);
+/* when a client has high or more bytes queued, the loop stops reading from
+   it until the queue went down to low. high 0 (the default) never stops. */
+void rocksockserver_set_watermarks(rocksockserver* srv, size_t high, size_t low);
+/* called when the queue of fd went empty */
+void rocksockserver_set_drainfunc(rocksockserver* srv, int (*on_drain) (void* userdata, int fd));
+/* sends what the socket takes right away and queues the rest, which the
+   loop writes out (several chunks per sendmsg) as the socket becomes
+   writable, ahead of on_clientwantsdata. data is only queued behind data
+   already queued, so the order is kept. returns 0, or -1 with errno set:
+   ENOBUFS if fd has no queue or len doesn't fit into the free chunks,
+   in which case nothing was sent, or the error of send, after which the
+   client should be disconnected. */
+int rocksockserver_send(rocksockserver* srv, int fd, const void* buf, size_t len);
+/* bytes queued for fd */
+size_t rocksockserver_pending(rocksockserver* srv, int fd);
 void rocksockserver_set_signalfd(rocksockserver* srv, int signalfd);
 void rocksockserver_set_perrorfunc(rocksockserver* srv, perror_func perr);
+/* picks the readiness mechanism of rocksockserver_loop, call it after init
+   and before the loop. RS_SB_SELECT (the default) handles fds below
+   USER_MAX_FD only. RS_SB_EPOLL (linux) has no limit besides RLIMIT_NOFILE,
+   and its cost grows with the number of ready fds rather than the highest
+   fd; with it, client fds can be USER_MAX_FD or above.
+   returns the backend in use, which is RS_SB_SELECT if epoll isn't
+   available. */
+rs_serverBackend rocksockserver_set_backend(rocksockserver* srv, rs_serverBackend backend);
 int rocksockserver_loop(rocksockserver* srv,
 			char* buf, size_t bufsize,
 			int (*on_clientconnect) (void* userdata, struct sockaddr_storage* clientaddr, int fd), 
@@ -46,6 +184,30 @@ int rocksockserver_loop(rocksockserver* srv,
 			int (*on_clientdisconnect) (void* userdata, int fd)
 );
 
+
+/* sharded server for using more than one core: n workers, each with its
+   own SO_REUSEPORT listener and loop in its own thread, sharing nothing.
+   init takes caller-allocated storage for the n shards, userdata[i] is
+   passed to the callbacks of worker i (userdata may be NULL). as the
+   callbacks don't see the server, per-worker userdata is the place to
+   keep the worker id; it's also in shards[i].srv.worker. flags are
+   rs_shardFlags. returns 0, or the error of rocksockserver_init or -1
+   if RS_SF_STEER isn't supported, with everything closed again.
+   between init and run, the servers can be configured with the other
+   rocksockserver_ functions (backend, write interest, sleeptime).
+   run starts the threads, each calling rocksockserver_loop; worker i
+   reads into buf + i * bufsize, so buf holds n * bufsize bytes (or is
+   NULL). it returns when all loops ended, with the first non-zero return
+   value among them, or -1 if a thread couldn't be started, in which case
+   no loop was run. */
+int rocksockserver_shards_init(rs_serverShard* shards, size_t n, const char* listenip, unsigned short port,
+                               void** userdata, int flags);
+int rocksockserver_shards_run(rs_serverShard* shards, size_t n, char* buf, size_t bufsize,
+                              rs_onClientConnect on_clientconnect,
+                              rs_onClientRead on_clientread,
+                              rs_onClientWantsData on_clientwantsdata,
+                              rs_onClientDisconnect on_clientdisconnect);
+
 #endif
 
 //RcB: DEP "rocksockserver*.c"
@@ -0,0 +1,5 @@
+#include "rocksockserver.h"
+void rocksockserver_set_accept(rocksockserver* srv, int max, int flags) {
+	srv->accept_max = max > 0 ? max : 1;
+	srv->accept_flags = flags;
+}
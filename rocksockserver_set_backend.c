@@ -0,0 +1,29 @@
+#include <unistd.h>
+#include "rocksockserver.h"
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+rs_serverBackend rocksockserver_set_backend(rocksockserver* srv, rs_serverBackend backend) {
+#ifdef __linux__
+	struct epoll_event ev;
+	int fd;
+	if(backend == RS_SB_EPOLL && srv->epfd == -1) {
+		if((srv->epfd = epoll_create1(EPOLL_CLOEXEC)) == -1) return RS_SB_SELECT;
+		/* take over what's watched so far, the listen socket and the signalfd */
+		for(fd = 0; fd <= srv->maxfd; fd++) if(FD_ISSET(fd, &srv->master)) {
+			ev.events = (FD_ISSET(fd, &srv->wantread) ? EPOLLIN : 0) |
+			            (FD_ISSET(fd, &srv->wantwrite) ? EPOLLOUT : 0);
+			ev.data.fd = fd;
+			epoll_ctl(srv->epfd, EPOLL_CTL_ADD, fd, &ev);
+		}
+	} else if(backend == RS_SB_SELECT && srv->epfd != -1) {
+		close(srv->epfd);
+		srv->epfd = -1;
+	}
+	return srv->epfd == -1 ? RS_SB_SELECT : RS_SB_EPOLL;
+#else
+	(void) backend;
+	return RS_SB_SELECT;
+#endif
+}
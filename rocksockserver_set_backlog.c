@@ -0,0 +1,5 @@
+#include "rocksockserver.h"
+// listen() on a listening socket just updates the backlog
+int rocksockserver_set_backlog(rocksockserver* srv, int backlog) {
+	return listen(srv->listensocket, backlog);
+}
@@ -0,0 +1,12 @@
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "rocksockserver.h"
+int rocksockserver_set_defer_accept(rocksockserver* srv, int seconds) {
+#ifdef TCP_DEFER_ACCEPT
+	return setsockopt(srv->listensocket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds));
+#else
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
@@ -0,0 +1,4 @@
+#include "rocksockserver.h"
+void rocksockserver_set_drainfunc(rocksockserver* srv, int (*on_drain) (void* userdata, int fd)) {
+	srv->on_drain = on_drain;
+}
@@ -0,0 +1,27 @@
+#include <string.h>
+#include "rocksockserver.h"
+
+// chunks start at pointer alignment
+#define CHUNK_STRIDE(size) ((sizeof(rs_outChunk) + (size) + sizeof(void*) - 1) & ~(sizeof(void*) - 1))
+
+int rocksockserver_set_outqueue(rocksockserver* srv, rs_outQueue* queues, size_t nqueues,
+                                char* pool, size_t poolsize, size_t chunksize) {
+	size_t off, stride = CHUNK_STRIDE(chunksize), skip = -(size_t) pool & (sizeof(void*) - 1);
+	rs_outChunk* c;
+	if(!chunksize || poolsize < skip + stride) return -1;
+	pool += skip;
+	poolsize -= skip;
+	memset(queues, 0, nqueues * sizeof(*queues));
+	srv->queues = queues;
+	srv->nqueues = nqueues;
+	srv->chunksize = chunksize;
+	srv->freechunks = NULL;
+	srv->nfree = 0;
+	for(off = 0; off + stride <= poolsize; off += stride) {
+		c = (rs_outChunk*) (pool + off);
+		c->next = srv->freechunks;
+		srv->freechunks = c;
+		srv->nfree++;
+	}
+	return 0;
+}
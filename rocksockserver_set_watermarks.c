@@ -0,0 +1,5 @@
+#include "rocksockserver.h"
+void rocksockserver_set_watermarks(rocksockserver* srv, size_t high, size_t low) {
+	srv->high_watermark = high;
+	srv->low_watermark = low < high ? low : (high ? high - 1 : 0);
+}
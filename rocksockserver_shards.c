@@ -0,0 +1,164 @@
+/*
+ *
+ * author: rofl0r
+ *
+ * License: LGPL 2.1+ with static linking exception
+ *
+ *
+ */
+
+#undef _GNU_SOURCE
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
+#include "rocksockserver.h"
+
+/* the i-th cpu in the affinity mask of the process, or -1 */
+static int nth_cpu(size_t i) {
+#ifdef __linux__
+	cpu_set_t set;
+	int cpu;
+	if(sched_getaffinity(0, sizeof set, &set)) return -1;
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++)
+		if(CPU_ISSET(cpu, &set) && !i--) return cpu;
+#endif
+	return -1;
+}
+
+#ifdef __linux__
+/* shards that get a cpu of their own in the steering program, the
+   others only get connections through the fallback */
+#define STEER_MAX 256
+
+/* picks the listener of the shard on the receiving cpu, the index in
+   the reuseport group being the order the shards were initialized in.
+   cpus without a shard fall back to listener (cpu % n).
+   returns -1 if the kernel doesn't support it. */
+static int steer(rs_serverShard* shards, size_t n) {
+	struct sock_filter code[3 + 2 * STEER_MAX];
+	struct sock_fprog prog = { .filter = code };
+	size_t i, len = 0;
+	int cpu;
+	code[len++] = (struct sock_filter) { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU };
+	for(i = 0; i < n; i++) {
+		cpu = shards[i].cpu != -1 ? shards[i].cpu : nth_cpu(i);
+		if(cpu == -1) continue;
+#ifdef SO_INCOMING_CPU
+		if(setsockopt(shards[i].srv.listensocket, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof cpu)) return -1;
+#endif
+		if(i >= STEER_MAX) continue;
+		code[len++] = (struct sock_filter) { BPF_JMP | BPF_JEQ | BPF_K, 0, 1, cpu };
+		code[len++] = (struct sock_filter) { BPF_RET | BPF_K, 0, 0, i };
+	}
+	code[len++] = (struct sock_filter) { BPF_ALU | BPF_MOD | BPF_K, 0, 0, n };
+	code[len++] = (struct sock_filter) { BPF_RET | BPF_A, 0, 0, 0 };
+	prog.len = len;
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+	return setsockopt(shards[0].srv.listensocket, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog);
+#else
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
+#endif
+
+int rocksockserver_shards_init(rs_serverShard* shards, size_t n, const char* listenip, unsigned short port,
+                               void** userdata, int flags) {
+	size_t i;
+	int ret;
+	if(!shards || !n) return -1;
+	for(i = 0; i < n; i++) {
+		memset(&shards[i], 0, sizeof(shards[i]));
+		if((ret = rocksockserver_init_reuseport(&shards[i].srv, listenip, port, userdata ? userdata[i] : NULL))) {
+			while(i--) close(shards[i].srv.listensocket);
+			return ret;
+		}
+		shards[i].srv.worker = i;
+		shards[i].cpu = flags & RS_SF_PIN ? nth_cpu(i) : -1;
+	}
+	if(flags & RS_SF_STEER) {
+#ifdef __linux__
+		ret = steer(shards, n);
+#else
+		ret = -1;
+#endif
+		if(ret) {
+			for(i = 0; i < n; i++) close(shards[i].srv.listensocket);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* run holds lock until all threads are started, abort tells the ones
+   that were if another one couldn't be */
+struct start_gate {
+	pthread_mutex_t lock;
+	int abort;
+};
+
+static void* worker(void* arg) {
+	rs_serverShard* sh = arg;
+	struct start_gate* gate = sh->gate;
+	int abort;
+	pthread_mutex_lock(&gate->lock);
+	abort = gate->abort;
+	pthread_mutex_unlock(&gate->lock);
+	if(abort) {
+		sh->ret = -1;
+		return 0;
+	}
+#ifdef __linux__
+	if(sh->cpu != -1) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(sh->cpu, &set);
+		pthread_setaffinity_np(pthread_self(), sizeof set, &set);
+	}
+#endif
+	sh->ret = rocksockserver_loop(&sh->srv, sh->buf, sh->bufsize,
+	                              sh->on_clientconnect, sh->on_clientread,
+	                              sh->on_clientwantsdata, sh->on_clientdisconnect);
+	return 0;
+}
+
+int rocksockserver_shards_run(rs_serverShard* shards, size_t n, char* buf, size_t bufsize,
+                              rs_onClientConnect on_clientconnect,
+                              rs_onClientRead on_clientread,
+                              rs_onClientWantsData on_clientwantsdata,
+                              rs_onClientDisconnect on_clientdisconnect) {
+	struct start_gate gate = {.lock = PTHREAD_MUTEX_INITIALIZER};
+	size_t i, started;
+	int ret = 0;
+	pthread_mutex_lock(&gate.lock);
+	for(started = 0; started < n; started++) {
+		rs_serverShard* sh = &shards[started];
+		sh->gate = &gate;
+		sh->buf = buf ? buf + started * bufsize : NULL;
+		sh->bufsize = bufsize;
+		sh->on_clientconnect = on_clientconnect;
+		sh->on_clientread = on_clientread;
+		sh->on_clientwantsdata = on_clientwantsdata;
+		sh->on_clientdisconnect = on_clientdisconnect;
+		if(pthread_create(&sh->thread, NULL, worker, sh)) {
+			ret = -1;
+			gate.abort = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&gate.lock);
+	for(i = 0; i < started; i++) {
+		pthread_join(shards[i].thread, NULL);
+		if(!ret) ret = shards[i].ret;
+	}
+	return ret;
+}
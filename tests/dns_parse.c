@@ -0,0 +1,155 @@
+/*
+ * feeds canned and truncated replies to the reply parser of the stub
+ * resolver. the nameservers are closed loopback ports, so the query a
+ * SERVFAIL makes it retry goes nowhere.
+ *
+ * author: rofl0r
+ * License: LGPL 2.1+ with static linking exception
+ */
+
+#include "../rocksock_dns.c"
+#include <stdio.h>
+
+#define HOST "www.example.com"
+#define ID 0x4242
+
+static rs_dnsConfig conf;
+static rs_dnsBatch b;
+static rs_dnsQuery q;
+static int failed;
+
+static void check(int ok, const char* what) {
+	printf("%s %s\n", ok ? "ok" : "FAIL", what);
+	if(!ok) failed = 1;
+}
+
+static void setup(void) {
+	memset(&q, 0, sizeof q);
+	q.host = HOST;
+	q.pending = P_A | P_AAAA;
+	b.conf = &conf;
+	b.queries = &q;
+	b.count = b.pending = 1;
+	b.fds[0] = b.fds[1] = -1;
+	b.idbase = ID;
+}
+
+/* size of the header and question of a reply */
+static size_t qlen(void) {
+	unsigned char name[256];
+	return 12 + encode_name(HOST, name) + 4;
+}
+
+#define CNAME_LEN (2 + 10 + 6)
+#define A_LEN (2 + 10 + 4)
+
+/* a reply with rcode and n records of type qtype, the A ones preceded
+   by a CNAME. the record names point to the question. */
+static size_t reply(unsigned char* pkt, int qtype, int rcode, int n) {
+	size_t off, rdlen = qtype == T_A ? 4 : 16;
+	int i;
+	memset(pkt, 0, 12);
+	pkt[0] = ID >> 8;
+	pkt[1] = ID & 0xff;
+	pkt[2] = 0x81;
+	pkt[3] = 0x80 | rcode;
+	pkt[5] = 1;
+	pkt[7] = n + (n && qtype == T_A);
+	off = 12 + encode_name(HOST, pkt + 12);
+	pkt[off++] = 0; pkt[off++] = qtype; pkt[off++] = 0; pkt[off++] = 1;
+	if(n && qtype == T_A) {
+		static const unsigned char cname[] = {
+			0xc0, 12, 0, 5, 0, 1, 0, 0, 0, 60, 0, 6, 3, 'w', 'e', 'b', 0xc0, 16 };
+		memcpy(pkt + off, cname, sizeof cname);
+		off += sizeof cname;
+	}
+	for(i = 0; i < n; i++) {
+		pkt[off++] = 0xc0; pkt[off++] = 12;
+		pkt[off++] = 0; pkt[off++] = qtype; pkt[off++] = 0; pkt[off++] = 1;
+		pkt[off++] = 0; pkt[off++] = 0; pkt[off++] = 0; pkt[off++] = 60;
+		pkt[off++] = 0; pkt[off++] = rdlen;
+		memset(pkt + off, i + 1, rdlen);
+		off += rdlen;
+	}
+	return off;
+}
+
+/* passes a copy of the first len bytes, so reading past them is caught
+   by valgrind or asan */
+static int feed(const unsigned char* pkt, size_t len, int server) {
+	unsigned char *copy = malloc(len ? len : 1);
+	int ret;
+	memcpy(copy, pkt, len);
+	ret = process_reply(&b, copy, len, &conf.servers[server]);
+	free(copy);
+	return ret;
+}
+
+int main(void) {
+	unsigned char pkt[512];
+	size_t len, i, full;
+	int ok;
+
+	conf.nservers = 2;
+	conf.attempts = 1;
+	conf.timeout = 1000;
+	parse_addr("127.0.0.1", 1, &conf.servers[0]);
+	parse_addr("127.0.0.1", 2, &conf.servers[1]);
+
+	setup();
+	feed(pkt, reply(pkt, T_A, 0, 2), 0);
+	feed(pkt, reply(pkt, T_AAAA, 0, 1), 0);
+	check(!q.pending && !b.pending && !q.error && q.errortype == RS_ET_OWN && q.naddrs == 3 &&
+	      q.addrs[0].sa.sa_family == AF_INET6 && q.addrs[1].sa.sa_family == AF_INET &&
+	      q.addrs[2].sa.sa_family == AF_INET && q.addrs[2].v4.sin_addr.s_addr == 0x02020202,
+	      "answers, interleaved");
+
+	full = reply(pkt, T_A, 0, 2);
+	for(ok = 1, len = 0; len < full; len++) {
+		size_t complete = 0;
+		setup();
+		feed(pkt, len, 0);
+		for(i = 1; i <= 2; i++)
+			complete += qlen() + CNAME_LEN + i * A_LEN <= len;
+		if(len < qlen()) ok &= q.pending == (P_A | P_AAAA);
+		else ok &= q.pending == P_AAAA && q.n4 == (int) complete;
+	}
+	check(ok, "truncated replies");
+
+	setup();
+	len = reply(pkt, T_A, 0, 2);
+	pkt[1]++;
+	feed(pkt, len, 0);
+	pkt[1]--;
+	feed(pkt, len, 1);
+	pkt[2] &= ~0x80;
+	feed(pkt, len, 0);
+	pkt[2] |= 0x80;
+	pkt[13] = 'x';
+	feed(pkt, len, 0);
+	check(q.pending == (P_A | P_AAAA) && !q.n4, "id, server, qr bit and name checked");
+
+	setup();
+	feed(pkt, reply(pkt, T_A, 3, 0), 0);
+	feed(pkt, reply(pkt, T_AAAA, 3, 0), 0);
+	check(!q.pending && q.error == RS_E_DNS_NOT_FOUND && q.errortype == RS_ET_OWN, "nxdomain");
+
+	setup();
+	feed(pkt, reply(pkt, T_A, 3, 0), 0);
+	feed(pkt, reply(pkt, T_AAAA, 0, 1), 0);
+	check(!q.pending && !q.error && q.naddrs == 1, "nxdomain for one family only");
+
+	setup();
+	ok = !feed(pkt, reply(pkt, T_A, 2, 0), 0);
+	ok &= q.tries == 1 && q.pending == (P_A | P_AAAA) && b.fds[0] != -1;
+	/* the old server's answer is stale now */
+	feed(pkt, reply(pkt, T_AAAA, 0, 1), 0);
+	ok &= q.pending == (P_A | P_AAAA);
+	check(ok, "servfail tries the next server");
+	feed(pkt, reply(pkt, T_A, 2, 0), 1);
+	feed(pkt, reply(pkt, T_AAAA, 3, 0), 1);
+	check(!q.pending && q.error == RS_E_DNS_FAILURE, "servfail from every server");
+	rocksock_dns_batch_close(&b);
+
+	return failed;
+}